@@ -0,0 +1,472 @@
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <spdlog/spdlog.h>
+
+#include "argparse.hpp"
+#include "core_impl.hpp"
+#include "tuntap/memory_device.hpp"
+#include "tuntap/pcap_device.hpp"
+#include "tuntap/socketpair_device.hpp"
+
+using namespace tun2socks;
+
+namespace {
+
+// Echoes every datagram back to its sender, the upstream end of the load.
+class udp_echo_server {
+public:
+    explicit udp_echo_server(uint16_t port = 0)
+        : socket_(ioc_, boost::asio::ip::udp::endpoint(boost::asio::ip::address_v4::loopback(), port))
+    {
+        socket_.set_option(boost::asio::socket_base::receive_buffer_size(4 * 1024 * 1024));
+        receive();
+        thread_ = std::thread([this]() { ioc_.run(); });
+    }
+    ~udp_echo_server()
+    {
+        ioc_.stop();
+        thread_.join();
+    }
+
+    uint16_t port() const
+    {
+        return socket_.local_endpoint().port();
+    }
+
+private:
+    void receive()
+    {
+        socket_.async_receive_from(boost::asio::buffer(buffer_), from_, [this](const boost::system::error_code& ec, std::size_t bytes) {
+            if (ec)
+                return;
+            boost::system::error_code send_ec;
+            socket_.send_to(boost::asio::buffer(buffer_.data(), bytes), from_, 0, send_ec);
+            receive();
+        });
+    }
+
+private:
+    boost::asio::io_context        ioc_;
+    boost::asio::ip::udp::socket   socket_;
+    boost::asio::ip::udp::endpoint from_;
+    std::array<uint8_t, 65536>     buffer_;
+    std::thread                    thread_;
+};
+
+// UDP echo requests from a number of flows. Only window packets are in flight,
+// every reply releases the next one.
+class udp_echo_load {
+public:
+    struct options
+    {
+        std::size_t packets = 100000;
+        std::size_t flows   = 16;
+        std::size_t size    = 64;
+        std::size_t window  = 256;
+    };
+
+public:
+    udp_echo_load(const options& op, uint16_t port)
+        : op_(op),
+          port_(port)
+    {
+    }
+
+    // Empty once every packet was handed out.
+    std::vector<uint8_t> next()
+    {
+        auto n = sent_.fetch_add(1, std::memory_order_relaxed);
+        if (n >= op_.packets)
+            return {};
+        return make_packet(n % op_.flows);
+    }
+    std::size_t window() const
+    {
+        return std::min(op_.window, op_.packets);
+    }
+    void on_reply()
+    {
+        if (received_.fetch_add(1, std::memory_order_relaxed) + 1 == op_.packets)
+            done_.notify_all();
+    }
+
+    // Returns once every reply arrived, or every request was sent and no
+    // reply came for idle. UDP may drop requests, when replies stall the
+    // window is refilled through send so losses don't shrink it.
+    template <typename Send>
+    void run(Send&& send, std::chrono::steady_clock::duration idle)
+    {
+        start_ = std::chrono::steady_clock::now();
+        for (std::size_t i = 0; i < window(); ++i)
+            send(next());
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (auto last = received_.load();;) {
+            if (done_.wait_for(lock, idle, [&] { return received_ == op_.packets; })) {
+                end_ = std::chrono::steady_clock::now();
+                break;
+            }
+            auto now = received_.load();
+            if (now != last) {
+                last = now;
+                continue;
+            }
+            if (sent_ >= op_.packets) {
+                end_ = std::chrono::steady_clock::now() - idle;
+                break;
+            }
+            for (std::size_t i = 0; i < window(); ++i) {
+                if (auto p = next(); !p.empty())
+                    send(std::move(p));
+            }
+        }
+    }
+    void report(const char* device) const
+    {
+        auto elapsed = std::chrono::duration<double>(end_ - start_).count();
+        std::cout << device << ": " << received_ << "/" << op_.packets << " echoed in " << elapsed << "s, "
+                  << (elapsed > 0 ? received_ / elapsed : 0.0) << " packets/s" << std::endl;
+    }
+    // Whether anything made it through the core and back.
+    bool echoed() const
+    {
+        return received_ != 0;
+    }
+
+private:
+    // 10.1.2.2:(10000 + flow) -> 127.0.0.1:port
+    std::vector<uint8_t> make_packet(std::size_t flow) const
+    {
+        std::vector<uint8_t> p(28);
+        p.resize(28 + op_.size, 0x5a);
+
+        auto put16 = [&](std::size_t off, uint16_t v) {
+            p[off]     = uint8_t(v >> 8);
+            p[off + 1] = uint8_t(v);
+        };
+        p[0] = 0x45;
+        put16(2, uint16_t(p.size()));
+        put16(6, 0x4000);
+        p[8] = 64;
+        p[9] = IP_PROTO_UDP;
+        std::memcpy(&p[12], "\x0a\x01\x02\x02", 4);
+        std::memcpy(&p[16], "\x7f\x00\x00\x01", 4);
+        put16(10, lwip_htons(inet_chksum(p.data(), 20)));
+
+        put16(20, uint16_t(10000 + flow));
+        put16(22, port_);
+        put16(24, uint16_t(8 + op_.size));
+        put16(26, 0);
+
+        std::vector<uint8_t> pseudo(12 + 8 + op_.size);
+        std::memcpy(&pseudo[0], &p[12], 8);
+        pseudo[9]  = IP_PROTO_UDP;
+        pseudo[10] = p[24];
+        pseudo[11] = p[25];
+        std::memcpy(&pseudo[12], &p[20], 8 + op_.size);
+        auto sum = lwip_htons(inet_chksum(pseudo.data(), uint16_t(pseudo.size())));
+        put16(26, sum ? sum : 0xffff);
+        return p;
+    }
+
+private:
+    options                               op_;
+    uint16_t                              port_;
+    std::atomic<std::size_t>              sent_{0};
+    std::atomic<std::size_t>              received_{0};
+    std::mutex                            mutex_;
+    std::condition_variable               done_;
+    std::chrono::steady_clock::time_point start_;
+    std::chrono::steady_clock::time_point end_;
+};
+
+constexpr auto idle_timeout = std::chrono::milliseconds(200);
+
+template <typename Device>
+using bench_core = basic_core_impl<tuntap::basic_tuntap<Device>>;
+
+template <typename Device>
+bool start_core(bench_core<Device>& core, const parameter::tun_device& tun_param)
+{
+    core.proxy_policy().set_default_direct(true);
+    return core.start(tun_param, parameter::socks5_server());
+}
+
+// Packets are injected into the device queue and the core's output is
+// consumed by a callback, nothing leaves the process but the upstream socket.
+bool run_memory(const parameter::tun_device& tun_param, const udp_echo_load::options& op)
+{
+    udp_echo_server server;
+    udp_echo_load   load(op, server.port());
+
+    bench_core<tuntap::memory_device> core;
+    auto&                             device = core.tuntap().device();
+    device.set_output_function([&](boost::asio::const_buffer) {
+        load.on_reply();
+        if (auto p = load.next(); !p.empty())
+            device.inject(std::move(p));
+    });
+    if (!start_core(core, tun_param))
+        return false;
+
+    load.run([&](std::vector<uint8_t> p) { device.inject(std::move(p)); }, idle_timeout);
+    load.report("memory");
+
+    core.stop();
+    return load.echoed();
+}
+
+struct pcap_options
+{
+    std::string replay;
+    std::string record;
+    bool        original_timing = false;
+    uint16_t    echo_port       = 0;
+};
+
+// A LINKTYPE_RAW capture of the whole load, 10us apart.
+bool write_capture(const std::string& path, udp_echo_load& load)
+{
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file)
+        return false;
+
+    auto put32 = [&](uint32_t v) {
+        file.write(reinterpret_cast<const char*>(&v), sizeof(v));
+    };
+    put32(0xa1b2c3d4);
+    put32(2 | (4 << 16));
+    put32(0);
+    put32(0);
+    put32(0xffff);
+    put32(101);
+
+    uint64_t us = 0;
+    for (auto p = load.next(); !p.empty(); p = load.next(), us += 10) {
+        put32(uint32_t(us / 1000000));
+        put32(uint32_t(us % 1000000));
+        put32(uint32_t(p.size()));
+        put32(uint32_t(p.size()));
+        file.write(reinterpret_cast<const char*>(p.data()), p.size());
+    }
+    return bool(file);
+}
+
+// The device is only touched from the core's thread.
+template <typename F>
+auto on_device_thread(tuntap::pcap_device& device, F&& f)
+{
+    std::promise<decltype(f())> result;
+    boost::asio::post(device.get_io_context(), [&]() {
+        result.set_value(f());
+    });
+    return result.get_future().get();
+}
+
+// Replays a capture into the core and records what it writes back. Without a
+// capture to replay the echo load is written to one first.
+bool run_pcap(const parameter::tun_device&   tun_param,
+              const udp_echo_load::options& op,
+              const pcap_options&           pcap)
+{
+    udp_echo_server server(pcap.echo_port);
+
+    auto replay = pcap.replay;
+    if (!replay.empty() && !std::filesystem::exists(replay)) {
+        std::cout << "No such capture: " << replay << std::endl;
+        return false;
+    }
+    if (replay.empty()) {
+        replay = (std::filesystem::temp_directory_path() / "tun2socks_bench.pcap").string();
+
+        udp_echo_load load(op, server.port());
+        if (!write_capture(replay, load)) {
+            std::cout << "Failed to write " << replay << std::endl;
+            return false;
+        }
+    }
+
+    bench_core<tuntap::pcap_device> core;
+    auto&                           device = core.tuntap().device();
+    device.set_replay_file(replay, pcap.original_timing ? tuntap::pcap_device::timing::original : tuntap::pcap_device::timing::line_rate);
+    device.set_record_file(pcap.record);
+    if (!start_core(core, tun_param))
+        return false;
+
+    // Replies keep coming after the last packet was read, the run ends once
+    // the replay is over and the output was quiet for the idle timeout.
+    tuntap::pcap_device::statistics stats;
+    for (;;) {
+        std::this_thread::sleep_for(idle_timeout);
+
+        auto now = on_device_thread(device, [&]() {
+            return device.stats();
+        });
+        bool replayed = now.replay_end != std::chrono::steady_clock::time_point{} || now.packets_in == 0;
+        bool quiet    = now.packets_out == stats.packets_out;
+        stats         = now;
+        if (replayed && quiet)
+            break;
+    }
+    core.stop();
+
+    auto elapsed = std::chrono::duration<double>(stats.replay_end - stats.replay_start).count();
+    std::cout << "pcap: " << stats.packets_in << " packets replayed in " << elapsed << "s, "
+              << (elapsed > 0 ? stats.packets_in / elapsed : 0.0) << " packets/s, "
+              << stats.packets_out << " written back" << std::endl;
+    return stats.packets_out != 0;
+}
+
+#ifndef OS_WINDOWS
+// Same load through the peer end of a socketpair, adds one syscall per packet
+// in each direction like a TUN fd would.
+bool run_socketpair(const parameter::tun_device& tun_param, const udp_echo_load::options& op)
+{
+    udp_echo_server server;
+    udp_echo_load   load(op, server.port());
+
+    bench_core<tuntap::socketpair_device> core;
+    if (!start_core(core, tun_param))
+        return false;
+
+    int  peer  = core.tuntap().device().peer_handle();
+    auto write = [peer](const std::vector<uint8_t>& p) {
+        ::send(peer, p.data(), p.size(), 0);
+    };
+    std::atomic<bool> stop{false};
+    std::thread       reader([&]() {
+        std::vector<uint8_t> buffer(65536);
+        while (!stop) {
+            auto bytes = ::recv(peer, buffer.data(), buffer.size(), 0);
+            if (bytes <= 0)
+                break;
+            load.on_reply();
+            if (auto p = load.next(); !p.empty())
+                write(p);
+        }
+    });
+
+    load.run(write, idle_timeout);
+    load.report("socketpair");
+
+    stop = true;
+    ::shutdown(peer, SHUT_RDWR);
+    reader.join();
+    core.stop();
+    return load.echoed();
+}
+#endif
+
+}  // namespace
+
+int main(int argc, char** argv)
+{
+    argparse::ArgumentParser program("tun2socks_bench");
+
+    program.add_argument("device")
+        .help("The packet device the core runs on: memory, socketpair or pcap.");
+
+    program.add_argument("-n", "--packets")
+        .help("The number of UDP echo requests. Default( 100000 )")
+        .default_value(100000)
+        .action([](const std::string& n) { return std::stoi(n); });
+
+    program.add_argument("--flows")
+        .help("The number of UDP flows the requests are spread over. Default( 16 )")
+        .default_value(16)
+        .action([](const std::string& n) { return std::stoi(n); });
+
+    program.add_argument("--size")
+        .help("The UDP payload size in bytes. Default( 64 )")
+        .default_value(64)
+        .action([](const std::string& n) { return std::stoi(n); });
+
+    program.add_argument("--window")
+        .help("The number of requests in flight. Default( 256 )")
+        .default_value(256)
+        .action([](const std::string& n) { return std::stoi(n); });
+
+    program.add_argument("--verify-checksum")
+        .help("Have lwIP verify the checksums of packets read from the device.")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("-ts", "--stacks")
+        .help("The number of lwIP stacks. Default( 1 )")
+        .default_value(1)
+        .action([](const std::string& stacks) { return std::stoi(stacks); });
+
+    program.add_argument("--replay")
+        .help("pcap: The capture to replay, by default one of the UDP echo load is written.")
+        .default_value(std::string());
+
+    program.add_argument("--record")
+        .help("pcap: Where the packets written by the core are recorded.")
+        .default_value(std::string());
+
+    program.add_argument("--original-timing")
+        .help("pcap: Keep the gaps between packets of the capture.")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("--echo-port")
+        .help("pcap: The loopback port of the UDP echo server a replayed capture talks to. Default( any )")
+        .default_value(0)
+        .action([](const std::string& port) { return std::stoi(port); });
+
+    parameter::tun_device  tun_param;
+    udp_echo_load::options op;
+    pcap_options           pcap;
+    std::string            device;
+    try {
+        program.parse_args(argc, argv);
+
+        device           = program.get<std::string>("device");
+        op.packets       = program.get<int>("-n");
+        op.flows         = std::max(1, program.get<int>("--flows"));
+        op.size          = program.get<int>("--size");
+        op.window        = std::max(1, program.get<int>("--window"));
+        tun_param.stacks          = program.get<int>("-ts");
+        tun_param.verify_checksum = program.get<bool>("--verify-checksum");
+
+        pcap.replay          = program.get<std::string>("--replay");
+        pcap.record          = program.get<std::string>("--record");
+        pcap.original_timing = program.get<bool>("--original-timing");
+        pcap.echo_port       = uint16_t(program.get<int>("--echo-port"));
+    }
+    catch (const std::exception& err) {
+        std::cout << err.what() << std::endl;
+        std::cout << program;
+        return -1;
+    }
+    // Per connection logging would dominate the measurement.
+    spdlog::set_level(spdlog::level::err);
+
+    bool ok = false;
+    if (device == "memory")
+        ok = run_memory(tun_param, op);
+    else if (device == "pcap")
+        ok = run_pcap(tun_param, op, pcap);
+#ifndef OS_WINDOWS
+    else if (device == "socketpair")
+        ok = run_socketpair(tun_param, op);
+#endif
+    else {
+        std::cout << "Unknown device: " << device << std::endl;
+        std::cout << program;
+        return -1;
+    }
+    return ok ? 0 : 1;
+}
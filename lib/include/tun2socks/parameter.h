@@ -15,6 +15,12 @@ namespace parameter {
         std::string            tun_name;
         std::optional<address> ipv4;
         std::optional<address> ipv6;
+        uint16_t               mtu                   = 1500;
+        uint16_t               queues                = 1;
+        uint16_t               stacks                = 1;
+        bool                   offload               = false;
+        bool                   verify_checksum       = false;
+        bool                   connect_before_accept = false;
     };
 
     struct socks5_server
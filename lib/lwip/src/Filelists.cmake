@@ -53,6 +53,7 @@ set(lwipcore_SRCS
     ${LWIP_DIR}/src/core/timeouts.c
     ${LWIP_DIR}/src/core/udp.c
     ${LWIP_DIR}/src/core/sys_arch.cpp
+    ${LWIP_DIR}/src/core/inet_chksum_arch.cpp
 )
 set(lwipcore4_SRCS
     ${LWIP_DIR}/src/core/ipv4/autoip.c
@@ -0,0 +1,222 @@
+/*
+	Internet checksum kernels for LWIP_CHKSUM and LWIP_CHKSUM_COPY.
+
+	The one's complement sum does not depend on the word size, so the data
+	is added as 16 bit halves of 32 bit lanes and only folded at the end.
+	The widest kernel the CPU supports is picked once at startup.
+*/
+#include "lwip/opt.h"
+#include "arch/sys_arch.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#    define CHKSUM_X86 1
+#    include <immintrin.h>
+#    if defined(_MSC_VER) && !defined(__clang__)
+#        include <intrin.h>
+#        define CHKSUM_TARGET(isa)
+#    else
+#        define CHKSUM_TARGET(isa) __attribute__((target(isa)))
+#    endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#    define CHKSUM_NEON 1
+#    include <arm_neon.h>
+#endif
+
+namespace {
+
+using chksum_kernel = std::uint64_t (*)(std::uint8_t* dst, const std::uint8_t* src, std::size_t len);
+
+std::uint16_t chksum_fold(std::uint64_t sum)
+{
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return static_cast<std::uint16_t>(sum);
+}
+
+// Words are loaded in host order like lwip_standard_chksum does, an odd
+// trailing byte is padded with zero.
+template <bool Copy>
+std::uint64_t chksum_scalar(std::uint8_t* dst, const std::uint8_t* src, std::size_t len)
+{
+    std::uint64_t sum = 0;
+    std::size_t   i   = 0;
+    for (; i + 4 <= len; i += 4) {
+        std::uint32_t v;
+        std::memcpy(&v, src + i, 4);
+        if constexpr (Copy)
+            std::memcpy(dst + i, &v, 4);
+        sum += v;
+    }
+    for (; i + 2 <= len; i += 2) {
+        std::uint16_t v;
+        std::memcpy(&v, src + i, 2);
+        if constexpr (Copy)
+            std::memcpy(dst + i, &v, 2);
+        sum += v;
+    }
+    if (i < len) {
+        std::uint16_t v = 0;
+        std::memcpy(&v, src + i, 1);
+        if constexpr (Copy)
+            dst[i] = src[i];
+        sum += v;
+    }
+    return sum;
+}
+
+// A 32 bit lane grows by at most 2 * 0xffff per step.
+constexpr std::size_t chksum_lane_steps = 32768;
+
+#if CHKSUM_X86
+template <bool Copy>
+CHKSUM_TARGET("avx2")
+std::uint64_t chksum_avx2(std::uint8_t* dst, const std::uint8_t* src, std::size_t len)
+{
+    const __m256i low = _mm256_set1_epi32(0xffff);
+
+    std::uint64_t sum = 0;
+    std::size_t   i   = 0;
+    while (len - i >= 32) {
+        auto    end = i + std::min((len - i) / 32, chksum_lane_steps) * 32;
+        __m256i acc = _mm256_setzero_si256();
+        for (; i < end; i += 32) {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+            if constexpr (Copy)
+                _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), v);
+            acc = _mm256_add_epi32(acc, _mm256_and_si256(v, low));
+            acc = _mm256_add_epi32(acc, _mm256_srli_epi32(v, 16));
+        }
+        __m128i half = _mm_add_epi64(_mm_unpacklo_epi32(_mm256_castsi256_si128(acc), _mm_setzero_si128()),
+                                     _mm_unpackhi_epi32(_mm256_castsi256_si128(acc), _mm_setzero_si128()));
+        __m128i top  = _mm256_extracti128_si256(acc, 1);
+        half         = _mm_add_epi64(half, _mm_unpacklo_epi32(top, _mm_setzero_si128()));
+        half         = _mm_add_epi64(half, _mm_unpackhi_epi32(top, _mm_setzero_si128()));
+        std::uint64_t lanes[2];
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), half);
+        sum += lanes[0] + lanes[1];
+    }
+    return sum + chksum_scalar<Copy>(Copy ? dst + i : nullptr, src + i, len - i);
+}
+
+template <bool Copy>
+CHKSUM_TARGET("sse2")
+std::uint64_t chksum_sse2(std::uint8_t* dst, const std::uint8_t* src, std::size_t len)
+{
+    const __m128i low = _mm_set1_epi32(0xffff);
+
+    std::uint64_t sum = 0;
+    std::size_t   i   = 0;
+    while (len - i >= 16) {
+        auto    end = i + std::min((len - i) / 16, chksum_lane_steps) * 16;
+        __m128i acc = _mm_setzero_si128();
+        for (; i < end; i += 16) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+            if constexpr (Copy)
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), v);
+            acc = _mm_add_epi32(acc, _mm_and_si128(v, low));
+            acc = _mm_add_epi32(acc, _mm_srli_epi32(v, 16));
+        }
+        __m128i wide = _mm_add_epi64(_mm_unpacklo_epi32(acc, _mm_setzero_si128()),
+                                     _mm_unpackhi_epi32(acc, _mm_setzero_si128()));
+        std::uint64_t lanes[2];
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), wide);
+        sum += lanes[0] + lanes[1];
+    }
+    return sum + chksum_scalar<Copy>(Copy ? dst + i : nullptr, src + i, len - i);
+}
+
+bool chksum_has_avx2()
+{
+#    if defined(_MSC_VER) && !defined(__clang__)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7)
+        return false;
+    __cpuid(info, 1);
+    // The OS has to save the YMM registers as well.
+    if (!(info[2] & (1 << 27)) || !(info[2] & (1 << 28)) || (_xgetbv(0) & 6) != 6)
+        return false;
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#    else
+    return __builtin_cpu_supports("avx2");
+#    endif
+}
+
+bool chksum_has_sse2()
+{
+#    if defined(__x86_64__) || defined(_M_X64)
+    return true;
+#    elif defined(_MSC_VER) && !defined(__clang__)
+    int info[4];
+    __cpuid(info, 1);
+    return (info[3] & (1 << 26)) != 0;
+#    else
+    return __builtin_cpu_supports("sse2");
+#    endif
+}
+#endif
+
+#if CHKSUM_NEON
+template <bool Copy>
+std::uint64_t chksum_neon(std::uint8_t* dst, const std::uint8_t* src, std::size_t len)
+{
+    std::uint64_t sum = 0;
+    std::size_t   i   = 0;
+    while (len - i >= 16) {
+        auto       end = i + std::min((len - i) / 16, chksum_lane_steps) * 16;
+        uint32x4_t acc = vdupq_n_u32(0);
+        for (; i < end; i += 16) {
+            uint8x16_t v = vld1q_u8(src + i);
+            if constexpr (Copy)
+                vst1q_u8(dst + i, v);
+            acc = vpadalq_u16(acc, vreinterpretq_u16_u8(v));
+        }
+        uint64x2_t wide = vpaddlq_u32(acc);
+        sum += vgetq_lane_u64(wide, 0) + vgetq_lane_u64(wide, 1);
+    }
+    return sum + chksum_scalar<Copy>(Copy ? dst + i : nullptr, src + i, len - i);
+}
+#endif
+
+struct chksum_kernels
+{
+    chksum_kernel sum;
+    chksum_kernel copy;
+};
+
+chksum_kernels chksum_select()
+{
+#if CHKSUM_X86
+    if (chksum_has_avx2())
+        return {chksum_avx2<false>, chksum_avx2<true>};
+    if (chksum_has_sse2())
+        return {chksum_sse2<false>, chksum_sse2<true>};
+#elif CHKSUM_NEON
+    return {chksum_neon<false>, chksum_neon<true>};
+#endif
+    return {chksum_scalar<false>, chksum_scalar<true>};
+}
+
+const chksum_kernels chksum = chksum_select();
+
+}  // namespace
+
+uint16_t sys_arch_chksum(const void* dataptr, int len)
+{
+    if (len <= 0)
+        return 0;
+    return chksum_fold(chksum.sum(nullptr, static_cast<const std::uint8_t*>(dataptr), static_cast<std::size_t>(len)));
+}
+
+uint16_t sys_arch_chksum_copy(void* dst, const void* src, uint16_t len)
+{
+    return chksum_fold(chksum.copy(static_cast<std::uint8_t*>(dst), static_cast<const std::uint8_t*>(src), len));
+}
@@ -61,7 +61,10 @@
 #include "lwip/ip.h"
 
 /** Global data for both IPv4 and IPv6 */
-struct ip_globals ip_data;
+/*
+	15. tun2socks: one stack per worker thread, see LWIP_THREAD_LOCAL in arch/cc.h.
+*/
+LWIP_THREAD_LOCAL struct ip_globals ip_data;
 
 #if LWIP_IPV4 && LWIP_IPV6
 
@@ -104,11 +104,18 @@
 #endif /* LWIP_DHCP */
 
 /** The IP header ID of the next outgoing IP packet */
-static u16_t ip_id;
+/*
+	15. tun2socks: one stack per worker thread, see LWIP_THREAD_LOCAL in arch/cc.h.
+*/
+/*
+	31. tun2socks: not static, packets built outside of ip4_output_if take their
+	ID from here too. See ip4.h.
+*/
+LWIP_THREAD_LOCAL u16_t ip_id;
 
 #if LWIP_MULTICAST_TX_OPTIONS
 /** The default netif used for multicast */
-static struct netif *ip4_default_multicast_netif;
+static LWIP_THREAD_LOCAL struct netif *ip4_default_multicast_netif;
 
 /**
  * @ingroup ip4
@@ -56,19 +56,11 @@
  * The IP reassembly code currently has the following limitations:
  * - IP header options are not supported
  * - fragments must not overlap (e.g. due to different routes),
- *   currently, overlapping or duplicate fragments are thrown away
- *   if IP_REASS_CHECK_OVERLAP=1 (the default)!
+ *   overlapping or duplicate fragments are thrown away!
  *
  * @todo: work with IP header options
  */
 
-/** Setting this to 0, you can turn off checking the fragments for overlapping
- * regions. The code gets a little smaller. Only use this if you know that
- * overlapping won't occur on your network! */
-#ifndef IP_REASS_CHECK_OVERLAP
-#define IP_REASS_CHECK_OVERLAP 1
-#endif /* IP_REASS_CHECK_OVERLAP */
-
 /** Set to 0 to prevent freeing the oldest datagram when the reassembly buffer is
  * full (IP_REASS_MAX_PBUFS pbufs are enqueued). The code gets a little smaller.
  * Datagrams will be freed by timeout only. Especially useful when MEMP_NUM_REASSDATA
@@ -77,6 +69,10 @@
 #define IP_REASS_FREE_OLDEST 1
 #endif /* IP_REASS_FREE_OLDEST */
 
+#if (IP_REASS_HASH_SIZE & (IP_REASS_HASH_SIZE - 1)) != 0
+#error "IP_REASS_HASH_SIZE must be a power of two"
+#endif
+
 #define IP_REASS_FLAG_LASTFRAG 0x01
 
 #define IP_REASS_VALIDATE_TELEGRAM_FINISHED  1
@@ -110,13 +106,55 @@ PACK_STRUCT_END
    ip4_addr_cmp(&(iphdrA)->dest, &(iphdrB)->dest) && \
    IPH_ID(iphdrA) == IPH_ID(iphdrB)) ? 1 : 0
 
+#define IP_REASS_HELPER(p) ((struct ip_reass_helper *)(p)->payload)
+
 /* global variables */
-static struct ip_reassdata *reassdatagrams;
-static u16_t ip_reass_pbufcount;
+/*
+	15. tun2socks: one stack per worker thread, see LWIP_THREAD_LOCAL in arch/cc.h.
+*/
+/*
+	23. tun2socks: datagrams are chained into ip_reass_hash by addresses and id,
+	and into an age list, oldest first, for the timer and for eviction. The
+	pbufs queued per source and destination pair are counted in
+	ip_reass_peer_pbufs. Fragments never overlap, so a datagram is complete
+	once its last fragment arrived and recv_len reached its length.
+*/
+static LWIP_THREAD_LOCAL struct ip_reassdata *ip_reass_hash[IP_REASS_HASH_SIZE];
+static LWIP_THREAD_LOCAL struct ip_reassdata *ip_reass_oldest;
+static LWIP_THREAD_LOCAL struct ip_reassdata *ip_reass_newest;
+static LWIP_THREAD_LOCAL u16_t ip_reass_peer_pbufs[IP_REASS_HASH_SIZE];
+static LWIP_THREAD_LOCAL u16_t ip_reass_pbufcount;
 
 /* function prototypes */
-static void ip_reass_dequeue_datagram(struct ip_reassdata *ipr, struct ip_reassdata *prev);
-static int ip_reass_free_complete_datagram(struct ip_reassdata *ipr, struct ip_reassdata *prev);
+static void ip_reass_dequeue_datagram(struct ip_reassdata *ipr);
+static int ip_reass_free_complete_datagram(struct ip_reassdata *ipr);
+
+static u32_t
+ip_reass_mix(u32_t h)
+{
+  /* finalizer of murmur3 */
+  h ^= h >> 16;
+  h *= 0x85ebca6bU;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35U;
+  h ^= h >> 16;
+  return h;
+}
+
+static u32_t
+ip_reass_peer_index(const struct ip_hdr *iphdr)
+{
+  u32_t h = ip4_addr_get_u32(&iphdr->src) * 0x9e3779b1U ^ ip4_addr_get_u32(&iphdr->dest);
+  return ip_reass_mix(h) & (IP_REASS_HASH_SIZE - 1);
+}
+
+static u32_t
+ip_reass_hash_index(const struct ip_hdr *iphdr)
+{
+  u32_t h = ip4_addr_get_u32(&iphdr->src) * 0x9e3779b1U ^ ip4_addr_get_u32(&iphdr->dest);
+  h = ip_reass_mix(h) ^ IPH_ID(iphdr);
+  return ip_reass_mix(h) & (IP_REASS_HASH_SIZE - 1);
+}
 
 /**
  * Reassembly timer base function
@@ -127,26 +165,24 @@ static int ip_reass_free_complete_datagram(struct ip_reassdata *ipr, struct ip_r
 void
 ip_reass_tmr(void)
 {
-  struct ip_reassdata *r, *prev = NULL;
+  struct ip_reassdata *r, *tmp;
 
-  r = reassdatagrams;
+  r = ip_reass_oldest;
   while (r != NULL) {
     /* Decrement the timer. Once it reaches 0,
      * clean up the incomplete fragment assembly */
     if (r->timer > 0) {
       r->timer--;
       LWIP_DEBUGF(IP_REASS_DEBUG, ("ip_reass_tmr: timer dec %" U16_F "\n", (u16_t)r->timer));
-      prev = r;
-      r = r->next;
+      r = r->age_next;
     } else {
       /* reassembly timed out */
-      struct ip_reassdata *tmp;
       LWIP_DEBUGF(IP_REASS_DEBUG, ("ip_reass_tmr: timer timed out\n"));
       tmp = r;
       /* get the next pointer before freeing */
-      r = r->next;
+      r = r->age_next;
       /* free the helper struct and all enqueued pbufs */
-      ip_reass_free_complete_datagram(tmp, prev);
+      ip_reass_free_complete_datagram(tmp);
     }
   }
 }
@@ -157,21 +193,18 @@ ip_reass_tmr(void)
  * SNMP counters and sends an ICMP time exceeded packet.
  *
  * @param ipr datagram to free
- * @param prev the previous datagram in the linked list
  * @return the number of pbufs freed
  */
 static int
-ip_reass_free_complete_datagram(struct ip_reassdata *ipr, struct ip_reassdata *prev)
+ip_reass_free_complete_datagram(struct ip_reassdata *ipr)
 {
   u16_t pbufs_freed = 0;
   u16_t clen;
+  u32_t peer;
   struct pbuf *p;
   struct ip_reass_helper *iprh;
 
-  LWIP_ASSERT("prev != ipr", prev != ipr);
-  if (prev != NULL) {
-    LWIP_ASSERT("prev->next == ipr", prev->next == ipr);
-  }
+  peer = ip_reass_peer_index(&ipr->iphdr);
 
   MIB2_STATS_INC(mib2.ipreasmfails);
 #if LWIP_ICMP
@@ -205,65 +238,43 @@ ip_reass_free_complete_datagram(struct ip_reassdata *ipr, struct ip_reassdata *p
     pbufs_freed = (u16_t)(pbufs_freed + clen);
     pbuf_free(pcur);
   }
-  /* Then, unchain the struct ip_reassdata from the list and free it. */
-  ip_reass_dequeue_datagram(ipr, prev);
+  /* Then, unchain the struct ip_reassdata from the lists and free it. */
+  ip_reass_dequeue_datagram(ipr);
   LWIP_ASSERT("ip_reass_pbufcount >= pbufs_freed", ip_reass_pbufcount >= pbufs_freed);
   ip_reass_pbufcount = (u16_t)(ip_reass_pbufcount - pbufs_freed);
+  ip_reass_peer_pbufs[peer] = (u16_t)(ip_reass_peer_pbufs[peer] - pbufs_freed);
 
   return pbufs_freed;
 }
 
 #if IP_REASS_FREE_OLDEST
 /**
- * Free the oldest datagram to make room for enqueueing new fragments.
+ * Free the oldest datagrams to make room for enqueueing new fragments.
  * The datagram 'fraghdr' belongs to is not freed!
  *
  * @param fraghdr IP header of the current fragment
  * @param pbufs_needed number of pbufs needed to enqueue
  *        (used for freeing other datagrams if not enough space)
+ * @param peer only free datagrams of this slot of ip_reass_peer_pbufs,
+ *        or of any slot if negative
  * @return the number of pbufs freed
  */
 static int
-ip_reass_remove_oldest_datagram(struct ip_hdr *fraghdr, int pbufs_needed)
+ip_reass_remove_oldest_datagram(struct ip_hdr *fraghdr, int pbufs_needed, s32_t peer)
 {
-  /* @todo Can't we simply remove the last datagram in the
-   *       linked list behind reassdatagrams?
-   */
-  struct ip_reassdata *r, *oldest, *prev, *oldest_prev;
-  int pbufs_freed = 0, pbufs_freed_current;
-  int other_datagrams;
-
-  /* Free datagrams until being allowed to enqueue 'pbufs_needed' pbufs,
-   * but don't free the datagram that 'fraghdr' belongs to! */
-  do {
-    oldest = NULL;
-    prev = NULL;
-    oldest_prev = NULL;
-    other_datagrams = 0;
-    r = reassdatagrams;
-    while (r != NULL) {
-      if (!IP_ADDRESSES_AND_ID_MATCH(&r->iphdr, fraghdr)) {
-        /* Not the same datagram as fraghdr */
-        other_datagrams++;
-        if (oldest == NULL) {
-          oldest = r;
-          oldest_prev = prev;
-        } else if (r->timer <= oldest->timer) {
-          /* older than the previous oldest */
-          oldest = r;
-          oldest_prev = prev;
-        }
-      }
-      if (r->next != NULL) {
-        prev = r;
-      }
-      r = r->next;
+  struct ip_reassdata *r, *next;
+  int pbufs_freed = 0;
+
+  for (r = ip_reass_oldest; (r != NULL) && (pbufs_freed < pbufs_needed); r = next) {
+    next = r->age_next;
+    if (IP_ADDRESSES_AND_ID_MATCH(&r->iphdr, fraghdr)) {
+      continue;
     }
-    if (oldest != NULL) {
-      pbufs_freed_current = ip_reass_free_complete_datagram(oldest, oldest_prev);
-      pbufs_freed += pbufs_freed_current;
+    if ((peer >= 0) && (ip_reass_peer_index(&r->iphdr) != (u32_t)peer)) {
+      continue;
     }
-  } while ((pbufs_freed < pbufs_needed) && (other_datagrams > 1));
+    pbufs_freed += ip_reass_free_complete_datagram(r);
+  }
   return pbufs_freed;
 }
 #endif /* IP_REASS_FREE_OLDEST */
@@ -278,6 +289,7 @@ static struct ip_reassdata *
 ip_reass_enqueue_new_datagram(struct ip_hdr *fraghdr, int clen)
 {
   struct ip_reassdata *ipr;
+  struct ip_reassdata **bucket;
 #if ! IP_REASS_FREE_OLDEST
   LWIP_UNUSED_ARG(clen);
 #endif
@@ -286,7 +298,7 @@ ip_reass_enqueue_new_datagram(struct ip_hdr *fraghdr, int clen)
   ipr = (struct ip_reassdata *)memp_malloc(MEMP_REASSDATA);
   if (ipr == NULL) {
 #if IP_REASS_FREE_OLDEST
-    if (ip_reass_remove_oldest_datagram(fraghdr, clen) >= clen) {
+    if (ip_reass_remove_oldest_datagram(fraghdr, clen, -1) >= clen) {
       ipr = (struct ip_reassdata *)memp_malloc(MEMP_REASSDATA);
     }
     if (ipr == NULL)
@@ -300,12 +312,23 @@ ip_reass_enqueue_new_datagram(struct ip_hdr *fraghdr, int clen)
   memset(ipr, 0, sizeof(struct ip_reassdata));
   ipr->timer = IP_REASS_MAXAGE;
 
-  /* enqueue the new structure to the front of the list */
-  ipr->next = reassdatagrams;
-  reassdatagrams = ipr;
   /* copy the ip header for later tests and input */
   /* @todo: no ip options supported? */
   SMEMCPY(&(ipr->iphdr), fraghdr, IP_HLEN);
+
+  /* enqueue the new structure to the front of its bucket */
+  bucket = &ip_reass_hash[ip_reass_hash_index(fraghdr)];
+  ipr->next = *bucket;
+  *bucket = ipr;
+
+  /* and to the end of the age list */
+  ipr->age_prev = ip_reass_newest;
+  if (ip_reass_newest != NULL) {
+    ip_reass_newest->age_next = ipr;
+  } else {
+    ip_reass_oldest = ipr;
+  }
+  ip_reass_newest = ipr;
   return ipr;
 }
 
@@ -314,16 +337,28 @@ ip_reass_enqueue_new_datagram(struct ip_hdr *fraghdr, int clen)
  * @param ipr points to the queue entry to dequeue
  */
 static void
-ip_reass_dequeue_datagram(struct ip_reassdata *ipr, struct ip_reassdata *prev)
+ip_reass_dequeue_datagram(struct ip_reassdata *ipr)
 {
-  /* dequeue the reass struct  */
-  if (reassdatagrams == ipr) {
-    /* it was the first in the list */
-    reassdatagrams = ipr->next;
+  struct ip_reassdata **link;
+
+  /* dequeue the reass struct from its bucket */
+  for (link = &ip_reass_hash[ip_reass_hash_index(&ipr->iphdr)]; *link != NULL; link = &(*link)->next) {
+    if (*link == ipr) {
+      *link = ipr->next;
+      break;
+    }
+  }
+
+  /* and from the age list */
+  if (ipr->age_prev != NULL) {
+    ipr->age_prev->age_next = ipr->age_next;
   } else {
-    /* it wasn't the first, so it must have a valid 'prev' */
-    LWIP_ASSERT("sanity check linked list", prev != NULL);
-    prev->next = ipr->next;
+    ip_reass_oldest = ipr->age_next;
+  }
+  if (ipr->age_next != NULL) {
+    ipr->age_next->age_prev = ipr->age_prev;
+  } else {
+    ip_reass_newest = ipr->age_prev;
   }
 
   /* now we can free the ip_reassdata struct */
@@ -333,8 +368,8 @@ ip_reass_dequeue_datagram(struct ip_reassdata *ipr, struct ip_reassdata *prev)
 /**
  * Chain a new pbuf into the pbuf list that composes the datagram.  The pbuf list
  * will grow over time as  new pbufs are rx.
- * Also checks that the datagram passes basic continuity checks (if the last
- * fragment was received at least once).
+ * Also checks whether the datagram is complete (if the last fragment was
+ * received at least once).
  * @param ipr points to the reassembly state
  * @param new_p points to the pbuf for the current fragment
  * @param is_last is 1 if this pbuf has MF==0 (ipr->flags not updated yet)
@@ -343,12 +378,11 @@ ip_reass_dequeue_datagram(struct ip_reassdata *ipr, struct ip_reassdata *prev)
 static int
 ip_reass_chain_frag_into_datagram_and_validate(struct ip_reassdata *ipr, struct pbuf *new_p, int is_last)
 {
-  struct ip_reass_helper *iprh, *iprh_tmp, *iprh_prev = NULL;
+  struct ip_reass_helper *iprh, *iprh_tmp = NULL, *iprh_prev = NULL;
   struct pbuf *q;
-  u16_t offset, len;
+  u16_t offset, len, datagram_len;
   u8_t hlen;
   struct ip_hdr *fraghdr;
-  int valid = 1;
 
   /* Extract length and fragment offset from current fragment */
   fraghdr = (struct ip_hdr *)new_p->payload;
@@ -375,119 +409,63 @@ ip_reass_chain_frag_into_datagram_and_validate(struct ip_reassdata *ipr, struct
     return IP_REASS_VALIDATE_PBUF_DROPPED;
   }
 
-  /* Iterate through until we either get to the end of the list (append),
-   * or we find one with a larger offset (insert). */
-  for (q = ipr->p; q != NULL;) {
-    iprh_tmp = (struct ip_reass_helper *)q->payload;
-    if (iprh->start < iprh_tmp->start) {
-      /* the new pbuf should be inserted before this */
-      iprh->next_pbuf = q;
-      if (iprh_prev != NULL) {
-        /* not the fragment with the lowest offset */
-#if IP_REASS_CHECK_OVERLAP
-        if ((iprh->start < iprh_prev->end) || (iprh->end > iprh_tmp->start)) {
-          /* fragment overlaps with previous or following, throw away */
-          return IP_REASS_VALIDATE_PBUF_DROPPED;
-        }
-#endif /* IP_REASS_CHECK_OVERLAP */
-        iprh_prev->next_pbuf = new_p;
-        if (iprh_prev->end != iprh->start) {
-          /* There is a fragment missing between the current
-           * and the previous fragment */
-          valid = 0;
-        }
-      } else {
-#if IP_REASS_CHECK_OVERLAP
-        if (iprh->end > iprh_tmp->start) {
-          /* fragment overlaps with following, throw away */
-          return IP_REASS_VALIDATE_PBUF_DROPPED;
-        }
-#endif /* IP_REASS_CHECK_OVERLAP */
-        /* fragment with the lowest offset */
-        ipr->p = new_p;
-      }
-      break;
-    } else if (iprh->start == iprh_tmp->start) {
-      /* received the same datagram twice: no need to keep the datagram */
+  /* Nothing may end behind the last fragment. */
+  if ((ipr->flags & IP_REASS_FLAG_LASTFRAG) != 0) {
+    if ((iprh->end > ipr->datagram_len) || (is_last && (iprh->end != ipr->datagram_len))) {
       return IP_REASS_VALIDATE_PBUF_DROPPED;
-#if IP_REASS_CHECK_OVERLAP
-    } else if (iprh->start < iprh_tmp->end) {
-      /* overlap: no need to keep the new datagram */
-      return IP_REASS_VALIDATE_PBUF_DROPPED;
-#endif /* IP_REASS_CHECK_OVERLAP */
-    } else {
-      /* Check if the fragments received so far have no holes. */
-      if (iprh_prev != NULL) {
-        if (iprh_prev->end != iprh_tmp->start) {
-          /* There is a fragment missing between the current
-           * and the previous fragment */
-          valid = 0;
-        }
-      }
     }
-    q = iprh_tmp->next_pbuf;
-    iprh_prev = iprh_tmp;
+  } else if (is_last && (ipr->p_last != NULL) && (IP_REASS_HELPER(ipr->p_last)->end > iprh->end)) {
+    return IP_REASS_VALIDATE_PBUF_DROPPED;
   }
 
-  /* If q is NULL, then we made it to the end of the list. Determine what to do now */
-  if (q == NULL) {
+  if (ipr->p_last == NULL) {
+    /* this is the first fragment we ever received for this ip datagram */
+    ipr->p = new_p;
+    ipr->p_last = new_p;
+  } else if (IP_REASS_HELPER(ipr->p_last)->end <= iprh->start) {
+    /* in order: chain it behind the fragment with the highest offset */
+    IP_REASS_HELPER(ipr->p_last)->next_pbuf = new_p;
+    ipr->p_last = new_p;
+  } else {
+    /* Iterate through until we find one with a larger offset (insert),
+     * or get to the end of the list (overlapping the last one). */
+    for (q = ipr->p; q != NULL; q = iprh_tmp->next_pbuf) {
+      iprh_tmp = (struct ip_reass_helper *)q->payload;
+      if (iprh->start < iprh_tmp->start) {
+        break;
+      }
+      iprh_prev = iprh_tmp;
+    }
+    if (((iprh_prev != NULL) && (iprh->start < iprh_prev->end)) ||
+        ((q != NULL) && (iprh->end > iprh_tmp->start)) ||
+        ((iprh_prev != NULL) && (iprh->start == iprh_prev->start))) {
+      /* overlaps with or duplicates a queued fragment, throw away */
+      return IP_REASS_VALIDATE_PBUF_DROPPED;
+    }
+    iprh->next_pbuf = q;
     if (iprh_prev != NULL) {
-      /* this is (for now), the fragment with the highest offset:
-       * chain it to the last fragment */
-#if IP_REASS_CHECK_OVERLAP
-      LWIP_ASSERT("check fragments don't overlap", iprh_prev->end <= iprh->start);
-#endif /* IP_REASS_CHECK_OVERLAP */
       iprh_prev->next_pbuf = new_p;
-      if (iprh_prev->end != iprh->start) {
-        valid = 0;
-      }
     } else {
-#if IP_REASS_CHECK_OVERLAP
-      LWIP_ASSERT("no previous fragment, this must be the first fragment!",
-                  ipr->p == NULL);
-#endif /* IP_REASS_CHECK_OVERLAP */
-      /* this is the first fragment we ever received for this ip datagram */
+      /* fragment with the lowest offset */
       ipr->p = new_p;
     }
+    if (q == NULL) {
+      ipr->p_last = new_p;
+    }
   }
+  ipr->recv_len = (u16_t)(ipr->recv_len + len);
 
-  /* At this point, the validation part begins: */
-  /* If we already received the last fragment */
+  /* If we already received the last fragment, check if the rest is here */
   if (is_last || ((ipr->flags & IP_REASS_FLAG_LASTFRAG) != 0)) {
-    /* and had no holes so far */
-    if (valid) {
-      /* then check if the rest of the fragments is here */
-      /* Check if the queue starts with the first datagram */
-      if ((ipr->p == NULL) || (((struct ip_reass_helper *)ipr->p->payload)->start != 0)) {
-        valid = 0;
-      } else {
-        /* and check that there are no holes after this datagram */
-        iprh_prev = iprh;
-        q = iprh->next_pbuf;
-        while (q != NULL) {
-          iprh = (struct ip_reass_helper *)q->payload;
-          if (iprh_prev->end != iprh->start) {
-            valid = 0;
-            break;
-          }
-          iprh_prev = iprh;
-          q = iprh->next_pbuf;
-        }
-        /* if still valid, all fragments are received
-         * (because to the MF==0 already arrived */
-        if (valid) {
-          LWIP_ASSERT("sanity check", ipr->p != NULL);
-          LWIP_ASSERT("sanity check",
-                      ((struct ip_reass_helper *)ipr->p->payload) != iprh);
-          LWIP_ASSERT("validate_datagram:next_pbuf!=NULL",
-                      iprh->next_pbuf == NULL);
-        }
-      }
+    datagram_len = is_last ? iprh->end : ipr->datagram_len;
+    if (ipr->recv_len == datagram_len) {
+      LWIP_ASSERT("sanity check", IP_REASS_HELPER(ipr->p)->start == 0);
+      LWIP_ASSERT("validate_datagram:next_pbuf!=NULL",
+                  IP_REASS_HELPER(ipr->p_last)->next_pbuf == NULL);
+      return IP_REASS_VALIDATE_TELEGRAM_FINISHED;
     }
-    /* If valid is 0 here, there are some fragments missing in the middle
-     * (since MF == 0 has already arrived). Such datagrams simply time out if
-     * no more fragments are received... */
-    return valid ? IP_REASS_VALIDATE_TELEGRAM_FINISHED : IP_REASS_VALIDATE_PBUF_QUEUED;
+    /* Some fragments are missing in the middle, such datagrams simply
+     * time out if no more fragments are received... */
   }
   /* If we come here, not all fragments were received, yet! */
   return IP_REASS_VALIDATE_PBUF_QUEUED; /* not yet valid! */
@@ -507,6 +485,7 @@ ip4_reass(struct pbuf *p)
   struct ip_reassdata *ipr;
   struct ip_reass_helper *iprh;
   u16_t offset, len, clen;
+  u32_t peer;
   u8_t hlen;
   int valid;
   int is_last;
@@ -531,11 +510,26 @@ ip4_reass(struct pbuf *p)
   }
   len = (u16_t)(len - hlen);
 
-  /* Check if we are allowed to enqueue more datagrams. */
+  /* Check if this source and destination pair may enqueue more fragments. */
   clen = pbuf_clen(p);
+  peer = ip_reass_peer_index(fraghdr);
+  if ((ip_reass_peer_pbufs[peer] + clen) > IP_REASS_MAX_PBUFS_PER_PEER) {
+#if IP_REASS_FREE_OLDEST
+    if (!ip_reass_remove_oldest_datagram(fraghdr, clen, (s32_t)peer) ||
+        ((ip_reass_peer_pbufs[peer] + clen) > IP_REASS_MAX_PBUFS_PER_PEER))
+#endif /* IP_REASS_FREE_OLDEST */
+    {
+      LWIP_DEBUGF(IP_REASS_DEBUG, ("ip4_reass: Peer overflow condition: pbufct=%d, clen=%d, MAX=%d\n",
+                                   ip_reass_peer_pbufs[peer], clen, IP_REASS_MAX_PBUFS_PER_PEER));
+      IPFRAG_STATS_INC(ip_frag.memerr);
+      goto nullreturn;
+    }
+  }
+
+  /* Check if we are allowed to enqueue more datagrams. */
   if ((ip_reass_pbufcount + clen) > IP_REASS_MAX_PBUFS) {
 #if IP_REASS_FREE_OLDEST
-    if (!ip_reass_remove_oldest_datagram(fraghdr, clen) ||
+    if (!ip_reass_remove_oldest_datagram(fraghdr, clen, -1) ||
         ((ip_reass_pbufcount + clen) > IP_REASS_MAX_PBUFS))
 #endif /* IP_REASS_FREE_OLDEST */
     {
@@ -549,9 +543,8 @@ ip4_reass(struct pbuf *p)
     }
   }
 
-  /* Look for the datagram the fragment belongs to in the current datagram queue,
-   * remembering the previous in the queue for later dequeueing. */
-  for (ipr = reassdatagrams; ipr != NULL; ipr = ipr->next) {
+  /* Look for the datagram the fragment belongs to in its bucket. */
+  for (ipr = ip_reass_hash[ip_reass_hash_index(fraghdr)]; ipr != NULL; ipr = ipr->next) {
     /* Check if the incoming fragment matches the one currently present
        in the reassembly buffer. If so, we proceed with copying the
        fragment into the buffer. */
@@ -605,6 +598,7 @@ ip4_reass(struct pbuf *p)
      the number of fragments that may be enqueued at any one time
      (overflow checked by testing against IP_REASS_MAX_PBUFS) */
   ip_reass_pbufcount = (u16_t)(ip_reass_pbufcount + clen);
+  ip_reass_peer_pbufs[peer] = (u16_t)(ip_reass_peer_pbufs[peer] + clen);
   if (is_last) {
     u16_t datagram_len = (u16_t)(offset + len);
     ipr->datagram_len = datagram_len;
@@ -615,7 +609,6 @@ ip4_reass(struct pbuf *p)
   }
 
   if (valid == IP_REASS_VALIDATE_TELEGRAM_FINISHED) {
-    struct ip_reassdata *ipr_prev;
     /* the totally last fragment (flag more fragments = 0) was received at least
      * once AND all fragments are received */
     u16_t datagram_len = (u16_t)(ipr->datagram_len + IP_HLEN);
@@ -648,24 +641,14 @@ ip4_reass(struct pbuf *p)
       r = iprh->next_pbuf;
     }
 
-    /* find the previous entry in the linked list */
-    if (ipr == reassdatagrams) {
-      ipr_prev = NULL;
-    } else {
-      for (ipr_prev = reassdatagrams; ipr_prev != NULL; ipr_prev = ipr_prev->next) {
-        if (ipr_prev->next == ipr) {
-          break;
-        }
-      }
-    }
-
     /* release the sources allocate for the fragment queue entry */
-    ip_reass_dequeue_datagram(ipr, ipr_prev);
+    ip_reass_dequeue_datagram(ipr);
 
     /* and adjust the number of pbufs currently queued for reassembly. */
     clen = pbuf_clen(p);
     LWIP_ASSERT("ip_reass_pbufcount >= clen", ip_reass_pbufcount >= clen);
     ip_reass_pbufcount = (u16_t)(ip_reass_pbufcount - clen);
+    ip_reass_peer_pbufs[peer] = (u16_t)(ip_reass_peer_pbufs[peer] - clen);
 
     MIB2_STATS_INC(mib2.ipreasmoks);
 
@@ -680,8 +663,7 @@ nullreturn_ipr:
   LWIP_ASSERT("ipr != NULL", ipr != NULL);
   if (ipr->p == NULL) {
     /* dropped pbuf after creating a new datagram entry: remove the entry, too */
-    LWIP_ASSERT("not firstalthough just enqueued", ipr == reassdatagrams);
-    ip_reass_dequeue_datagram(ipr, NULL);
+    ip_reass_dequeue_datagram(ipr);
   }
 
 nullreturn:
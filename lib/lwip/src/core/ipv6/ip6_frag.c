@@ -55,13 +55,6 @@
 #if LWIP_IPV6 && LWIP_IPV6_REASS  /* don't build if not configured for use in lwipopts.h */
 
 
-/** Setting this to 0, you can turn off checking the fragments for overlapping
- * regions. The code gets a little smaller. Only use this if you know that
- * overlapping won't occur on your network! */
-#ifndef IP_REASS_CHECK_OVERLAP
-#define IP_REASS_CHECK_OVERLAP 1
-#endif /* IP_REASS_CHECK_OVERLAP */
-
 /** Set to 0 to prevent freeing the oldest datagram when the reassembly buffer is
  * full (IP_REASS_MAX_PBUFS pbufs are enqueued). The code gets a little smaller.
  * Datagrams will be freed by timeout only. Especially useful when MEMP_NUM_REASSDATA
@@ -70,14 +63,16 @@
 #define IP_REASS_FREE_OLDEST 1
 #endif /* IP_REASS_FREE_OLDEST */
 
+#if (IP_REASS_HASH_SIZE & (IP_REASS_HASH_SIZE - 1)) != 0
+#error "IP_REASS_HASH_SIZE must be a power of two"
+#endif
+
 #if IPV6_FRAG_COPYHEADER
 /* The number of bytes we need to "borrow" from (i.e., overwrite in) the header
  * that precedes the fragment header for reassembly pruposes. */
 #define IPV6_FRAG_REQROOM ((s16_t)(sizeof(struct ip6_reass_helper) - IP6_FRAG_HLEN))
 #endif
 
-#define IP_REASS_FLAG_LASTFRAG 0x01
-
 /** This is a helper struct which holds the starting
  * offset and the ending offset of this fragment to
  * easily chain the fragments.
@@ -99,15 +94,66 @@ PACK_STRUCT_END
 #  include "arch/epstruct.h"
 #endif
 
+#define IP6_REASS_HELPER(p) ((struct ip6_reass_helper *)(p)->payload)
+
 /* static variables */
-static struct ip6_reassdata *reassdatagrams;
-static u16_t ip6_reass_pbufcount;
+/*
+	15. tun2socks: one stack per worker thread, see LWIP_THREAD_LOCAL in arch/cc.h.
+*/
+/*
+	23. tun2socks: same layout as ip4_frag.c. Datagrams are chained into
+	ip6_reass_hash by addresses and identification, and into an age list,
+	oldest first. Fragments never overlap, so a datagram is complete once its
+	last fragment arrived and recv_len reached its length.
+*/
+static LWIP_THREAD_LOCAL struct ip6_reassdata *ip6_reass_hash[IP_REASS_HASH_SIZE];
+static LWIP_THREAD_LOCAL struct ip6_reassdata *ip6_reass_oldest;
+static LWIP_THREAD_LOCAL struct ip6_reassdata *ip6_reass_newest;
+static LWIP_THREAD_LOCAL u16_t ip6_reass_peer_pbufs[IP_REASS_HASH_SIZE];
+static LWIP_THREAD_LOCAL u16_t ip6_reass_pbufcount;
 
 /* Forward declarations. */
-static void ip6_reass_free_complete_datagram(struct ip6_reassdata *ipr);
-#if IP_REASS_FREE_OLDEST
-static void ip6_reass_remove_oldest_datagram(struct ip6_reassdata *ipr, int pbufs_needed);
-#endif /* IP_REASS_FREE_OLDEST */
+static void ip6_reass_dequeue_datagram(struct ip6_reassdata *ipr);
+static u16_t ip6_reass_free_complete_datagram(struct ip6_reassdata *ipr);
+
+static u32_t
+ip6_reass_mix(u32_t h)
+{
+  /* finalizer of murmur3 */
+  h ^= h >> 16;
+  h *= 0x85ebca6bU;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35U;
+  h ^= h >> 16;
+  return h;
+}
+
+/* addr points to the 16 address bytes, which may be unaligned. */
+static u32_t
+ip6_reass_addr_fold(const void *addr)
+{
+  u32_t a[4];
+  MEMCPY(a, addr, sizeof(a));
+  return a[0] ^ a[1] ^ a[2] ^ a[3];
+}
+
+static u32_t
+ip6_reass_peer_hash(const void *src, const void *dest)
+{
+  return ip6_reass_mix(ip6_reass_addr_fold(src) * 0x9e3779b1U ^ ip6_reass_addr_fold(dest));
+}
+
+static u32_t
+ip6_reass_peer_index(const struct ip6_reassdata *ipr)
+{
+  return ip6_reass_peer_hash(&IPV6_FRAG_SRC(ipr), &IPV6_FRAG_DEST(ipr)) & (IP_REASS_HASH_SIZE - 1);
+}
+
+static u32_t
+ip6_reass_hash_index(u32_t peer_hash, u32_t identification)
+{
+  return ip6_reass_mix(peer_hash ^ identification) & (IP_REASS_HASH_SIZE - 1);
+}
 
 void
 ip6_reass_tmr(void)
@@ -119,18 +165,18 @@ ip6_reass_tmr(void)
     sizeof(struct ip6_reass_helper) <= IP6_FRAG_HLEN);
 #endif /* !IPV6_FRAG_COPYHEADER */
 
-  r = reassdatagrams;
+  r = ip6_reass_oldest;
   while (r != NULL) {
     /* Decrement the timer. Once it reaches 0,
      * clean up the incomplete fragment assembly */
     if (r->timer > 0) {
       r->timer--;
-      r = r->next;
+      r = r->age_next;
     } else {
       /* reassembly timed out */
       tmp = r;
       /* get the next pointer before freeing */
-      r = r->next;
+      r = r->age_next;
       /* free the helper struct and all enqueued pbufs */
       ip6_reass_free_complete_datagram(tmp);
      }
@@ -143,16 +189,19 @@ ip6_reass_tmr(void)
  * sends an ICMP time exceeded packet.
  *
  * @param ipr datagram to free
+ * @return the number of pbufs freed
  */
-static void
+static u16_t
 ip6_reass_free_complete_datagram(struct ip6_reassdata *ipr)
 {
-  struct ip6_reassdata *prev;
   u16_t pbufs_freed = 0;
   u16_t clen;
+  u32_t peer;
   struct pbuf *p;
   struct ip6_reass_helper *iprh;
 
+  peer = ip6_reass_peer_index(ipr);
+
 #if LWIP_ICMP6
   iprh = (struct ip6_reass_helper *)ipr->p->payload;
   if (iprh->start == 0) {
@@ -201,63 +250,78 @@ ip6_reass_free_complete_datagram(struct ip6_reassdata *ipr)
     pbuf_free(pcur);
   }
 
-  /* Then, unchain the struct ip6_reassdata from the list and free it. */
-  if (ipr == reassdatagrams) {
-    reassdatagrams = ipr->next;
-  } else {
-    prev = reassdatagrams;
-    while (prev != NULL) {
-      if (prev->next == ipr) {
-        break;
-      }
-      prev = prev->next;
-    }
-    if (prev != NULL) {
-      prev->next = ipr->next;
-    }
-  }
-  memp_free(MEMP_IP6_REASSDATA, ipr);
+  /* Then, unchain the struct ip6_reassdata from the lists and free it. */
+  ip6_reass_dequeue_datagram(ipr);
 
   /* Finally, update number of pbufs in reassembly queue */
   LWIP_ASSERT("ip_reass_pbufcount >= clen", ip6_reass_pbufcount >= pbufs_freed);
   ip6_reass_pbufcount = (u16_t)(ip6_reass_pbufcount - pbufs_freed);
+  ip6_reass_peer_pbufs[peer] = (u16_t)(ip6_reass_peer_pbufs[peer] - pbufs_freed);
+  return pbufs_freed;
+}
+
+/**
+ * Unchain a datagram from its bucket and the age list and free it.
+ * Doesn't deallocate the pbufs.
+ *
+ * @param ipr datagram to dequeue
+ */
+static void
+ip6_reass_dequeue_datagram(struct ip6_reassdata *ipr)
+{
+  struct ip6_reassdata **link;
+  u32_t peer_hash = ip6_reass_peer_hash(&IPV6_FRAG_SRC(ipr), &IPV6_FRAG_DEST(ipr));
+
+  for (link = &ip6_reass_hash[ip6_reass_hash_index(peer_hash, ipr->identification)];
+       *link != NULL; link = &(*link)->next) {
+    if (*link == ipr) {
+      *link = ipr->next;
+      break;
+    }
+  }
+
+  if (ipr->age_prev != NULL) {
+    ipr->age_prev->age_next = ipr->age_next;
+  } else {
+    ip6_reass_oldest = ipr->age_next;
+  }
+  if (ipr->age_next != NULL) {
+    ipr->age_next->age_prev = ipr->age_prev;
+  } else {
+    ip6_reass_newest = ipr->age_prev;
+  }
+  memp_free(MEMP_IP6_REASSDATA, ipr);
 }
 
 #if IP_REASS_FREE_OLDEST
 /**
- * Free the oldest datagram to make room for enqueueing new fragments.
+ * Free the oldest datagrams to make room for enqueueing new fragments.
  * The datagram ipr is not freed!
  *
- * @param ipr ip6_reassdata for the current fragment
+ * @param ipr ip6_reassdata for the current fragment, may be NULL
  * @param pbufs_needed number of pbufs needed to enqueue
  *        (used for freeing other datagrams if not enough space)
+ * @param peer only free datagrams of this slot of ip6_reass_peer_pbufs,
+ *        or of any slot if negative
+ * @return the number of pbufs freed
  */
-static void
-ip6_reass_remove_oldest_datagram(struct ip6_reassdata *ipr, int pbufs_needed)
+static int
+ip6_reass_remove_oldest_datagram(struct ip6_reassdata *ipr, int pbufs_needed, s32_t peer)
 {
-  struct ip6_reassdata *r, *oldest;
-
-  /* Free datagrams until being allowed to enqueue 'pbufs_needed' pbufs,
-   * but don't free the current datagram! */
-  do {
-    r = oldest = reassdatagrams;
-    while (r != NULL) {
-      if (r != ipr) {
-        if (r->timer <= oldest->timer) {
-          /* older than the previous oldest */
-          oldest = r;
-        }
-      }
-      r = r->next;
-    }
-    if (oldest == ipr) {
-      /* nothing to free, ipr is the only element on the list */
-      return;
+  struct ip6_reassdata *r, *next;
+  int pbufs_freed = 0;
+
+  for (r = ip6_reass_oldest; (r != NULL) && (pbufs_freed < pbufs_needed); r = next) {
+    next = r->age_next;
+    if (r == ipr) {
+      continue;
     }
-    if (oldest != NULL) {
-      ip6_reass_free_complete_datagram(oldest);
+    if ((peer >= 0) && (ip6_reass_peer_index(r) != (u32_t)peer)) {
+      continue;
     }
-  } while (((ip6_reass_pbufcount + pbufs_needed) > IP_REASS_MAX_PBUFS) && (reassdatagrams != NULL));
+    pbufs_freed += ip6_reass_free_complete_datagram(r);
+  }
+  return pbufs_freed;
 }
 #endif /* IP_REASS_FREE_OLDEST */
 
@@ -271,13 +335,14 @@ ip6_reass_remove_oldest_datagram(struct ip6_reassdata *ipr, int pbufs_needed)
 struct pbuf *
 ip6_reass(struct pbuf *p)
 {
-  struct ip6_reassdata *ipr, *ipr_prev;
-  struct ip6_reass_helper *iprh, *iprh_tmp, *iprh_prev=NULL;
+  struct ip6_reassdata *ipr;
+  struct ip6_reass_helper *iprh, *iprh_tmp = NULL, *iprh_prev = NULL;
   struct ip6_frag_hdr *frag_hdr;
   u16_t offset, len, start, end;
   ptrdiff_t hdrdiff;
   u16_t clen;
-  u8_t valid = 1;
+  u32_t peer_hash, peer;
+  u8_t last_frag;
   struct pbuf *q, *next_pbuf;
 
   IP6_FRAG_STATS_INC(ip6_frag.recv);
@@ -312,10 +377,14 @@ ip6_reass(struct pbuf *p)
     IP6_FRAG_STATS_INC(ip6_frag.proterr);
     goto nullreturn;
   }
+  end = (u16_t)(start + len);
+  last_frag = (offset & IP6_FRAG_MORE_FLAG) == 0;
 
-  /* Look for the datagram the fragment belongs to in the current datagram queue,
-   * remembering the previous in the queue for later dequeueing. */
-  for (ipr = reassdatagrams, ipr_prev = NULL; ipr != NULL; ipr = ipr->next) {
+  /* Look for the datagram the fragment belongs to in its bucket. */
+  peer_hash = ip6_reass_peer_hash(ip6_current_src_addr(), ip6_current_dest_addr());
+  peer = peer_hash & (IP_REASS_HASH_SIZE - 1);
+  for (ipr = ip6_reass_hash[ip6_reass_hash_index(peer_hash, frag_hdr->_identification)];
+       ipr != NULL; ipr = ipr->next) {
     /* Check if the incoming fragment matches the one currently present
        in the reassembly buffer. If so, we proceed with copying the
        fragment into the buffer. */
@@ -325,7 +394,32 @@ ip6_reass(struct pbuf *p)
       IP6_FRAG_STATS_INC(ip6_frag.cachehit);
       break;
     }
-    ipr_prev = ipr;
+  }
+
+  /* Check if this source and destination pair may enqueue more fragments. */
+  if ((ip6_reass_peer_pbufs[peer] + clen) > IP_REASS_MAX_PBUFS_PER_PEER) {
+#if IP_REASS_FREE_OLDEST
+    ip6_reass_remove_oldest_datagram(ipr, clen, (s32_t)peer);
+    if ((ip6_reass_peer_pbufs[peer] + clen) > IP_REASS_MAX_PBUFS_PER_PEER)
+#endif /* IP_REASS_FREE_OLDEST */
+    {
+      IP6_FRAG_STATS_INC(ip6_frag.memerr);
+      goto nullreturn;
+    }
+  }
+
+  /* Check if we are allowed to enqueue more datagrams. */
+  if ((ip6_reass_pbufcount + clen) > IP_REASS_MAX_PBUFS) {
+#if IP_REASS_FREE_OLDEST
+    ip6_reass_remove_oldest_datagram(ipr, clen, -1);
+    if ((ip6_reass_pbufcount + clen) > IP_REASS_MAX_PBUFS)
+#endif /* IP_REASS_FREE_OLDEST */
+    {
+      /* @todo: send ICMPv6 time exceeded here? */
+      /* drop this pbuf */
+      IP6_FRAG_STATS_INC(ip6_frag.memerr);
+      goto nullreturn;
+    }
   }
 
   if (ipr == NULL) {
@@ -334,16 +428,9 @@ ip6_reass(struct pbuf *p)
     if (ipr == NULL) {
 #if IP_REASS_FREE_OLDEST
       /* Make room and try again. */
-      ip6_reass_remove_oldest_datagram(ipr, clen);
+      ip6_reass_remove_oldest_datagram(NULL, clen, -1);
       ipr = (struct ip6_reassdata *)memp_malloc(MEMP_IP6_REASSDATA);
-      if (ipr != NULL) {
-        /* re-search ipr_prev since it might have been removed */
-        for (ipr_prev = reassdatagrams; ipr_prev != NULL; ipr_prev = ipr_prev->next) {
-          if (ipr_prev->next == ipr) {
-            break;
-          }
-        }
-      } else
+      if (ipr == NULL)
 #endif /* IP_REASS_FREE_OLDEST */
       {
         IP6_FRAG_STATS_INC(ip6_frag.memerr);
@@ -354,9 +441,18 @@ ip6_reass(struct pbuf *p)
     memset(ipr, 0, sizeof(struct ip6_reassdata));
     ipr->timer = IPV6_REASS_MAXAGE;
 
-    /* enqueue the new structure to the front of the list */
-    ipr->next = reassdatagrams;
-    reassdatagrams = ipr;
+    /* enqueue the new structure to the front of its bucket */
+    ipr->next = ip6_reass_hash[ip6_reass_hash_index(peer_hash, frag_hdr->_identification)];
+    ip6_reass_hash[ip6_reass_hash_index(peer_hash, frag_hdr->_identification)] = ipr;
+
+    /* and to the end of the age list */
+    ipr->age_prev = ip6_reass_newest;
+    if (ip6_reass_newest != NULL) {
+      ip6_reass_newest->age_next = ipr;
+    } else {
+      ip6_reass_oldest = ipr;
+    }
+    ip6_reass_newest = ipr;
 
     /* Use the current IPv6 header for src/dest address reference.
      * Eventually, we will replace it when we get the first fragment
@@ -384,25 +480,15 @@ ip6_reass(struct pbuf *p)
     ipr->nexth = frag_hdr->_nexth;
   }
 
-  /* Check if we are allowed to enqueue more datagrams. */
-  if ((ip6_reass_pbufcount + clen) > IP_REASS_MAX_PBUFS) {
-#if IP_REASS_FREE_OLDEST
-    ip6_reass_remove_oldest_datagram(ipr, clen);
-    if ((ip6_reass_pbufcount + clen) <= IP_REASS_MAX_PBUFS) {
-      /* re-search ipr_prev since it might have been removed */
-      for (ipr_prev = reassdatagrams; ipr_prev != NULL; ipr_prev = ipr_prev->next) {
-        if (ipr_prev->next == ipr) {
-          break;
-        }
-      }
-    } else
-#endif /* IP_REASS_FREE_OLDEST */
-    {
-      /* @todo: send ICMPv6 time exceeded here? */
-      /* drop this pbuf */
-      IP6_FRAG_STATS_INC(ip6_frag.memerr);
-      goto nullreturn;
+  /* Nothing may end behind the last fragment. */
+  if (ipr->datagram_len != 0) {
+    if ((end > ipr->datagram_len) || (last_frag && (end != ipr->datagram_len))) {
+      IP6_FRAG_STATS_INC(ip6_frag.proterr);
+      goto nullreturn_ipr;
     }
+  } else if (last_frag && (ipr->p_last != NULL) && (IP6_REASS_HELPER(ipr->p_last)->end > end)) {
+    IP6_FRAG_STATS_INC(ip6_frag.proterr);
+    goto nullreturn_ipr;
   }
 
   /* Overwrite Fragment Header with our own helper struct. */
@@ -425,86 +511,48 @@ ip6_reass(struct pbuf *p)
    * sure that we are going to add this packet to the list. */
   iprh = (struct ip6_reass_helper *)p->payload;
   next_pbuf = NULL;
-  end = (u16_t)(start + len);
 
   /* find the right place to insert this pbuf */
-  /* Iterate through until we either get to the end of the list (append),
-   * or we find on with a larger offset (insert). */
-  for (q = ipr->p; q != NULL;) {
-    iprh_tmp = (struct ip6_reass_helper*)q->payload;
-    if (start < iprh_tmp->start) {
-#if IP_REASS_CHECK_OVERLAP
-      if (end > iprh_tmp->start) {
-        /* fragment overlaps with following, throw away */
-        IP6_FRAG_STATS_INC(ip6_frag.proterr);
-        goto nullreturn;
-      }
-      if (iprh_prev != NULL) {
-        if (start < iprh_prev->end) {
-          /* fragment overlaps with previous, throw away */
-          IP6_FRAG_STATS_INC(ip6_frag.proterr);
-          goto nullreturn;
-        }
-      }
-#endif /* IP_REASS_CHECK_OVERLAP */
-      /* the new pbuf should be inserted before this */
-      next_pbuf = q;
-      if (iprh_prev != NULL) {
-        /* not the fragment with the lowest offset */
-        iprh_prev->next_pbuf = p;
-      } else {
-        /* fragment with the lowest offset */
-        ipr->p = p;
+  if (ipr->p_last == NULL) {
+    /* this is the first fragment we ever received for this ip datagram */
+    ipr->p = p;
+  } else if (IP6_REASS_HELPER(ipr->p_last)->end <= start) {
+    /* in order: chain it behind the fragment with the highest offset */
+    IP6_REASS_HELPER(ipr->p_last)->next_pbuf = p;
+  } else {
+    /* Iterate through until we find one with a larger offset (insert),
+     * or get to the end of the list (overlapping the last one). */
+    for (q = ipr->p; q != NULL; q = iprh_tmp->next_pbuf) {
+      iprh_tmp = (struct ip6_reass_helper*)q->payload;
+      if (start < iprh_tmp->start) {
+        break;
       }
-      break;
-    } else if (start == iprh_tmp->start) {
-      /* received the same datagram twice: no need to keep the datagram */
-      goto nullreturn;
-#if IP_REASS_CHECK_OVERLAP
-    } else if (start < iprh_tmp->end) {
-      /* overlap: no need to keep the new datagram */
+      iprh_prev = iprh_tmp;
+    }
+    if (((iprh_prev != NULL) && ((start < iprh_prev->end) || (start == iprh_prev->start))) ||
+        ((q != NULL) && (end > iprh_tmp->start))) {
+      /* overlaps with or duplicates a queued fragment, throw away */
       IP6_FRAG_STATS_INC(ip6_frag.proterr);
-      goto nullreturn;
-#endif /* IP_REASS_CHECK_OVERLAP */
-    } else {
-      /* Check if the fragments received so far have no gaps. */
-      if (iprh_prev != NULL) {
-        if (iprh_prev->end != iprh_tmp->start) {
-          /* There is a fragment missing between the current
-           * and the previous fragment */
-          valid = 0;
-        }
-      }
+      goto nullreturn_ipr;
     }
-    q = iprh_tmp->next_pbuf;
-    iprh_prev = iprh_tmp;
-  }
-
-  /* If q is NULL, then we made it to the end of the list. Determine what to do now */
-  if (q == NULL) {
+    /* the new pbuf should be inserted before q */
+    next_pbuf = q;
     if (iprh_prev != NULL) {
-      /* this is (for now), the fragment with the highest offset:
-       * chain it to the last fragment */
-#if IP_REASS_CHECK_OVERLAP
-      LWIP_ASSERT("check fragments don't overlap", iprh_prev->end <= start);
-#endif /* IP_REASS_CHECK_OVERLAP */
+      /* not the fragment with the lowest offset */
       iprh_prev->next_pbuf = p;
-      if (iprh_prev->end != start) {
-        valid = 0;
-      }
     } else {
-#if IP_REASS_CHECK_OVERLAP
-      LWIP_ASSERT("no previous fragment, this must be the first fragment!",
-        ipr->p == NULL);
-#endif /* IP_REASS_CHECK_OVERLAP */
-      /* this is the first fragment we ever received for this ip datagram */
+      /* fragment with the lowest offset */
       ipr->p = p;
     }
   }
+  if (next_pbuf == NULL) {
+    ipr->p_last = p;
+  }
 
   /* Track the current number of pbufs current 'in-flight', in order to limit
   the number of fragments that may be enqueued at any one time */
   ip6_reass_pbufcount = (u16_t)(ip6_reass_pbufcount + clen);
+  ip6_reass_peer_pbufs[peer] = (u16_t)(ip6_reass_peer_pbufs[peer] + clen);
 
   /* Remember IPv6 header if this is the first fragment. */
   if (start == 0) {
@@ -521,38 +569,20 @@ ip6_reass(struct pbuf *p)
   iprh->next_pbuf = next_pbuf;
   iprh->start = start;
   iprh->end = end;
+  ipr->recv_len = (u16_t)(ipr->recv_len + len);
 
   /* If this is the last fragment, calculate total packet length. */
-  if ((offset & IP6_FRAG_MORE_FLAG) == 0) {
+  if (last_frag) {
     ipr->datagram_len = iprh->end;
   }
 
-  /* Additional validity tests: we have received first and last fragment. */
-  iprh_tmp = (struct ip6_reass_helper*)ipr->p->payload;
-  if (iprh_tmp->start != 0) {
-    valid = 0;
-  }
-  if (ipr->datagram_len == 0) {
-    valid = 0;
-  }
-
-  /* Final validity test: no gaps between current and last fragment. */
-  iprh_prev = iprh;
-  q = iprh->next_pbuf;
-  while ((q != NULL) && valid) {
-    iprh = (struct ip6_reass_helper*)q->payload;
-    if (iprh_prev->end != iprh->start) {
-      valid = 0;
-      break;
-    }
-    iprh_prev = iprh;
-    q = iprh->next_pbuf;
-  }
-
-  if (valid) {
-    /* All fragments have been received */
+  /* All fragments have been received once the last one arrived and the
+   * fragments, which never overlap, add up to the datagram length. */
+  if ((ipr->datagram_len != 0) && (ipr->recv_len == ipr->datagram_len)) {
     struct ip6_hdr* iphdr_ptr;
 
+    LWIP_ASSERT("sanity check", IP6_REASS_HELPER(ipr->p)->start == 0);
+
     /* chain together the pbufs contained within the ip6_reassdata list. */
     iprh = (struct ip6_reass_helper*) ipr->p->payload;
     while (iprh != NULL) {
@@ -635,20 +665,13 @@ ip6_reass(struct pbuf *p)
     }
 
     /* release the resources allocated for the fragment queue entry */
-    if (reassdatagrams == ipr) {
-      /* it was the first in the list */
-      reassdatagrams = ipr->next;
-    } else {
-      /* it wasn't the first, so it must have a valid 'prev' */
-      LWIP_ASSERT("sanity check linked list", ipr_prev != NULL);
-      ipr_prev->next = ipr->next;
-    }
-    memp_free(MEMP_IP6_REASSDATA, ipr);
+    ip6_reass_dequeue_datagram(ipr);
 
     /* adjust the number of pbufs currently queued for reassembly. */
     clen = pbuf_clen(p);
     LWIP_ASSERT("ip6_reass_pbufcount >= clen", ip6_reass_pbufcount >= clen);
     ip6_reass_pbufcount = (u16_t)(ip6_reass_pbufcount - clen);
+    ip6_reass_peer_pbufs[peer] = (u16_t)(ip6_reass_peer_pbufs[peer] - clen);
 
     /* Move pbuf back to IPv6 header. This should never fail. */
     if (pbuf_header_force(p, (s16_t)((u8_t*)p->payload - (u8_t*)iphdr_ptr))) {
@@ -663,6 +686,12 @@ ip6_reass(struct pbuf *p)
   /* the datagram is not (yet?) reassembled completely */
   return NULL;
 
+nullreturn_ipr:
+  if (ipr->p == NULL) {
+    /* dropped the only fragment of a new datagram entry: remove the entry, too */
+    ip6_reass_dequeue_datagram(ipr);
+  }
+
 nullreturn:
   IP6_FRAG_STATS_INC(ip6_frag.drop);
   pbuf_free(p);
@@ -728,7 +757,7 @@ ip6_frag(struct pbuf *p, struct netif *netif, const ip6_addr_t *dest)
   u16_t newpbuflen = 0;
   u16_t left_to_copy;
 #endif
-  static u32_t identification;
+  static LWIP_THREAD_LOCAL u32_t identification;
   u16_t left, cop;
   const u16_t mtu = nd6_get_destination_mtu(dest, netif);
   const u16_t nfb = (u16_t)((mtu - (IP6_HLEN + IP6_FRAG_HLEN)) & IP6_FRAG_OFFSET_MASK);
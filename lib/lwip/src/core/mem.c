@@ -64,6 +64,10 @@
 
 #if MEM_LIBC_MALLOC
 #include <stdlib.h> /* for malloc()/free() */
+/*
+	21. tun2socks: mem_clib_malloc and friends are the slab allocator of sys_arch.cpp.
+*/
+#include "arch/sys_arch.h"
 #endif
 
 /* This is overridable for tests only... */
@@ -47,7 +47,7 @@
 
 #include <string.h>
 
-struct stats_ lwip_stats;
+LWIP_THREAD_LOCAL struct stats_ lwip_stats;
 
 void
 stats_init(void)
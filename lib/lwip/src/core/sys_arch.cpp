@@ -4,10 +4,17 @@
 
 #include "lwip/sys.h"
 #include "arch/sys_arch.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
 
-static std::unordered_set<void*>             sys_arch_pcb_sets;
-static std::chrono::steady_clock::time_point startupTime;
+static thread_local std::unordered_set<void*>             sys_arch_pcb_sets;
+static thread_local std::chrono::steady_clock::time_point startupTime;
 
 void sys_init(void)
 {
@@ -68,3 +75,276 @@ int sys_arch_pcb_unwatch(void* pcb)
     }
     return rc;
 }
+
+/*
+	Slab allocator behind mem_malloc and memp_malloc.
+
+	Every thread owns a heap with one free list per size class, blocks are
+	carved from chunks that are never returned, so the footprint is the
+	high-water mark of each class. A block freed by another thread, which
+	happens to packets handed between stacks, is pushed on a lock-free list
+	of its class and reclaimed by the owner on its next allocation. The heap
+	of an exited thread is kept and adopted by the next new thread.
+*/
+namespace {
+
+// Four classes per power of two, header included.
+constexpr std::size_t slab_min   = 32;
+constexpr std::size_t slab_max   = 128 * 1024;
+constexpr std::size_t slab_count = 47;
+
+constexpr std::array<std::size_t, slab_count> slab_sizes = [] {
+    std::array<std::size_t, slab_count> sizes{};
+    std::size_t                         n = 0;
+    sizes[n++]                            = 32;
+    sizes[n++]                            = 48;
+    for (std::size_t p = 64; p < slab_max; p *= 2)
+        for (std::size_t q = 0; q < 4; ++q)
+            sizes[n++] = p + q * p / 4;
+    sizes[n++] = slab_max;
+    return sizes;
+}();
+static_assert(slab_sizes[0] == slab_min && slab_sizes[slab_count - 1] == slab_max);
+
+constexpr std::uint32_t slab_large = slab_count;
+
+struct slab_heap;
+
+struct slab_block
+{
+    slab_heap*    heap;
+    std::uint32_t cls;
+};
+
+// Free blocks keep their header, the link lives in the payload.
+inline slab_block*& slab_next(slab_block* b)
+{
+    return *reinterpret_cast<slab_block**>(b + 1);
+}
+
+// Counters are written by the owner only, relaxed atomics let any thread
+// read them for sys_arch_mem_stats.
+inline void slab_add(std::atomic<std::size_t>& v, std::ptrdiff_t n)
+{
+    v.store(v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+struct slab_heap
+{
+    struct size_class
+    {
+        slab_block*              free = nullptr;
+        std::atomic<slab_block*> remote{nullptr};
+        std::uint8_t*            bump = nullptr;
+        std::uint8_t*            end  = nullptr;
+        std::atomic<std::size_t> used{0};
+        std::atomic<std::size_t> max{0};
+        std::atomic<std::size_t> carved{0};
+        std::atomic<std::size_t> remote_used{0};
+    };
+
+    size_class          classes[slab_count];
+    std::vector<void*>  chunks;
+
+    slab_block* alloc(std::uint32_t cls)
+    {
+        auto& c = classes[cls];
+        if (!c.free)
+            reclaim(c);
+        if (!c.free && !carve(c, slab_sizes[cls]))
+            return nullptr;
+
+        auto b = c.free;
+        c.free = slab_next(b);
+
+        auto used = c.used.load(std::memory_order_relaxed) + 1;
+        c.used.store(used, std::memory_order_relaxed);
+        if (used > c.max.load(std::memory_order_relaxed))
+            c.max.store(used, std::memory_order_relaxed);
+        return b;
+    }
+
+    void free(slab_block* b)
+    {
+        auto& c      = classes[b->cls];
+        slab_next(b) = c.free;
+        c.free       = b;
+        slab_add(c.used, -1);
+    }
+
+    void free_remote(slab_block* b)
+    {
+        auto& c    = classes[b->cls];
+        auto  head = c.remote.load(std::memory_order_relaxed);
+        do {
+            slab_next(b) = head;
+        } while (!c.remote.compare_exchange_weak(head, b, std::memory_order_release, std::memory_order_relaxed));
+        c.remote_used.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void reclaim(size_class& c)
+    {
+        auto b = c.remote.exchange(nullptr, std::memory_order_acquire);
+        if (!b)
+            return;
+
+        std::ptrdiff_t n = 0;
+        for (auto tail = b;; tail = slab_next(tail)) {
+            ++n;
+            if (!slab_next(tail)) {
+                slab_next(tail) = c.free;
+                break;
+            }
+        }
+        c.free = b;
+        slab_add(c.used, -n);
+        c.remote_used.fetch_sub(n, std::memory_order_relaxed);
+    }
+
+    bool carve(size_class& c, std::size_t size)
+    {
+        if (c.bump == c.end) {
+            auto bytes = std::clamp<std::size_t>(size * 16, 64 * 1024, 1024 * 1024) / size * size;
+            auto chunk = std::malloc(bytes);
+            if (!chunk)
+                return false;
+
+            chunks.push_back(chunk);
+            c.bump = static_cast<std::uint8_t*>(chunk);
+            c.end  = c.bump + bytes;
+        }
+
+        auto b = reinterpret_cast<slab_block*>(c.bump);
+        c.bump += size;
+        b->heap      = this;
+        b->cls       = static_cast<std::uint32_t>(&c - classes);
+        slab_next(b) = nullptr;
+        c.free       = b;
+        slab_add(c.carved, 1);
+        return true;
+    }
+};
+
+std::mutex              slab_mutex;
+std::vector<slab_heap*> slab_heaps;
+std::vector<slab_heap*> slab_abandoned;
+
+std::atomic<std::size_t> slab_large_used{0};
+std::atomic<std::size_t> slab_large_max{0};
+
+// Trivially destructible, so still usable while thread locals are destroyed.
+thread_local slab_heap* slab_current = nullptr;
+thread_local bool       slab_exited  = false;
+
+struct slab_thread
+{
+    ~slab_thread()
+    {
+        slab_exited = true;
+        if (!slab_current)
+            return;
+
+        std::lock_guard<std::mutex> lock(slab_mutex);
+        slab_abandoned.push_back(slab_current);
+        slab_current = nullptr;
+    }
+};
+thread_local slab_thread slab_thread_guard;
+
+slab_heap* slab_heap_of_thread()
+{
+    if (slab_current || slab_exited)
+        return slab_current;
+
+    (void)&slab_thread_guard;
+
+    std::lock_guard<std::mutex> lock(slab_mutex);
+    if (!slab_abandoned.empty()) {
+        slab_current = slab_abandoned.back();
+        slab_abandoned.pop_back();
+    } else {
+        slab_current = new slab_heap;
+        slab_heaps.push_back(slab_current);
+    }
+    return slab_current;
+}
+
+void* slab_alloc_large(std::size_t size)
+{
+    auto b = static_cast<slab_block*>(std::malloc(sizeof(slab_block) + size));
+    if (!b)
+        return nullptr;
+
+    b->heap = nullptr;
+    b->cls  = slab_large;
+
+    auto used = slab_large_used.fetch_add(1, std::memory_order_relaxed) + 1;
+    auto max  = slab_large_max.load(std::memory_order_relaxed);
+    while (used > max && !slab_large_max.compare_exchange_weak(max, used, std::memory_order_relaxed)) {
+    }
+    return b + 1;
+}
+
+}  // namespace
+
+void* sys_arch_mem_malloc(size_t size)
+{
+    auto total = sizeof(slab_block) + size;
+    if (total > slab_max)
+        return slab_alloc_large(size);
+
+    auto heap = slab_heap_of_thread();
+    if (!heap)
+        return slab_alloc_large(size);
+
+    auto cls = std::lower_bound(slab_sizes.begin(), slab_sizes.end(), total) - slab_sizes.begin();
+    auto b   = heap->alloc(static_cast<std::uint32_t>(cls));
+    return b ? b + 1 : nullptr;
+}
+
+void* sys_arch_mem_calloc(size_t count, size_t size)
+{
+    if (size && count > SIZE_MAX / size)
+        return nullptr;
+
+    auto mem = sys_arch_mem_malloc(count * size);
+    if (mem)
+        std::memset(mem, 0, count * size);
+    return mem;
+}
+
+void sys_arch_mem_free(void* mem)
+{
+    if (!mem)
+        return;
+
+    auto b = static_cast<slab_block*>(mem) - 1;
+    if (b->cls == slab_large) {
+        slab_large_used.fetch_sub(1, std::memory_order_relaxed);
+        std::free(b);
+    } else if (b->heap == slab_current) {
+        b->heap->free(b);
+    } else {
+        b->heap->free_remote(b);
+    }
+}
+
+size_t sys_arch_mem_stats(struct sys_arch_mem_stats* stats, size_t count)
+{
+    std::lock_guard<std::mutex> lock(slab_mutex);
+    for (std::size_t i = 0; i < std::min<std::size_t>(count, slab_count); ++i) {
+        struct sys_arch_mem_stats s{slab_sizes[i], 0, 0, 0};
+        std::size_t        carved = 0;
+        for (auto heap : slab_heaps) {
+            auto& c = heap->classes[i];
+            s.used += c.used.load(std::memory_order_relaxed) - c.remote_used.load(std::memory_order_relaxed);
+            s.max += c.max.load(std::memory_order_relaxed);
+            carved += c.carved.load(std::memory_order_relaxed);
+        }
+        s.cached = carved > s.used ? carved - s.used : 0;
+        stats[i] = s;
+    }
+    if (count > slab_count)
+        stats[slab_count] = {0, slab_large_used.load(std::memory_order_relaxed), slab_large_max.load(std::memory_order_relaxed), 0};
+    return slab_count + 1;
+}
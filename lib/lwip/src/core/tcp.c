@@ -156,11 +156,14 @@ static const char *const tcp_state_str[] = {
   "TIME_WAIT"
 };
 
+/*
+	15. tun2socks: one stack per worker thread, see LWIP_THREAD_LOCAL in arch/cc.h.
+*/
 /* last local TCP port */
-static u16_t tcp_port = TCP_LOCAL_PORT_RANGE_START;
+static LWIP_THREAD_LOCAL u16_t tcp_port = TCP_LOCAL_PORT_RANGE_START;
 
 /* Incremented every coarse grained timer shot (typically every 500 ms). */
-u32_t tcp_ticks;
+LWIP_THREAD_LOCAL u32_t tcp_ticks;
 static const u8_t tcp_backoff[13] =
 { 1, 2, 3, 4, 5, 6, 7, 7, 7, 7, 7, 7, 7 };
 /* Times per slowtmr hits */
@@ -169,25 +172,49 @@ static const u8_t tcp_persist_backoff[7] = { 3, 6, 12, 24, 48, 96, 120 };
 /* The TCP PCB lists. */
 
 /** List of all TCP PCBs bound but not yet (connected || listening) */
-struct tcp_pcb *tcp_bound_pcbs;
+LWIP_THREAD_LOCAL struct tcp_pcb *tcp_bound_pcbs;
 /** List of all TCP PCBs in LISTEN state */
-union tcp_listen_pcbs_t tcp_listen_pcbs;
+LWIP_THREAD_LOCAL union tcp_listen_pcbs_t tcp_listen_pcbs;
 /** List of all TCP PCBs that are in a state in which
  * they accept or send data. */
-struct tcp_pcb *tcp_active_pcbs;
+LWIP_THREAD_LOCAL struct tcp_pcb *tcp_active_pcbs;
 /** List of all TCP PCBs in TIME-WAIT state */
-struct tcp_pcb *tcp_tw_pcbs;
+LWIP_THREAD_LOCAL struct tcp_pcb *tcp_tw_pcbs;
 
-/** An array with all (non-temporary) PCB lists, mainly used for smaller code size */
-struct tcp_pcb **const tcp_pcb_lists[] = { &tcp_listen_pcbs.pcbs, &tcp_bound_pcbs,
-		 &tcp_active_pcbs, &tcp_tw_pcbs
-};
+/** An array with all (non-temporary) PCB lists, mainly used for smaller code size.
+ *  The addresses of thread local lists are not constant, tcp_init() fills it in. */
+LWIP_THREAD_LOCAL struct tcp_pcb **tcp_pcb_lists[NUM_TCP_PCB_LISTS];
+
+/*
+	16. tun2socks: 4-tuple index of tcp_active_pcbs and tcp_tw_pcbs, allocated
+	by tcp_init() so only threads running a stack pay for it.
+*/
+#if (TCP_PCB_HASH_SIZE & (TCP_PCB_HASH_SIZE - 1)) != 0
+#error "TCP_PCB_HASH_SIZE must be a power of two"
+#endif
+LWIP_THREAD_LOCAL struct tcp_pcb **tcp_pcb_hash;
 
-u8_t tcp_active_pcbs_changed;
+/*
+	19. tun2socks: active PCBs with timer work pending.
+*/
+LWIP_THREAD_LOCAL struct tcp_pcb *tcp_timer_pcbs;
+
+/*
+	24. tun2socks: PCBs with deferred output.
+*/
+LWIP_THREAD_LOCAL u8_t tcp_output_deferred;
+LWIP_THREAD_LOCAL struct tcp_pcb *tcp_output_pcbs;
+
+/*
+	30. tun2socks: see tcp_priv.h.
+*/
+LWIP_THREAD_LOCAL u16_t tcp_output_gso_mss;
+
+LWIP_THREAD_LOCAL u8_t tcp_active_pcbs_changed;
 
 /** Timer counter to handle calling slow-timer from tcp_tmr() */
-static u8_t tcp_timer;
-static u8_t tcp_timer_ctr;
+static LWIP_THREAD_LOCAL u8_t tcp_timer;
+static LWIP_THREAD_LOCAL u8_t tcp_timer_ctr;
 static u16_t tcp_new_port(void);
 
 static err_t tcp_close_shutdown_fin(struct tcp_pcb *pcb);
@@ -201,17 +228,214 @@ static void tcp_ext_arg_invoke_callbacks_destroyed(struct tcp_pcb_ext_args *ext_
 void
 tcp_init(void)
 {
+	tcp_pcb_lists[0] = &tcp_listen_pcbs.pcbs;
+	tcp_pcb_lists[1] = &tcp_bound_pcbs;
+	tcp_pcb_lists[2] = &tcp_active_pcbs;
+	tcp_pcb_lists[3] = &tcp_tw_pcbs;
+	if (tcp_pcb_hash == NULL) {
+		tcp_pcb_hash = (struct tcp_pcb **)mem_calloc(TCP_PCB_HASH_SIZE, sizeof(struct tcp_pcb *));
+		LWIP_ASSERT("tcp_init: failed to allocate tcp_pcb_hash", tcp_pcb_hash != NULL);
+	}
 #ifdef LWIP_RAND
 	tcp_port = TCP_ENSURE_LOCAL_PORT_RANGE(LWIP_RAND());
 #endif /* LWIP_RAND */
 }
 
+static u32_t
+tcp_pcb_hash_addr(const ip_addr_t *addr)
+{
+#if LWIP_IPV6
+	if (IP_IS_V6(addr)) {
+		const u32_t *a = ip_2_ip6(addr)->addr;
+		return a[0] ^ a[1] ^ a[2] ^ a[3];
+	}
+#endif /* LWIP_IPV6 */
+#if LWIP_IPV4
+	return ip4_addr_get_u32(ip_2_ip4(addr));
+#else
+	return 0;
+#endif /* LWIP_IPV4 */
+}
+
+/**
+ * Bucket of tcp_pcb_hash for a connection, ports in host byte order.
+ */
+u32_t
+tcp_pcb_hash_index(const ip_addr_t *local_ip, u16_t local_port,
+	const ip_addr_t *remote_ip, u16_t remote_port)
+{
+	u32_t h = tcp_pcb_hash_addr(local_ip);
+	h ^= (h >> 16) ^ tcp_pcb_hash_addr(remote_ip) * 0x9e3779b1U;
+	h ^= ((u32_t)local_port << 16) | remote_port;
+	/* finalizer of murmur3 */
+	h ^= h >> 16;
+	h *= 0x85ebca6bU;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35U;
+	h ^= h >> 16;
+	return h & (TCP_PCB_HASH_SIZE - 1);
+}
+
+void
+tcp_pcb_hash_insert(struct tcp_pcb *pcb)
+{
+	struct tcp_pcb **bucket = &tcp_pcb_hash[tcp_pcb_hash_index(&pcb->local_ip, pcb->local_port,
+		&pcb->remote_ip, pcb->remote_port)];
+	pcb->hash_next = *bucket;
+	*bucket = pcb;
+}
+
+void
+tcp_pcb_hash_remove(struct tcp_pcb *pcb)
+{
+	struct tcp_pcb **link = &tcp_pcb_hash[tcp_pcb_hash_index(&pcb->local_ip, pcb->local_port,
+		&pcb->remote_ip, pcb->remote_port)];
+	for (; *link != NULL; link = &(*link)->hash_next) {
+		if (*link == pcb) {
+			*link = pcb->hash_next;
+			break;
+		}
+	}
+	pcb->hash_next = NULL;
+}
+
+void
+tcp_pcb_list_unlink(struct tcp_pcb **pcbs, struct tcp_pcb *pcb)
+{
+	if (pcb->prev != NULL) {
+		pcb->prev->next = pcb->next;
+	}
+	else if (*pcbs == pcb) {
+		*pcbs = pcb->next;
+	}
+	else {
+		return;
+	}
+	if (pcb->next != NULL) {
+		pcb->next->prev = pcb->prev;
+	}
+	pcb->prev = NULL;
+}
+
+void
+tcp_timer_pcb_arm(struct tcp_pcb *pcb)
+{
+	if ((pcb->tmr_prev != NULL) || (tcp_timer_pcbs == pcb) ||
+		(pcb->state == CLOSED) || (pcb->state == LISTEN) || (pcb->state == TIME_WAIT)) {
+		return;
+	}
+	pcb->tmr_prev = NULL;
+	pcb->tmr_next = tcp_timer_pcbs;
+	if (tcp_timer_pcbs != NULL) {
+		tcp_timer_pcbs->tmr_prev = pcb;
+	}
+	tcp_timer_pcbs = pcb;
+}
+
+void
+tcp_timer_pcb_disarm(struct tcp_pcb *pcb)
+{
+	if (pcb->tmr_prev != NULL) {
+		pcb->tmr_prev->tmr_next = pcb->tmr_next;
+	}
+	else if (tcp_timer_pcbs == pcb) {
+		tcp_timer_pcbs = pcb->tmr_next;
+	}
+	else {
+		return;
+	}
+	if (pcb->tmr_next != NULL) {
+		pcb->tmr_next->tmr_prev = pcb->tmr_prev;
+	}
+	pcb->tmr_next = NULL;
+	pcb->tmr_prev = NULL;
+}
+
+void
+tcp_output_pcb_defer(struct tcp_pcb *pcb)
+{
+	if ((pcb->out_prev != NULL) || (tcp_output_pcbs == pcb)) {
+		return;
+	}
+	pcb->out_prev = NULL;
+	pcb->out_next = tcp_output_pcbs;
+	if (tcp_output_pcbs != NULL) {
+		tcp_output_pcbs->out_prev = pcb;
+	}
+	tcp_output_pcbs = pcb;
+}
+
+void
+tcp_output_pcb_undefer(struct tcp_pcb *pcb)
+{
+	if (pcb->out_prev != NULL) {
+		pcb->out_prev->out_next = pcb->out_next;
+	}
+	else if (tcp_output_pcbs == pcb) {
+		tcp_output_pcbs = pcb->out_next;
+	}
+	else {
+		return;
+	}
+	if (pcb->out_next != NULL) {
+		pcb->out_next->out_prev = pcb->out_prev;
+	}
+	pcb->out_next = NULL;
+	pcb->out_prev = NULL;
+}
+
+void
+tcp_output_set_deferred(u8_t deferred)
+{
+	tcp_output_deferred = deferred;
+}
+
+void
+tcp_output_flush(void)
+{
+	tcp_output_deferred = 0;
+	while (tcp_output_pcbs != NULL) {
+		struct tcp_pcb *pcb = tcp_output_pcbs;
+		tcp_output_pcb_undefer(pcb);
+		if ((pcb->state != CLOSED) && (pcb->state != LISTEN)) {
+			tcp_output(pcb);
+		}
+	}
+}
+
+/**
+ * Returns 1 if neither tcp_fasttmr nor tcp_slowtmr has anything to do for the
+ * pcb until it sees activity again. Keepalive only counts if SOF_KEEPALIVE was
+ * set before the pcb went idle.
+ */
+static int
+tcp_timer_pcb_idle(const struct tcp_pcb *pcb)
+{
+#if LWIP_CALLBACK_API
+	return ((pcb->state == ESTABLISHED) || (pcb->state == CLOSE_WAIT)) &&
+		(pcb->unacked == NULL) && (pcb->unsent == NULL) && (pcb->rtime < 0) &&
+		(pcb->persist_backoff == 0) &&
+#if TCP_QUEUE_OOSEQ
+		(pcb->ooseq == NULL) &&
+#endif /* TCP_QUEUE_OOSEQ */
+		(pcb->refused_data == NULL) &&
+		((pcb->flags & (TF_ACK_DELAY | TF_ACK_NOW | TF_CLOSEPEND | TF_NAGLEMEMERR)) == 0) &&
+		(pcb->poll == NULL) && !ip_get_option(pcb, SOF_KEEPALIVE);
+#else /* LWIP_CALLBACK_API */
+	LWIP_UNUSED_ARG(pcb);
+	/* the poll event is always delivered */
+	return 0;
+#endif /* LWIP_CALLBACK_API */
+}
+
 /** Free a tcp pcb */
 void
 tcp_free(struct tcp_pcb *pcb)
 {
     if (sys_arch_pcb_unwatch(pcb)) {
         LWIP_ASSERT("tcp_free: LISTEN", pcb->state != LISTEN);
+        tcp_timer_pcb_disarm(pcb);
+        tcp_output_pcb_undefer(pcb);
 #if LWIP_TCP_PCB_NUM_EXT_ARGS
         tcp_ext_arg_invoke_callbacks_destroyed(pcb->ext_args);
 #endif
@@ -354,10 +578,15 @@ tcp_backlog_accepted(struct tcp_pcb *pcb)
 static err_t
 tcp_close_shutdown(struct tcp_pcb *pcb, u8_t rst_on_unacked_data)
 {
+	u8_t refuse;
+
 	LWIP_ASSERT("tcp_close_shutdown: invalid pcb", pcb != NULL);
 
-	if (rst_on_unacked_data && ((pcb->state == ESTABLISHED) || (pcb->state == CLOSE_WAIT))) {
-		if ((pcb->refused_data != NULL) || (pcb->rcv_wnd != TCP_WND_MAX(pcb))) {
+	/* 25. tun2socks: a SYN whose SYN|ACK is still held back gets a RST. */
+	refuse = (pcb->state == SYN_RCVD) && pcb->syn_held;
+
+	if (refuse || (rst_on_unacked_data && ((pcb->state == ESTABLISHED) || (pcb->state == CLOSE_WAIT)))) {
+		if (refuse || (pcb->refused_data != NULL) || (pcb->rcv_wnd != TCP_WND_MAX(pcb))) {
 			/* Not all data received by application, send RST to tell the remote
 			   side about this. */
 			LWIP_ASSERT("pcb->flags & TF_RXCLOSED", pcb->flags & TF_RXCLOSED);
@@ -419,6 +648,8 @@ tcp_close_shutdown_fin(struct tcp_pcb *pcb)
 	err_t err;
 	LWIP_ASSERT("pcb != NULL", pcb != NULL);
 
+	tcp_timer_pcb_arm(pcb);
+
 	switch (pcb->state) {
 	case SYN_RCVD:
 		err = tcp_send_fin(pcb);
@@ -933,6 +1164,7 @@ struct tcp_pcb *
 	tcp_free(pcb);
 #if LWIP_CALLBACK_API
 	lpcb->accept = tcp_accept_null;
+	lpcb->syn = NULL;
 #endif /* LWIP_CALLBACK_API */
 #if TCP_LISTEN_BACKLOG
 	lpcb->accepts_pending = 0;
@@ -1227,7 +1459,7 @@ tcp_connect(struct tcp_pcb *pcb, const ip_addr_t *ipaddr, u16_t port,
 void
 tcp_slowtmr(void)
 {
-	struct tcp_pcb *pcb, *prev;
+	struct tcp_pcb *pcb, *prev, *next;
 	tcpwnd_size_t eff_wnd;
 	u8_t pcb_remove;      /* flag if a PCB should be removed */
 	u8_t pcb_reset;       /* flag if a RST should be sent when removing */
@@ -1239,9 +1471,8 @@ tcp_slowtmr(void)
 	++tcp_timer_ctr;
 
 tcp_slowtmr_start:
-	/* Steps through all of the active PCBs. */
-	prev = NULL;
-	pcb = tcp_active_pcbs;
+	/* Steps through all of the active PCBs with timer work pending. */
+	pcb = tcp_timer_pcbs;
 	if (pcb == NULL) {
 		LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: no active pcbs\n"));
 	}
@@ -1252,8 +1483,7 @@ tcp_slowtmr_start:
 		LWIP_ASSERT("tcp_slowtmr: active pcb->state != TIME-WAIT\n", pcb->state != TIME_WAIT);
 		if (pcb->last_timer == tcp_timer_ctr) {
 			/* skip this pcb, we have already processed it */
-			prev = pcb;
-			pcb = pcb->next;
+			pcb = pcb->tmr_next;
 			continue;
 		}
 		pcb->last_timer = tcp_timer_ctr;
@@ -1405,6 +1635,11 @@ tcp_slowtmr_start:
 			if ((u32_t)(tcp_ticks - pcb->tmr) >
 				TCP_SYN_RCVD_TIMEOUT / TCP_SLOW_INTERVAL) {
 				++pcb_remove;
+				/* 26. tun2socks: the client of a held SYN never got an answer,
+				   refuse it like tcp_close_shutdown() does. */
+				if (pcb->syn_held) {
+					++pcb_reset;
+				}
 				LWIP_DEBUGF(TCP_DEBUG, ("tcp_slowtmr: removing pcb stuck in SYN-RCVD\n"));
 			}
 		}
@@ -1426,16 +1661,9 @@ tcp_slowtmr_start:
 			void *err_arg;
 			enum tcp_state last_state;
 			tcp_pcb_purge(pcb);
-			/* Remove PCB from tcp_active_pcbs list. */
-			if (prev != NULL) {
-				LWIP_ASSERT("tcp_slowtmr: middle tcp != tcp_active_pcbs", pcb != tcp_active_pcbs);
-				prev->next = pcb->next;
-			}
-			else {
-				/* This PCB was the first. */
-				LWIP_ASSERT("tcp_slowtmr: first pcb == tcp_active_pcbs", tcp_active_pcbs == pcb);
-				tcp_active_pcbs = pcb->next;
-			}
+			next = pcb->tmr_next;
+			/* Remove PCB from tcp_active_pcbs list, the hash and tcp_timer_pcbs. */
+			TCP_RMV(&tcp_active_pcbs, pcb);
 
 			if (pcb_reset) {
 				tcp_rst(pcb, pcb->snd_nxt, pcb->rcv_nxt, &pcb->local_ip, &pcb->remote_ip,
@@ -1445,7 +1673,7 @@ tcp_slowtmr_start:
 			err_arg = pcb->callback_arg;
 			last_state = pcb->state;
 			pcb2 = pcb;
-			pcb = pcb->next;
+			pcb = next;
 			tcp_free(pcb2);
 
 			tcp_active_pcbs_changed = 0;
@@ -1457,7 +1685,7 @@ tcp_slowtmr_start:
 		else {
 			/* get the 'next' element now and work with 'prev' below (in case of abort) */
 			prev = pcb;
-			pcb = pcb->next;
+			pcb = pcb->tmr_next;
 
 			/* We check if we should poll the connection. */
 			++prev->polltmr;
@@ -1470,16 +1698,19 @@ tcp_slowtmr_start:
 					goto tcp_slowtmr_start;
 				}
 				/* if err == ERR_ABRT, 'prev' is already deallocated */
-				if (err == ERR_OK) {
-					tcp_output(prev);
+				if (err != ERR_OK) {
+					continue;
 				}
+				tcp_output(prev);
+			}
+			if (tcp_timer_pcb_idle(prev)) {
+				tcp_timer_pcb_disarm(prev);
 			}
 		}
 	}
 
 
 	/* Steps through all of the TIME-WAIT PCBs. */
-	prev = NULL;
 	pcb = tcp_tw_pcbs;
 	while (pcb != NULL) {
 		LWIP_ASSERT("tcp_slowtmr: TIME-WAIT pcb->state == TIME-WAIT", pcb->state == TIME_WAIT);
@@ -1494,22 +1725,14 @@ tcp_slowtmr_start:
 		if (pcb_remove) {
 			struct tcp_pcb *pcb2;
 			tcp_pcb_purge(pcb);
-			/* Remove PCB from tcp_tw_pcbs list. */
-			if (prev != NULL) {
-				LWIP_ASSERT("tcp_slowtmr: middle tcp != tcp_tw_pcbs", pcb != tcp_tw_pcbs);
-				prev->next = pcb->next;
-			}
-			else {
-				/* This PCB was the first. */
-				LWIP_ASSERT("tcp_slowtmr: first pcb == tcp_tw_pcbs", tcp_tw_pcbs == pcb);
-				tcp_tw_pcbs = pcb->next;
-			}
+			next = pcb->next;
+			/* Remove PCB from tcp_tw_pcbs list and the hash. */
+			TCP_RMV(&tcp_tw_pcbs, pcb);
 			pcb2 = pcb;
-			pcb = pcb->next;
+			pcb = next;
 			tcp_free(pcb2);
 		}
 		else {
-			prev = pcb;
 			pcb = pcb->next;
 		}
 	}
@@ -1529,7 +1752,7 @@ tcp_fasttmr(void)
 	++tcp_timer_ctr;
 
 tcp_fasttmr_start:
-	pcb = tcp_active_pcbs;
+	pcb = tcp_timer_pcbs;
 
 	while (pcb != NULL) {
 		if (pcb->last_timer != tcp_timer_ctr) {
@@ -1549,7 +1772,7 @@ tcp_fasttmr_start:
 				tcp_close_shutdown_fin(pcb);
 			}
 
-			next = pcb->next;
+			next = pcb->tmr_next;
 
 			/* If there is data which was previously "refused" by upper layer */
 			if (pcb->refused_data != NULL) {
@@ -1560,10 +1783,13 @@ tcp_fasttmr_start:
 					goto tcp_fasttmr_start;
 				}
 			}
+			if (tcp_timer_pcb_idle(pcb)) {
+				tcp_timer_pcb_disarm(pcb);
+			}
 			pcb = next;
 		}
 		else {
-			pcb = pcb->next;
+			pcb = pcb->tmr_next;
 		}
 	}
 }
@@ -1946,6 +2172,7 @@ struct tcp_pcb *
 		/* Start with a window that does not need scaling. When window scaling is
 		   enabled and used, the window is enlarged when both sides agree on scaling. */
 		pcb->rcv_wnd = pcb->rcv_ann_wnd = TCPWND_MIN16(TCP_WND);
+		pcb->rcv_wnd_max = TCP_WND;
 		pcb->ttl = TCP_TTL;
 		/* As initial send MSS, we use TCP_MSS but limit it to 536.
 		   The send MSS is updated when an MSS option is received. */
@@ -2153,6 +2380,31 @@ void tcp_accept(struct tcp_pcb *pcb, tcp_accept_fn accept)
 		lpcb->accept = accept;
 	}
 }
+
+/*
+	25. tun2socks: see tcp_syn_fn.
+*/
+void tcp_syn(struct tcp_pcb *pcb, tcp_syn_fn syn)
+{
+	LWIP_ASSERT_CORE_LOCKED();
+	if ((pcb != NULL) && (pcb->state == LISTEN)) {
+		struct tcp_pcb_listen *lpcb = (struct tcp_pcb_listen *)pcb;
+		lpcb->syn = syn;
+	}
+}
+
+void tcp_syn_release(struct tcp_pcb *pcb)
+{
+	if (!sys_arch_pcb_is_watch(pcb)) {
+		return;
+	}
+
+	LWIP_ASSERT_CORE_LOCKED();
+	if (pcb->syn_held) {
+		pcb->syn_held = 0;
+		tcp_output(pcb);
+	}
+}
 #endif /* LWIP_CALLBACK_API */
 
 
@@ -2187,6 +2439,7 @@ tcp_poll(struct tcp_pcb *pcb, tcp_poll_fn poll, u8_t interval)
 	LWIP_UNUSED_ARG(poll);
 #endif /* LWIP_CALLBACK_API */
 	pcb->pollinterval = interval;
+	tcp_timer_pcb_arm(pcb);
 }
 
 /**
@@ -2290,7 +2543,7 @@ tcp_next_iss(struct tcp_pcb *pcb)
 	LWIP_ASSERT("tcp_next_iss: invalid pcb", pcb != NULL);
 	return LWIP_HOOK_TCP_ISN(&pcb->local_ip, pcb->local_port, &pcb->remote_ip, pcb->remote_port);
 #else /* LWIP_HOOK_TCP_ISN */
-	static u32_t iss = 6510;
+	static LWIP_THREAD_LOCAL u32_t iss = 6510;
 
 	LWIP_ASSERT("tcp_next_iss: invalid pcb", pcb != NULL);
 	LWIP_UNUSED_ARG(pcb);
@@ -71,21 +71,24 @@
 /* These variables are global to all functions involved in the input
    processing of TCP segments. They are set by the tcp_input()
    function. */
-static struct tcp_seg inseg;
-static struct tcp_hdr *tcphdr;
-static u16_t tcphdr_optlen;
-static u16_t tcphdr_opt1len;
-static u8_t *tcphdr_opt2;
-static u16_t tcp_optidx;
-static u32_t seqno, ackno;
-static tcpwnd_size_t recv_acked;
-static u16_t tcplen;
-static u8_t flags;
-
-static u8_t recv_flags;
-static struct pbuf *recv_data;
-
-struct tcp_pcb *tcp_input_pcb;
+/*
+	15. tun2socks: one stack per worker thread, see LWIP_THREAD_LOCAL in arch/cc.h.
+*/
+static LWIP_THREAD_LOCAL struct tcp_seg inseg;
+static LWIP_THREAD_LOCAL struct tcp_hdr *tcphdr;
+static LWIP_THREAD_LOCAL u16_t tcphdr_optlen;
+static LWIP_THREAD_LOCAL u16_t tcphdr_opt1len;
+static LWIP_THREAD_LOCAL u8_t *tcphdr_opt2;
+static LWIP_THREAD_LOCAL u16_t tcp_optidx;
+static LWIP_THREAD_LOCAL u32_t seqno, ackno;
+static LWIP_THREAD_LOCAL tcpwnd_size_t recv_acked;
+static LWIP_THREAD_LOCAL u16_t tcplen;
+static LWIP_THREAD_LOCAL u8_t flags;
+
+static LWIP_THREAD_LOCAL u8_t recv_flags;
+static LWIP_THREAD_LOCAL struct pbuf *recv_data;
+
+LWIP_THREAD_LOCAL struct tcp_pcb *tcp_input_pcb;
 
 /* Forward declarations. */
 static err_t tcp_process(struct tcp_pcb *pcb);
@@ -244,18 +247,20 @@ tcp_input(struct pbuf *p, struct netif *inp)
   }
 
   /* Demultiplex an incoming segment. First, we check if it is destined
-     for an active connection. */
-  prev = NULL;
-
-  for (pcb = tcp_active_pcbs; pcb != NULL; pcb = pcb->next) {
-    LWIP_ASSERT("tcp_input: active pcb->state != CLOSED", pcb->state != CLOSED);
-    LWIP_ASSERT("tcp_input: active pcb->state != TIME-WAIT", pcb->state != TIME_WAIT);
-    LWIP_ASSERT("tcp_input: active pcb->state != LISTEN", pcb->state != LISTEN);
+     for an active or a TIME-WAIT connection. */
+  /*
+	16. tun2socks: look the 4-tuple up in tcp_pcb_hash instead of walking
+	tcp_active_pcbs and tcp_tw_pcbs.
+  */
+  for (pcb = tcp_pcb_hash[tcp_pcb_hash_index(ip_current_dest_addr(), tcphdr->dest,
+                                              ip_current_src_addr(), tcphdr->src)];
+       pcb != NULL; pcb = pcb->hash_next) {
+    LWIP_ASSERT("tcp_input: hashed pcb->state != CLOSED", pcb->state != CLOSED);
+    LWIP_ASSERT("tcp_input: hashed pcb->state != LISTEN", pcb->state != LISTEN);
 
     /* check if PCB is bound to specific netif */
     if ((pcb->netif_idx != NETIF_NO_INDEX) &&
         (pcb->netif_idx != netif_get_index(ip_data.current_input_netif))) {
-      prev = pcb;
       continue;
     }
 
@@ -263,55 +268,24 @@ tcp_input(struct pbuf *p, struct netif *inp)
         pcb->local_port == tcphdr->dest &&
         ip_addr_cmp(&pcb->remote_ip, ip_current_src_addr()) &&
         ip_addr_cmp(&pcb->local_ip, ip_current_dest_addr())) {
-      /* Move this PCB to the front of the list so that subsequent
-         lookups will be faster (we exploit locality in TCP segment
-         arrivals). */
-      LWIP_ASSERT("tcp_input: pcb->next != pcb (before cache)", pcb->next != pcb);
-      if (prev != NULL) {
-        prev->next = pcb->next;
-        pcb->next = tcp_active_pcbs;
-        tcp_active_pcbs = pcb;
-      } else {
-        TCP_STATS_INC(tcp.cachehit);
-      }
-      LWIP_ASSERT("tcp_input: pcb->next != pcb (after cache)", pcb->next != pcb);
       break;
     }
-    prev = pcb;
   }
 
-  if (pcb == NULL) {
-    /* If it did not go to an active connection, we check the connections
-       in the TIME-WAIT state. */
-    for (pcb = tcp_tw_pcbs; pcb != NULL; pcb = pcb->next) {
-      LWIP_ASSERT("tcp_input: TIME-WAIT pcb->state == TIME-WAIT", pcb->state == TIME_WAIT);
-
-      /* check if PCB is bound to specific netif */
-      if ((pcb->netif_idx != NETIF_NO_INDEX) &&
-          (pcb->netif_idx != netif_get_index(ip_data.current_input_netif))) {
-        continue;
-      }
-
-      if (pcb->remote_port == tcphdr->src &&
-          pcb->local_port == tcphdr->dest &&
-          ip_addr_cmp(&pcb->remote_ip, ip_current_src_addr()) &&
-          ip_addr_cmp(&pcb->local_ip, ip_current_dest_addr())) {
-        /* We don't really care enough to move this PCB to the front
-           of the list since we are not very likely to receive that
-           many segments for connections in TIME-WAIT. */
-        LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_input: packed for TIME_WAITing connection.\n"));
+  if (pcb != NULL && pcb->state == TIME_WAIT) {
+    LWIP_DEBUGF(TCP_INPUT_DEBUG, ("tcp_input: packed for TIME_WAITing connection.\n"));
 #ifdef LWIP_HOOK_TCP_INPACKET_PCB
-        if (LWIP_HOOK_TCP_INPACKET_PCB(pcb, tcphdr, tcphdr_optlen, tcphdr_opt1len,
-                                       tcphdr_opt2, p) == ERR_OK)
+    if (LWIP_HOOK_TCP_INPACKET_PCB(pcb, tcphdr, tcphdr_optlen, tcphdr_opt1len,
+                                   tcphdr_opt2, p) == ERR_OK)
 #endif
-        {
-          tcp_timewait_input(pcb);
-        }
-        pbuf_free(p);
-        return;
-      }
+    {
+      tcp_timewait_input(pcb);
     }
+    pbuf_free(p);
+    return;
+  }
 
+  if (pcb == NULL) {
     /* Finally, if we still did not get a match, we check all PCBs that
        are LISTENing for incoming connections. */
 	/*
@@ -731,6 +705,20 @@ tcp_listen_input(struct tcp_pcb_listen *pcb)
       tcp_abandon(npcb, 0);
       return;
     }
+#if LWIP_CALLBACK_API
+    /* 25. tun2socks: the application decides when the SYN|ACK goes out. */
+    if (pcb->syn != NULL) {
+      npcb->syn_held = 1;
+      npcb->syn_accepted = 1;
+      rc = pcb->syn(pcb->callback_arg, npcb);
+      if (rc != ERR_OK) {
+        if (rc != ERR_ABRT) {
+          tcp_abort(npcb);
+        }
+        return;
+      }
+    }
+#endif /* LWIP_CALLBACK_API */
     tcp_output(npcb);
   }
   return;
@@ -935,6 +923,11 @@ tcp_process(struct tcp_pcb *pcb)
         if (TCP_SEQ_BETWEEN(ackno, pcb->lastack + 1, pcb->snd_nxt)) {
           pcb->state = ESTABLISHED;
           LWIP_DEBUGF(TCP_DEBUG, ("TCP connection established %" U16_F " -> %"  U16_F  ".\n", inseg.tcphdr->src, inseg.tcphdr->dest));
+          if (pcb->syn_accepted) {
+            /* 25. tun2socks: the syn callback handed it out already. */
+            tcp_backlog_accepted(pcb);
+            err = ERR_OK;
+          } else
 #if LWIP_CALLBACK_API || TCP_LISTEN_BACKLOG
           if (pcb->listener == NULL) {
             /* listen pcb might be closed by now */
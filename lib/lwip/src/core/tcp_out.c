@@ -441,6 +441,8 @@ tcp_write(struct tcp_pcb *pcb, const void *arg, u16_t len, u8_t apiflags)
 	if (err != ERR_OK) {
 		return err;
 	}
+	/* 19. tun2socks: queued data needs the timers again. */
+	tcp_timer_pcb_arm(pcb);
 	queuelen = pcb->snd_queuelen;
 
 #if LWIP_TCP_TIMESTAMPS
@@ -1272,6 +1274,9 @@ tcp_output(struct tcp_pcb *pcb)
 	LWIP_ASSERT("don't call tcp_output for listen-pcbs",
 		pcb->state != LISTEN);
 
+	/* 19. tun2socks: whatever is sent or left unsent needs the timers again. */
+	tcp_timer_pcb_arm(pcb);
+
 	/* First, check if we are invoked by the TCP input processing
 	   code. If so, we do not output anything. Instead, we rely on the
 	   input processing code to call us when input processing is done
@@ -1280,6 +1285,17 @@ tcp_output(struct tcp_pcb *pcb)
 		return ERR_OK;
 	}
 
+	/* 25. tun2socks: nothing goes out before tcp_syn_release(). */
+	if (pcb->syn_held) {
+		return ERR_OK;
+	}
+
+	/* 24. tun2socks: sent by tcp_output_flush() at the end of the batch. */
+	if (tcp_output_deferred) {
+		tcp_output_pcb_defer(pcb);
+		return ERR_OK;
+	}
+
 	wnd = LWIP_MIN(pcb->snd_wnd, pcb->cwnd);
 
 	seg = pcb->unsent;
@@ -1634,8 +1650,11 @@ tcp_output_segment(struct tcp_seg *seg, struct tcp_pcb *pcb, struct netif *netif
 	TCP_STATS_INC(tcp.xmit);
 
 	NETIF_SET_HINTS(netif, &(pcb->netif_hints));
+	/* 30. tun2socks: tells the netif the size to cut the segment at. */
+	tcp_output_gso_mss = pcb->gso_mss;
 	err = ip_output_if(seg->p, &pcb->local_ip, &pcb->remote_ip, pcb->ttl,
 		pcb->tos, IP_PROTO_TCP, netif);
+	tcp_output_gso_mss = 0;
 	NETIF_RESET_HINTS(netif);
 
 #if TCP_CHECKSUM_ON_COPY
@@ -118,10 +118,29 @@ const int lwip_num_cyclic_timers = LWIP_ARRAYSIZE(lwip_cyclic_timers);
 
 #if LWIP_TIMERS && !LWIP_TIMERS_CUSTOM
 
+/*
+	15. tun2socks: one stack per worker thread, see LWIP_THREAD_LOCAL in arch/cc.h.
+*/
 /** The one and only timeout list */
-static struct sys_timeo *next_timeout;
+static LWIP_THREAD_LOCAL struct sys_timeo *next_timeout;
 
-static u32_t current_timeout_due_time;
+static LWIP_THREAD_LOCAL u32_t current_timeout_due_time;
+
+/*
+	18. tun2socks: called whenever a timeout becomes the earliest one.
+*/
+static LWIP_THREAD_LOCAL struct sys_timeouts_changed_info
+{
+  sys_timeouts_changed_fn fn;
+  void *arg;
+} sys_timeouts_changed;
+
+void
+sys_timeouts_set_changed_callback(sys_timeouts_changed_fn fn, void *arg)
+{
+  sys_timeouts_changed.fn = fn;
+  sys_timeouts_changed.arg = arg;
+}
 
 #if LWIP_TESTMODE
 struct sys_timeo**
@@ -133,7 +152,7 @@ sys_timeouts_get_next_timeout(void)
 
 #if LWIP_TCP
 /** global variable that shows if the tcp timer is currently scheduled or not */
-static int tcpip_tcp_timer_active;
+static LWIP_THREAD_LOCAL int tcpip_tcp_timer_active;
 
 /**
  * Timer callback function that calls tcp_tmr() and reschedules itself.
@@ -202,13 +221,12 @@ sys_timeout_abs(u32_t abs_time, sys_timeout_handler handler, void *arg)
                              (void *)timeout, abs_time, handler_name, (void *)arg));
 #endif /* LWIP_DEBUG_TIMERNAMES */
 
-  if (next_timeout == NULL) {
-    next_timeout = timeout;
-    return;
-  }
-  if (TIME_LESS_THAN(timeout->time, next_timeout->time)) {
+  if (next_timeout == NULL || TIME_LESS_THAN(timeout->time, next_timeout->time)) {
     timeout->next = next_timeout;
     next_timeout = timeout;
+    if (sys_timeouts_changed.fn != NULL) {
+      sys_timeouts_changed.fn(sys_timeouts_changed.arg);
+    }
   } else {
     for (t = next_timeout; t != NULL; t = t->next) {
       if ((t->next == NULL) || TIME_LESS_THAN(timeout->time, t->next->time)) {
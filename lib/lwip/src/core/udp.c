@@ -77,11 +77,12 @@
 /*
   10. tun2socks: We need a global function to be called when new udp connection is created.
 */
-static struct udp_create_info
+struct udp_create_info
 {
     udp_crt_fn fn;
     void*      arg;
-} udp_create_fn;
+};
+static LWIP_THREAD_LOCAL struct udp_create_info udp_create_fn;
 
 void udp_create(udp_crt_fn create_fn, void* create_arg)
 {
@@ -89,12 +90,105 @@ void udp_create(udp_crt_fn create_fn, void* create_arg)
     udp_create_fn.arg = create_arg;
 }
 
+/*
+	15. tun2socks: one stack per worker thread, see LWIP_THREAD_LOCAL in arch/cc.h.
+*/
 /* last local UDP port */
-static u16_t udp_port = UDP_LOCAL_PORT_RANGE_START;
+static LWIP_THREAD_LOCAL u16_t udp_port = UDP_LOCAL_PORT_RANGE_START;
 
 /* The list of UDP PCBs */
 /* exported in udp.h (was static) */
-struct udp_pcb *udp_pcbs;
+LWIP_THREAD_LOCAL struct udp_pcb *udp_pcbs;
+
+/*
+	17. tun2socks: connected pcbs with specific addresses on both ends are also
+	indexed by their 4-tuple, so udp_input does not walk udp_pcbs for every
+	datagram. udp_pcbs is only walked while it holds pcbs outside the index.
+*/
+#ifndef UDP_PCB_HASH_SIZE
+#define UDP_PCB_HASH_SIZE 16384
+#endif
+#if (UDP_PCB_HASH_SIZE & (UDP_PCB_HASH_SIZE - 1)) != 0
+#error "UDP_PCB_HASH_SIZE must be a power of two"
+#endif
+static LWIP_THREAD_LOCAL struct udp_pcb **udp_pcb_hash;
+/* number of pcbs on udp_pcbs that are not in udp_pcb_hash */
+static LWIP_THREAD_LOCAL u32_t udp_pcbs_unhashed;
+
+static u32_t
+udp_pcb_hash_addr(const ip_addr_t *addr)
+{
+#if LWIP_IPV6
+  if (IP_IS_V6(addr)) {
+    const u32_t *a = ip_2_ip6(addr)->addr;
+    return a[0] ^ a[1] ^ a[2] ^ a[3];
+  }
+#endif /* LWIP_IPV6 */
+#if LWIP_IPV4
+  return ip4_addr_get_u32(ip_2_ip4(addr));
+#else
+  return 0;
+#endif /* LWIP_IPV4 */
+}
+
+static u32_t
+udp_pcb_hash_index(const ip_addr_t *local_ip, u16_t local_port,
+                   const ip_addr_t *remote_ip, u16_t remote_port)
+{
+  u32_t h = udp_pcb_hash_addr(local_ip);
+  h ^= (h >> 16) ^ udp_pcb_hash_addr(remote_ip) * 0x9e3779b1U;
+  h ^= ((u32_t)local_port << 16) | remote_port;
+  /* finalizer of murmur3 */
+  h ^= h >> 16;
+  h *= 0x85ebca6bU;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35U;
+  h ^= h >> 16;
+  return h & (UDP_PCB_HASH_SIZE - 1);
+}
+
+/* Returns 1 if the pcb was in the index. */
+static u8_t
+udp_pcb_hash_unlink(struct udp_pcb *pcb)
+{
+  struct udp_pcb **link;
+
+  if ((pcb->flags & UDP_FLAGS_HASHED) == 0) {
+    return 0;
+  }
+  link = &udp_pcb_hash[udp_pcb_hash_index(&pcb->local_ip, pcb->local_port,
+                                          &pcb->remote_ip, pcb->remote_port)];
+  for (; *link != NULL; link = &(*link)->hash_next) {
+    if (*link == pcb) {
+      *link = pcb->hash_next;
+      break;
+    }
+  }
+  pcb->hash_next = NULL;
+  udp_clear_flags(pcb, UDP_FLAGS_HASHED);
+  return 1;
+}
+
+/* Re-indexes a pcb on udp_pcbs after its addresses or ports changed. */
+static void
+udp_pcb_hash_update(struct udp_pcb *pcb)
+{
+  struct udp_pcb **bucket;
+
+  if (udp_pcb_hash_unlink(pcb)) {
+    udp_pcbs_unhashed++;
+  }
+  if ((pcb->flags & UDP_FLAGS_CONNECTED) == 0 ||
+      ip_addr_isany(&pcb->local_ip) || ip_addr_isany(&pcb->remote_ip)) {
+    return;
+  }
+  bucket = &udp_pcb_hash[udp_pcb_hash_index(&pcb->local_ip, pcb->local_port,
+                                            &pcb->remote_ip, pcb->remote_port)];
+  pcb->hash_next = *bucket;
+  *bucket = pcb;
+  udp_set_flags(pcb, UDP_FLAGS_HASHED);
+  udp_pcbs_unhashed--;
+}
 
 /**
  * Initialize this module.
@@ -107,6 +201,11 @@ udp_init(void)
 #endif /* LWIP_RAND */
   udp_create_fn.fn  = NULL;
   udp_create_fn.arg = NULL;
+  if (udp_pcb_hash == NULL) {
+    udp_pcb_hash = (struct udp_pcb **)mem_calloc(UDP_PCB_HASH_SIZE, sizeof(struct udp_pcb *));
+    LWIP_ASSERT("udp_init: failed to allocate udp_pcb_hash", udp_pcb_hash != NULL);
+  }
+  udp_pcbs_unhashed = 0;
 }
 
 /**
@@ -265,64 +364,81 @@ udp_input(struct pbuf *p, struct netif *inp)
   pcb = NULL;
   prev = NULL;
   uncon_pcb = NULL;
-  /* Iterate through the UDP pcb list for a matching pcb.
-   * 'Perfect match' pcbs (connected to the remote port & ip address) are
-   * preferred. If no perfect match is found, the first unconnected pcb that
-   * matches the local port and ip address gets the datagram. */
-  for (pcb = udp_pcbs; pcb != NULL; pcb = pcb->next) {
-    /* print the PCB local and remote address */
-    LWIP_DEBUGF(UDP_DEBUG, ("pcb ("));
-    ip_addr_debug_print_val(UDP_DEBUG, pcb->local_ip);
-    LWIP_DEBUGF(UDP_DEBUG, (", %" U16_F ") <-- (", pcb->local_port));
-    ip_addr_debug_print_val(UDP_DEBUG, pcb->remote_ip);
-    LWIP_DEBUGF(UDP_DEBUG, (", %" U16_F ")\n", pcb->remote_port));
-
-    /* compare PCB local addr+port to UDP destination addr+port */
-    if ((pcb->local_port == dest) &&
-        (udp_input_local_match(pcb, inp, broadcast) != 0)) {
-      if ((pcb->flags & UDP_FLAGS_CONNECTED) == 0) {
-        if (uncon_pcb == NULL) {
-          /* the first unconnected matching PCB */
-          uncon_pcb = pcb;
+  /* 17. tun2socks: perfect matches come from udp_pcb_hash. */
+  if (!broadcast) {
+    for (pcb = udp_pcb_hash[udp_pcb_hash_index(ip_current_dest_addr(), dest,
+                                                ip_current_src_addr(), src)];
+         pcb != NULL; pcb = pcb->hash_next) {
+      if ((pcb->local_port == dest) &&
+          (pcb->remote_port == src) &&
+          ((pcb->netif_idx == NETIF_NO_INDEX) || (pcb->netif_idx == netif_get_index(inp))) &&
+          ip_addr_cmp(&pcb->local_ip, ip_current_dest_addr()) &&
+          ip_addr_cmp(&pcb->remote_ip, ip_current_src_addr())) {
+        UDP_STATS_INC(udp.cachehit);
+        break;
+      }
+    }
+  }
+  if (pcb == NULL && udp_pcbs_unhashed != 0) {
+    /* Iterate through the UDP pcb list for a matching pcb.
+     * 'Perfect match' pcbs (connected to the remote port & ip address) are
+     * preferred. If no perfect match is found, the first unconnected pcb that
+     * matches the local port and ip address gets the datagram. */
+    for (pcb = udp_pcbs; pcb != NULL; pcb = pcb->next) {
+      /* print the PCB local and remote address */
+      LWIP_DEBUGF(UDP_DEBUG, ("pcb ("));
+      ip_addr_debug_print_val(UDP_DEBUG, pcb->local_ip);
+      LWIP_DEBUGF(UDP_DEBUG, (", %" U16_F ") <-- (", pcb->local_port));
+      ip_addr_debug_print_val(UDP_DEBUG, pcb->remote_ip);
+      LWIP_DEBUGF(UDP_DEBUG, (", %" U16_F ")\n", pcb->remote_port));
+
+      /* compare PCB local addr+port to UDP destination addr+port */
+      if ((pcb->local_port == dest) &&
+          (udp_input_local_match(pcb, inp, broadcast) != 0)) {
+        if ((pcb->flags & UDP_FLAGS_CONNECTED) == 0) {
+          if (uncon_pcb == NULL) {
+            /* the first unconnected matching PCB */
+            uncon_pcb = pcb;
 #if LWIP_IPV4
-        } else if (broadcast && ip4_current_dest_addr()->addr == IPADDR_BROADCAST) {
-          /* global broadcast address (only valid for IPv4; match was checked before) */
-          if (!IP_IS_V4_VAL(uncon_pcb->local_ip) || !ip4_addr_cmp(ip_2_ip4(&uncon_pcb->local_ip), netif_ip4_addr(inp))) {
-            /* uncon_pcb does not match the input netif, check this pcb */
-            if (IP_IS_V4_VAL(pcb->local_ip) && ip4_addr_cmp(ip_2_ip4(&pcb->local_ip), netif_ip4_addr(inp))) {
-              /* better match */
-              uncon_pcb = pcb;
+          } else if (broadcast && ip4_current_dest_addr()->addr == IPADDR_BROADCAST) {
+            /* global broadcast address (only valid for IPv4; match was checked before) */
+            if (!IP_IS_V4_VAL(uncon_pcb->local_ip) || !ip4_addr_cmp(ip_2_ip4(&uncon_pcb->local_ip), netif_ip4_addr(inp))) {
+              /* uncon_pcb does not match the input netif, check this pcb */
+              if (IP_IS_V4_VAL(pcb->local_ip) && ip4_addr_cmp(ip_2_ip4(&pcb->local_ip), netif_ip4_addr(inp))) {
+                /* better match */
+                uncon_pcb = pcb;
+              }
             }
-          }
 #endif /* LWIP_IPV4 */
-        }
+          }
 #if SO_REUSE
-        else if (!ip_addr_isany(&pcb->local_ip)) {
-          /* prefer specific IPs over catch-all */
-          uncon_pcb = pcb;
-        }
+          else if (!ip_addr_isany(&pcb->local_ip)) {
+            /* prefer specific IPs over catch-all */
+            uncon_pcb = pcb;
+          }
 #endif /* SO_REUSE */
-      }
+        }
 
-      /* compare PCB remote addr+port to UDP source addr+port */
-      if ((pcb->remote_port == src) &&
-          (ip_addr_isany_val(pcb->remote_ip) ||
-           ip_addr_cmp(&pcb->remote_ip, ip_current_src_addr()))) {
-        /* the first fully matching PCB */
-        if (prev != NULL) {
-          /* move the pcb to the front of udp_pcbs so that is
-             found faster next time */
-          prev->next = pcb->next;
-          pcb->next = udp_pcbs;
-          udp_pcbs = pcb;
-        } else {
-          UDP_STATS_INC(udp.cachehit);
+        /* compare PCB remote addr+port to UDP source addr+port */
+        if ((pcb->remote_port == src) &&
+            (ip_addr_isany_val(pcb->remote_ip) ||
+             ip_addr_cmp(&pcb->remote_ip, ip_current_src_addr()))) {
+          /* the first fully matching PCB */
+          if (prev != NULL) {
+            /* move the pcb to the front of udp_pcbs so that is
+               found faster next time */
+            prev->next = pcb->next;
+            pcb->next = udp_pcbs;
+            udp_pcbs = pcb;
+          } else {
+            UDP_STATS_INC(udp.cachehit);
+          }
+          break;
         }
-        break;
       }
-    }
 
-    prev = pcb;
+      prev = pcb;
+    }
   }
   /* no fully matching pcb found? then look for an unconnected pcb */
   if (pcb == NULL) {
@@ -330,26 +446,24 @@ udp_input(struct pbuf *p, struct netif *inp)
   }
 
   if (pcb == NULL && udp_create_fn.fn != NULL) {
+      /*
+        17. tun2socks: nothing owns this 4-tuple, so the session is inserted
+        directly. udp_bind() would walk udp_pcbs again and refuse a second
+        session to the same destination address and port.
+      */
       pcb = udp_new();
-      if (udp_bind(pcb, ip_current_dest_addr(), dest) == ERR_OK &&
-          udp_connect(pcb, ip_current_src_addr(), src) == ERR_OK) {
+      if (pcb != NULL) {
+          ip_addr_copy(pcb->local_ip, *ip_current_dest_addr());
+          pcb->local_port = dest;
+          ip_addr_copy(pcb->remote_ip, *ip_current_src_addr());
+          pcb->remote_port = src;
+          udp_set_flags(pcb, UDP_FLAGS_CONNECTED);
+          pcb->next = udp_pcbs;
+          udp_pcbs = pcb;
+          udp_pcbs_unhashed++;
+          udp_pcb_hash_update(pcb);
           udp_create_fn.fn(pcb, udp_create_fn.arg);
       }
-      else {
-          udp_remove(pcb);
-          pcb = NULL;
-      }
-      //pcb->local_port = dest;
-      //memcpy(&pcb->local_ip, ip_current_dest_addr(), sizeof(pcb->local_ip));
-      //// udp_connect
-      //pcb->remote_port = src;
-      //memcpy(&pcb->remote_ip, ip_current_src_addr(), sizeof(pcb->remote_ip));
-      //pcb->flags |= UDP_FLAGS_CONNECTED;
-      //// udp_bind
-      //pcb->next = udp_pcbs;
-      //udp_pcbs = pcb;
-      //// maybe handle ERR_ABRT here?
-      //udp_create_fn(pcb);
   }
 
   /* Check checksum if this is a match or if it was directed at us. */
@@ -703,10 +817,11 @@ udp_sendto_if_chksum(struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *dst_i
       }
     } else {
       /* use UDP PCB local IPv6 address as source address, if still valid. */
-      if (netif_get_ip6_addr_match(netif, ip_2_ip6(&pcb->local_ip)) < 0) {
-        /* Address isn't valid anymore. */
-        return ERR_RTE;
-      }
+      /* 13. tun2socks: same as for IPv4 below. */
+      //if (netif_get_ip6_addr_match(netif, ip_2_ip6(&pcb->local_ip)) < 0) {
+      //  /* Address isn't valid anymore. */
+      //  return ERR_RTE;
+      //}
       src_ip = &pcb->local_ip;
     }
   }
@@ -1058,6 +1173,9 @@ udp_bind(struct udp_pcb *pcb, const ip_addr_t *ipaddr, u16_t port)
     }
   }
 
+  if (udp_pcb_hash_unlink(pcb)) {
+    udp_pcbs_unhashed++;
+  }
   ip_addr_set_ipaddr(&pcb->local_ip, ipaddr);
 
   pcb->local_port = port;
@@ -1067,7 +1185,9 @@ udp_bind(struct udp_pcb *pcb, const ip_addr_t *ipaddr, u16_t port)
     /* place the PCB on the active list if not already there */
     pcb->next = udp_pcbs;
     udp_pcbs = pcb;
+    udp_pcbs_unhashed++;
   }
+  udp_pcb_hash_update(pcb);
   LWIP_DEBUGF(UDP_DEBUG | LWIP_DBG_TRACE | LWIP_DBG_STATE, ("udp_bind: bound to "));
   ip_addr_debug_print_val(UDP_DEBUG | LWIP_DBG_TRACE | LWIP_DBG_STATE, pcb->local_ip);
   LWIP_DEBUGF(UDP_DEBUG | LWIP_DBG_TRACE | LWIP_DBG_STATE, (", port %" U16_F ")\n", pcb->local_port));
@@ -1132,6 +1252,9 @@ udp_connect(struct udp_pcb *pcb, const ip_addr_t *ipaddr, u16_t port)
     }
   }
 
+  if (udp_pcb_hash_unlink(pcb)) {
+    udp_pcbs_unhashed++;
+  }
   ip_addr_set_ipaddr(&pcb->remote_ip, ipaddr);
 #if LWIP_IPV6 && LWIP_IPV6_SCOPES
   /* If the given IP address should have a zone but doesn't, assign one now,
@@ -1154,12 +1277,15 @@ udp_connect(struct udp_pcb *pcb, const ip_addr_t *ipaddr, u16_t port)
   for (ipcb = udp_pcbs; ipcb != NULL; ipcb = ipcb->next) {
     if (pcb == ipcb) {
       /* already on the list, just return */
+      udp_pcb_hash_update(pcb);
       return ERR_OK;
     }
   }
   /* PCB not yet on the list, add PCB now */
   pcb->next = udp_pcbs;
   udp_pcbs = pcb;
+  udp_pcbs_unhashed++;
+  udp_pcb_hash_update(pcb);
   return ERR_OK;
 }
 
@@ -1177,6 +1303,9 @@ udp_disconnect(struct udp_pcb *pcb)
 
   LWIP_ERROR("udp_disconnect: invalid pcb", pcb != NULL, return);
 
+  if (udp_pcb_hash_unlink(pcb)) {
+    udp_pcbs_unhashed++;
+  }
   /* reset remote address association */
 #if LWIP_IPV4 && LWIP_IPV6
   if (IP_IS_ANY_TYPE_VAL(pcb->local_ip)) {
@@ -1227,16 +1356,20 @@ void
 udp_remove(struct udp_pcb *pcb)
 {
   struct udp_pcb *pcb2;
+  u8_t hashed, on_list;
 
   LWIP_ASSERT_CORE_LOCKED();
 
   LWIP_ERROR("udp_remove: invalid pcb", pcb != NULL, return);
 
   mib2_udp_unbind(pcb);
+  hashed = udp_pcb_hash_unlink(pcb);
+  on_list = 0;
   /* pcb to be removed is first in list? */
   if (udp_pcbs == pcb) {
     /* make list start at 2nd pcb */
     udp_pcbs = udp_pcbs->next;
+    on_list = 1;
     /* pcb not 1st in list */
   } else {
     for (pcb2 = udp_pcbs; pcb2 != NULL; pcb2 = pcb2->next) {
@@ -1244,10 +1377,14 @@ udp_remove(struct udp_pcb *pcb)
       if (pcb2->next != NULL && pcb2->next == pcb) {
         /* remove pcb from list */
         pcb2->next = pcb->next;
+        on_list = 1;
         break;
       }
     }
   }
+  if (on_list && !hashed) {
+    udp_pcbs_unhashed--;
+  }
   memp_free(MEMP_UDP_PCB, pcb);
 }
 
@@ -1336,7 +1473,11 @@ void udp_netif_ip_addr_changed(const ip_addr_t *old_addr, const ip_addr_t *new_a
       if (ip_addr_cmp(&upcb->local_ip, old_addr)) {
         /* The PCB is bound to the old ipaddr and
          * is set to bound to the new one instead */
+        if (udp_pcb_hash_unlink(upcb)) {
+          udp_pcbs_unhashed++;
+        }
         ip_addr_copy(upcb->local_ip, *new_addr);
+        udp_pcb_hash_update(upcb);
       }
     }
   }
@@ -22,4 +22,16 @@
 
 #define PACK_STRUCT_USE_INCLUDES 1
 
+/*
+	15. tun2socks: every worker thread runs its own stack, the globals of
+	the stack are thread local.
+*/
+#if defined(__cplusplus)
+#define LWIP_THREAD_LOCAL thread_local
+#elif defined(_MSC_VER)
+#define LWIP_THREAD_LOCAL __declspec(thread)
+#else
+#define LWIP_THREAD_LOCAL _Thread_local
+#endif
+
 #endif
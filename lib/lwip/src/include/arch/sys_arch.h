@@ -1,6 +1,9 @@
 #ifndef LWIP_ARCH_SYS_ARCH_H
 #define LWIP_ARCH_SYS_ARCH_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 #define SYS_MBOX_NULL   NULL
 #define SYS_SEM_NULL    NULL
 #define LWIP_NO_UNISTD_H 1
@@ -10,6 +13,26 @@ extern "C" {
 int sys_arch_pcb_watch(void* pcb);
 int sys_arch_pcb_is_watch(void* pcb);
 int sys_arch_pcb_unwatch(void* pcb);
+
+void* sys_arch_mem_malloc(size_t size);
+void* sys_arch_mem_calloc(size_t count, size_t size);
+void  sys_arch_mem_free(void* mem);
+
+/* Usage of one size class, summed over the heaps of all threads.
+   Blocks too large for any class are reported with size 0. */
+struct sys_arch_mem_stats {
+    size_t size;   /* block size, header included */
+    size_t used;   /* blocks handed out */
+    size_t max;    /* high-water mark of used */
+    size_t cached; /* blocks carved from chunks but free */
+};
+/* Fills up to count entries and returns the number of classes. */
+size_t sys_arch_mem_stats(struct sys_arch_mem_stats* stats, size_t count);
+
+/* Non-inverted Internet checksum in host order, see lwip_standard_chksum. */
+uint16_t sys_arch_chksum(const void* dataptr, int len);
+/* memcpy returning the sys_arch_chksum of the copied data. */
+uint16_t sys_arch_chksum_copy(void* dst, const void* src, uint16_t len);
 #ifdef __cplusplus
 }
 #endif
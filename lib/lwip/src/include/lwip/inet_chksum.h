@@ -41,6 +41,10 @@
 
 #include "lwip/pbuf.h"
 #include "lwip/ip_addr.h"
+/*
+	22. tun2socks: LWIP_CHKSUM and LWIP_CHKSUM_COPY are implemented in inet_chksum_arch.cpp.
+*/
+#include "arch/sys_arch.h"
 
 /** Swap the bytes in an u16_t: much like lwip_htons() for little-endian */
 #ifndef SWAP_BYTES_IN_WORD
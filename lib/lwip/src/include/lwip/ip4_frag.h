@@ -60,9 +60,16 @@ extern "C" {
  */
 struct ip_reassdata {
   struct ip_reassdata *next;
+  /* 23. tun2socks: neighbours in the age list, see ip4_frag.c. */
+  struct ip_reassdata *age_prev;
+  struct ip_reassdata *age_next;
   struct pbuf *p;
+  /* 23. tun2socks: the fragment with the highest offset. */
+  struct pbuf *p_last;
   struct ip_hdr iphdr;
   u16_t datagram_len;
+  /* 23. tun2socks: payload bytes queued so far. */
+  u16_t recv_len;
   u8_t flags;
   u8_t timer;
 };
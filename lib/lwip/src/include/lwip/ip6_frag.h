@@ -89,7 +89,12 @@ extern "C" {
  */
 struct ip6_reassdata {
   struct ip6_reassdata *next;
+  /* 23. tun2socks: neighbours in the age list, see ip6_frag.c. */
+  struct ip6_reassdata *age_prev;
+  struct ip6_reassdata *age_next;
   struct pbuf *p;
+  /* 23. tun2socks: the fragment with the highest offset. */
+  struct pbuf *p_last;
   struct ip6_hdr *iphdr; /* pointer to the first (original) IPv6 header */
 #if IPV6_FRAG_COPYHEADER
   ip6_addr_p_t src; /* copy of the source address in the IP header */
@@ -103,6 +108,8 @@ struct ip6_reassdata {
 #endif /* IPV6_FRAG_COPYHEADER */
   u32_t identification;
   u16_t datagram_len;
+  /* 23. tun2socks: payload bytes queued so far. */
+  u16_t recv_len;
   u8_t nexth;
   u8_t timer;
 #if LWIP_IPV6_SCOPES
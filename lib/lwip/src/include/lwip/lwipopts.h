@@ -16,7 +16,11 @@
 #define LWIP_NETCONN 0
 #define LWIP_SOCKET 0
 #define LWIP_IPV6 1
-#define TCP_MSS 8192
+/*
+	Largest MSS whose IPv6 segment still fits a 65535 byte packet,
+	the effective MSS is clamped to the MTU of the loopback netif.
+*/
+#define TCP_MSS 65475
 #define LWIP_ALTCP 1
 /*
 	4 bytes alignment.
@@ -40,7 +44,32 @@
 	Enable scaling.
 */
 #define LWIP_WND_SCALE 1
-#define TCP_RCV_SCALE  4
+#define TCP_RCV_SCALE  6
+
+/*
+	Starting sizes in bytes, independent of TCP_MSS so a large MSS doesn't
+	make every connection expensive. tcp_autotune grows them per connection.
+*/
+#define TCP_WND     (32 * 1024)
+#define TCP_SND_BUF (16 * 1024)
+
+/*
+	Ceilings for the per connection auto-tuning in tcp_autotune.hpp.
+*/
+#define TCP_WND_LIMIT     (0xFFFFU << TCP_RCV_SCALE)
+#define TCP_SND_BUF_LIMIT (4 * 1024 * 1024)
+
+/*
+	The default queue length assumes every segment is TCP_MSS long,
+	size it for the smallest MSS a peer may announce instead.
+*/
+#define TCP_SND_QUEUELEN ((4 * (TCP_SND_BUF_LIMIT) + 535) / 536)
+
+/*
+	Buffers written by reference can outlive the tcp_conn of a closing
+	connection, an ext arg frees them along with the pcb.
+*/
+#define LWIP_TCP_PCB_NUM_EXT_ARGS 1
 
 
 /*
@@ -59,6 +88,28 @@
 #define MEM_LIBC_MALLOC 1
 #define MEMP_MEM_MALLOC 1
 
+/*
+	Heap and pool memory comes from the size-class slab allocator in
+	sys_arch.cpp instead of the C library.
+*/
+#define mem_clib_malloc sys_arch_mem_malloc
+#define mem_clib_calloc sys_arch_mem_calloc
+#define mem_clib_free   sys_arch_mem_free
+
+/*
+	Checksums use the SIMD kernels of inet_chksum_arch.cpp, tcp_write
+	checksums the data while copying it into segments.
+*/
+#define LWIP_CHKSUM                     sys_arch_chksum
+#define LWIP_CHECKSUM_ON_COPY           1
+#define LWIP_CHKSUM_COPY(dst, src, len) sys_arch_chksum_copy(dst, src, len)
+
+/*
+	Checksum checks and generation are configured on the netif at runtime,
+	see lwip::init.
+*/
+#define LWIP_CHECKSUM_CTRL_PER_NETIF 1
+
 #define MEM_SIZE 2048000
 
 /*
@@ -76,4 +127,25 @@
 
 #define MEMP_NUM_FRAG_PBUF 4096
 
+/*
+	Fragment reassembly, per stack. A 64 KiB datagram takes about 120
+	fragments at an MTU of 576, a single source and destination
+	pair may queue two of them.
+*/
+#define IP_REASS_MAX_PBUFS          2048
+#define IP_REASS_MAX_PBUFS_PER_PEER 256
+#define IP_REASS_HASH_SIZE          256
+
+/*
+	The reassembly helper struct is larger than the IPv6 fragment header
+	with 64 bit pointers.
+*/
+#define IPV6_FRAG_COPYHEADER 1
+
+/*
+	The default pool pbuf size is derived from TCP_MSS and would
+	overflow u16_t, pool pbufs are chained anyway.
+*/
+#define PBUF_POOL_BUFSIZE 1536
+
 #endif
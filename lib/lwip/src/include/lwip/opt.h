@@ -794,6 +794,19 @@
 #define IP_REASS_MAX_PBUFS              10
 #endif
 
+/*
+	23. tun2socks: datagrams waiting for reassembly are hashed by addresses and
+	identification, and one source and destination pair may only queue
+	IP_REASS_MAX_PBUFS_PER_PEER of the IP_REASS_MAX_PBUFS pbufs. Pairs are
+	counted in IP_REASS_HASH_SIZE slots, pairs sharing a slot share the cap.
+*/
+#if !defined IP_REASS_HASH_SIZE || defined __DOXYGEN__
+#define IP_REASS_HASH_SIZE              256
+#endif
+#if !defined IP_REASS_MAX_PBUFS_PER_PEER || defined __DOXYGEN__
+#define IP_REASS_MAX_PBUFS_PER_PEER     IP_REASS_MAX_PBUFS
+#endif
+
 /**
  * IP_DEFAULT_TTL: Default value for Time-To-Live used by transport layers.
  */
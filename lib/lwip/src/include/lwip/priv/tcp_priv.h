@@ -323,25 +323,74 @@ struct tcp_seg {
 #endif /* LWIP_WND_SCALE */
 
 /* Global variables: */
-extern struct tcp_pcb *tcp_input_pcb;
-extern u32_t tcp_ticks;
-extern u8_t tcp_active_pcbs_changed;
+extern LWIP_THREAD_LOCAL struct tcp_pcb *tcp_input_pcb;
+extern LWIP_THREAD_LOCAL u32_t tcp_ticks;
+extern LWIP_THREAD_LOCAL u8_t tcp_active_pcbs_changed;
 
 /* The TCP PCB lists. */
 union tcp_listen_pcbs_t { /* List of all TCP PCBs in LISTEN state. */
   struct tcp_pcb_listen *listen_pcbs;
   struct tcp_pcb *pcbs;
 };
-extern struct tcp_pcb *tcp_bound_pcbs;
-extern union tcp_listen_pcbs_t tcp_listen_pcbs;
-extern struct tcp_pcb *tcp_active_pcbs;  /* List of all TCP PCBs that are in a
+extern LWIP_THREAD_LOCAL struct tcp_pcb *tcp_bound_pcbs;
+extern LWIP_THREAD_LOCAL union tcp_listen_pcbs_t tcp_listen_pcbs;
+extern LWIP_THREAD_LOCAL struct tcp_pcb *tcp_active_pcbs;  /* List of all TCP PCBs that are in a
               state in which they accept or send
               data. */
-extern struct tcp_pcb *tcp_tw_pcbs;      /* List of all TCP PCBs in TIME-WAIT. */
+extern LWIP_THREAD_LOCAL struct tcp_pcb *tcp_tw_pcbs;      /* List of all TCP PCBs in TIME-WAIT. */
 
 #define NUM_TCP_PCB_LISTS_NO_TIME_WAIT  3
 #define NUM_TCP_PCB_LISTS               4
-extern struct tcp_pcb ** const tcp_pcb_lists[NUM_TCP_PCB_LISTS];
+extern LWIP_THREAD_LOCAL struct tcp_pcb **tcp_pcb_lists[NUM_TCP_PCB_LISTS];
+
+/*
+	16. tun2socks: PCBs on tcp_active_pcbs and tcp_tw_pcbs are also indexed by
+	their 4-tuple, so tcp_input does not walk tens of thousands of PCBs per
+	segment. TCP_REG and TCP_RMV keep the index in sync.
+*/
+#ifndef TCP_PCB_HASH_SIZE
+#define TCP_PCB_HASH_SIZE 16384
+#endif
+extern LWIP_THREAD_LOCAL struct tcp_pcb **tcp_pcb_hash;
+
+u32_t tcp_pcb_hash_index(const ip_addr_t *local_ip, u16_t local_port,
+                         const ip_addr_t *remote_ip, u16_t remote_port);
+void tcp_pcb_hash_insert(struct tcp_pcb *pcb);
+void tcp_pcb_hash_remove(struct tcp_pcb *pcb);
+
+/*
+	29. tun2socks: tcp_active_pcbs and tcp_tw_pcbs are doubly linked, so
+	removing a PCB doesn't walk the list to find its predecessor.
+*/
+void tcp_pcb_list_unlink(struct tcp_pcb **pcbs, struct tcp_pcb *pcb);
+
+#define TCP_PCB_HASHED(pcbs) (((pcbs) == &tcp_active_pcbs) || ((pcbs) == &tcp_tw_pcbs))
+
+/*
+	19. tun2socks: tcp_fasttmr and tcp_slowtmr only visit tcp_timer_pcbs, the
+	active PCBs that have timer work pending. An idle ESTABLISHED or CLOSE_WAIT
+	PCB drops off the list and tcp_timer_pcb_arm() puts it back on activity
+	(input, output, writes, close, poll registration).
+*/
+extern LWIP_THREAD_LOCAL struct tcp_pcb *tcp_timer_pcbs;
+
+void tcp_timer_pcb_arm(struct tcp_pcb *pcb);
+void tcp_timer_pcb_disarm(struct tcp_pcb *pcb);
+
+/*
+	24. tun2socks: PCBs whose tcp_output() waits for tcp_output_flush().
+*/
+extern LWIP_THREAD_LOCAL u8_t tcp_output_deferred;
+extern LWIP_THREAD_LOCAL struct tcp_pcb *tcp_output_pcbs;
+
+void tcp_output_pcb_defer(struct tcp_pcb *pcb);
+void tcp_output_pcb_undefer(struct tcp_pcb *pcb);
+
+/*
+	30. tun2socks: gso_mss of the PCB whose segment is being passed to the
+	netif, 0 outside of tcp_output_segment().
+*/
+extern LWIP_THREAD_LOCAL u16_t tcp_output_gso_mss;
 
 /* Axioms about the above lists:
    1) Every TCP PCB that is not CLOSED is in one of the lists.
@@ -366,6 +415,13 @@ extern struct tcp_pcb ** const tcp_pcb_lists[NUM_TCP_PCB_LISTS];
                             LWIP_ASSERT("TCP_REG: pcb->state != CLOSED", ((pcbs) == &tcp_bound_pcbs) || ((npcb)->state != CLOSED)); \
                             (npcb)->next = *(pcbs); \
                             LWIP_ASSERT("TCP_REG: npcb->next != npcb", (npcb)->next != (npcb)); \
+                            if (TCP_PCB_HASHED(pcbs)) { \
+                               (npcb)->prev = NULL; \
+                               if (*(pcbs) != NULL) { \
+                                  (*(pcbs))->prev = (npcb); \
+                               } \
+                               tcp_pcb_hash_insert(npcb); \
+                            } \
                             *(pcbs) = (npcb); \
                             LWIP_ASSERT("TCP_REG: tcp_pcbs sane", tcp_pcbs_sane()); \
               tcp_timer_needed(); \
@@ -374,7 +430,9 @@ extern struct tcp_pcb ** const tcp_pcb_lists[NUM_TCP_PCB_LISTS];
                             struct tcp_pcb *tcp_tmp_pcb; \
                             LWIP_ASSERT("TCP_RMV: pcbs != NULL", *(pcbs) != NULL); \
                             LWIP_DEBUGF(TCP_DEBUG, ("TCP_RMV: removing %p from %p\n", (void *)(npcb), (void *)(*(pcbs)))); \
-                            if(*(pcbs) == (npcb)) { \
+                            if (TCP_PCB_HASHED(pcbs)) { \
+                               tcp_pcb_list_unlink((pcbs), (npcb)); \
+                            } else if(*(pcbs) == (npcb)) { \
                                *(pcbs) = (*pcbs)->next; \
                             } else for (tcp_tmp_pcb = *(pcbs); tcp_tmp_pcb != NULL; tcp_tmp_pcb = tcp_tmp_pcb->next) { \
                                if(tcp_tmp_pcb->next == (npcb)) { \
@@ -383,6 +441,12 @@ extern struct tcp_pcb ** const tcp_pcb_lists[NUM_TCP_PCB_LISTS];
                                } \
                             } \
                             (npcb)->next = NULL; \
+                            if (TCP_PCB_HASHED(pcbs)) { \
+                               tcp_pcb_hash_remove(npcb); \
+                            } \
+                            if ((pcbs) == &tcp_active_pcbs) { \
+                               tcp_timer_pcb_disarm(npcb); \
+                            } \
                             LWIP_ASSERT("TCP_RMV: tcp_pcbs sane", tcp_pcbs_sane()); \
                             LWIP_DEBUGF(TCP_DEBUG, ("TCP_RMV: removed %p from %p\n", (void *)(npcb), (void *)(*(pcbs)))); \
                             } while(0)
@@ -392,13 +456,23 @@ extern struct tcp_pcb ** const tcp_pcb_lists[NUM_TCP_PCB_LISTS];
 #define TCP_REG(pcbs, npcb)                        \
   do {                                             \
     (npcb)->next = *pcbs;                          \
+    if (TCP_PCB_HASHED(pcbs)) {                    \
+      (npcb)->prev = NULL;                         \
+      if (*(pcbs) != NULL) {                       \
+        (*(pcbs))->prev = (npcb);                  \
+      }                                            \
+      tcp_pcb_hash_insert(npcb);                   \
+    }                                              \
     *(pcbs) = (npcb);                              \
     tcp_timer_needed();                            \
   } while (0)
 
 #define TCP_RMV(pcbs, npcb)                        \
   do {                                             \
-    if(*(pcbs) == (npcb)) {                        \
+    if (TCP_PCB_HASHED(pcbs)) {                    \
+      tcp_pcb_list_unlink((pcbs), (npcb));         \
+    }                                              \
+    else if(*(pcbs) == (npcb)) {                   \
       (*(pcbs)) = (*pcbs)->next;                   \
     }                                              \
     else {                                         \
@@ -413,6 +487,12 @@ extern struct tcp_pcb ** const tcp_pcb_lists[NUM_TCP_PCB_LISTS];
       }                                            \
     }                                              \
     (npcb)->next = NULL;                           \
+    if (TCP_PCB_HASHED(pcbs)) {                    \
+      tcp_pcb_hash_remove(npcb);                   \
+    }                                              \
+    if ((pcbs) == &tcp_active_pcbs) {              \
+      tcp_timer_pcb_disarm(npcb);                  \
+    }                                              \
   } while(0)
 
 #endif /* LWIP_DEBUG */
@@ -420,6 +500,7 @@ extern struct tcp_pcb ** const tcp_pcb_lists[NUM_TCP_PCB_LISTS];
 #define TCP_REG_ACTIVE(npcb)                       \
   do {                                             \
     TCP_REG(&tcp_active_pcbs, npcb);               \
+    tcp_timer_pcb_arm(npcb);                       \
     tcp_active_pcbs_changed = 1;                   \
   } while (0)
 
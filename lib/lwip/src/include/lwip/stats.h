@@ -301,7 +301,7 @@ struct stats_ {
 };
 
 /** Global variable containing lwIP internal statistics. Add this to your debugger's watchlist. */
-extern struct stats_ lwip_stats;
+extern LWIP_THREAD_LOCAL struct stats_ lwip_stats;
 
 /** Init statistics */
 void stats_init(void);
@@ -69,6 +69,14 @@ struct tcp_pcb_listen;
  */
 typedef err_t (*tcp_accept_fn)(void *arg, struct tcp_pcb *newpcb, err_t err);
 
+/*
+	25. tun2socks: called for a new connection before its SYN|ACK is sent.
+	Returning ERR_OK holds the SYN|ACK back until tcp_syn_release() and the
+	accept callback is not called for the connection. tcp_abort() answers
+	the SYN with a RST.
+*/
+typedef err_t (*tcp_syn_fn)(void *arg, struct tcp_pcb *newpcb);
+
 /** Function prototype for tcp receive callback functions. Called when data has
  * been received.
  *
@@ -137,7 +145,10 @@ typedef err_t (*tcp_connected_fn)(void *arg, struct tcp_pcb *tpcb, err_t err);
 #define RCV_WND_SCALE(pcb, wnd) (((wnd) >> (pcb)->rcv_scale))
 #define SND_WND_SCALE(pcb, wnd) (((wnd) << (pcb)->snd_scale))
 #define TCPWND16(x)             ((u16_t)LWIP_MIN((x), 0xFFFF))
-#define TCP_WND_MAX(pcb)        ((tcpwnd_size_t)(((pcb)->flags & TF_WND_SCALE) ? TCP_WND : TCPWND16(TCP_WND)))
+/*
+	20. tun2socks: the receive window ceiling is kept per connection so it can be auto-tuned.
+*/
+#define TCP_WND_MAX(pcb)        ((tcpwnd_size_t)(((pcb)->flags & TF_WND_SCALE) ? (pcb)->rcv_wnd_max : TCPWND16((pcb)->rcv_wnd_max)))
 #else
 #define RCV_WND_SCALE(pcb, wnd) (wnd)
 #define SND_WND_SCALE(pcb, wnd) (wnd)
@@ -229,6 +240,10 @@ struct tcp_pcb_listen {
 #if LWIP_CALLBACK_API
   /* Function to call when a listener has been connected. */
   tcp_accept_fn accept;
+  /*
+	25. tun2socks: function to call when a SYN arrived, see tcp_syn_fn.
+  */
+  tcp_syn_fn syn;
 #endif /* LWIP_CALLBACK_API */
 
 #if TCP_LISTEN_BACKLOG
@@ -248,6 +263,35 @@ struct tcp_pcb {
   /* ports are in host byte order */
   u16_t remote_port;
 
+  /*
+	16. tun2socks: chain of the 4-tuple hash, see tcp_pcb_hash in tcp_priv.h.
+  */
+  struct tcp_pcb *hash_next;
+
+  /*
+	29. tun2socks: back link in tcp_active_pcbs and tcp_tw_pcbs, see TCP_RMV.
+  */
+  struct tcp_pcb *prev;
+
+  /*
+	19. tun2socks: links of tcp_timer_pcbs, see tcp_priv.h.
+  */
+  struct tcp_pcb *tmr_next;
+  struct tcp_pcb *tmr_prev;
+
+  /*
+	24. tun2socks: links of tcp_output_pcbs, see tcp_output_set_deferred.
+  */
+  struct tcp_pcb *out_next;
+  struct tcp_pcb *out_prev;
+
+  /*
+	25. tun2socks: the SYN|ACK waits for tcp_syn_release(), the connection
+	was handed out by the syn callback.
+  */
+  u8_t syn_held;
+  u8_t syn_accepted;
+
   tcpflags_t flags;
 #define TF_ACK_DELAY   0x01U   /* Delayed ACK. */
 #define TF_ACK_NOW     0x02U   /* Immediate ACK. */
@@ -284,6 +328,10 @@ struct tcp_pcb {
   tcpwnd_size_t rcv_wnd;   /* receiver window available */
   tcpwnd_size_t rcv_ann_wnd; /* receiver window to announce */
   u32_t rcv_ann_right_edge; /* announced right edge of window */
+  /*
+	20. tun2socks: receive window ceiling, see TCP_WND_MAX.
+  */
+  tcpwnd_size_t rcv_wnd_max;
 
 #if LWIP_TCP_SACK_OUT
   /* SACK ranges to include in ACK packets (entry is invalid if left==right) */
@@ -295,6 +343,11 @@ struct tcp_pcb {
   s16_t rtime;
 
   u16_t mss;   /* maximum segment size */
+  /*
+	30. tun2socks: the MSS the peer announced, when mss was raised for a netif
+	that cuts large segments itself, 0 otherwise. See tcp_output_gso_mss.
+  */
+  u16_t gso_mss;
 
   /* RTT (round trip time) estimation variables */
   u32_t rttest; /* RTT estimate in 500ms ticks */
@@ -418,6 +471,8 @@ void             tcp_recv			(struct tcp_pcb *pcb, tcp_recv_fn recv);
 void tcp_sent(struct tcp_pcb *pcb, tcp_sent_fn sent);
 void tcp_err(struct tcp_pcb *pcb, tcp_err_fn err);
 void tcp_accept(struct tcp_pcb *pcb, tcp_accept_fn accept);
+void tcp_syn(struct tcp_pcb *pcb, tcp_syn_fn syn);
+void tcp_syn_release(struct tcp_pcb *pcb);
 #endif /* LWIP_CALLBACK_API */
 void             tcp_poll			(struct tcp_pcb *pcb, tcp_poll_fn poll, u8_t interval);
 
@@ -478,6 +533,14 @@ void             tcp_setprio (struct tcp_pcb *pcb, u8_t prio);
 
 err_t            tcp_output  (struct tcp_pcb *pcb);
 
+/*
+	24. tun2socks: while output is deferred tcp_output() only remembers the
+	pcb, tcp_output_flush() sends for each remembered pcb once and ends the
+	deferral. A burst of segments is then answered by one ACK.
+*/
+void             tcp_output_set_deferred(u8_t deferred);
+void             tcp_output_flush(void);
+
 err_t            tcp_tcp_get_tcp_addrinfo(struct tcp_pcb *pcb, int local, ip_addr_t *addr, u16_t *port);
 
 #define tcp_dbg_get_tcp_state(pcb) ((pcb)->state)
@@ -114,6 +114,13 @@ void sys_restart_timeouts(void);
 void sys_check_timeouts(void);
 u32_t sys_timeouts_sleeptime(void);
 
+/*
+	18. tun2socks: lets the host event loop sleep until the next timeout and be
+	woken when an earlier one is registered.
+*/
+typedef void (*sys_timeouts_changed_fn)(void *arg);
+void sys_timeouts_set_changed_callback(sys_timeouts_changed_fn fn, void *arg);
+
 #if LWIP_TESTMODE
 struct sys_timeo** sys_timeouts_get_next_timeout(void);
 void lwip_cyclic_timer(void *arg);
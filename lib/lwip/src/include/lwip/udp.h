@@ -57,6 +57,10 @@ extern "C" {
 #define UDP_FLAGS_UDPLITE        0x02U
 #define UDP_FLAGS_CONNECTED      0x04U
 #define UDP_FLAGS_MULTICAST_LOOP 0x08U
+/*
+	17. tun2socks: the pcb is linked into udp_pcb_hash.
+*/
+#define UDP_FLAGS_HASHED         0x10U
 
 struct udp_pcb;
 
@@ -87,6 +91,8 @@ struct udp_pcb {
 /* Protocol specific PCB members */
 
   struct udp_pcb *next;
+  /* 17. tun2socks: chain of udp_pcb_hash. */
+  struct udp_pcb *hash_next;
 
   u8_t flags;
   /** ports are in host byte order */
@@ -114,7 +120,7 @@ struct udp_pcb {
   void *recv_arg;
 };
 /* udp_pcbs export for external reference (e.g. SNMP agent) */
-extern struct udp_pcb *udp_pcbs;
+extern LWIP_THREAD_LOCAL struct udp_pcb *udp_pcbs;
 
 /*
   9. tun2socks: The following functions are used to support the management
@@ -33,7 +33,7 @@ void core::wait()
 
 void core::stop()
 {
-    impl_->stop_thread();
+    impl_->stop();
 }
 
 void core::set_connection_open_function(connection::open_function handle)
@@ -8,14 +8,33 @@
 #include "thread.hpp"
 #include "tuntap/tuntap.hpp"
 #include "udp_proxy.hpp"
+#include <algorithm>
+#include <arch/sys_arch.h>
+#include <array>
 #include <future>
+#include <mutex>
 #include <queue>
+#include <span>
+#include <thread>
+#include <unordered_set>
 
 namespace tun2socks {
 
-class core_impl : public thread, public core_impl_api {
+// An io_context whose pending handlers can be destroyed before the object
+// itself goes away.
+class core_io_context : public boost::asio::io_context {
 public:
-    explicit core_impl()
+    using boost::asio::io_context::shutdown;
+};
+
+template <typename Tuntap>
+class basic_core_impl : public thread {
+public:
+    using tuntap_type    = Tuntap;
+    using tcp_socket_ptr = core_impl_api::tcp_socket_ptr;
+    using udp_socket_ptr = core_impl_api::udp_socket_ptr;
+
+    explicit basic_core_impl()
         : tuntap_(ioc_),
           proxy_policy_(ioc_)
     {
@@ -28,37 +47,53 @@ public:
 
         return start_thread();
     }
+    // The device read and lwIP timers keep ioc_ busy, it has to be stopped
+    // before the thread can end.
+    void stop()
+    {
+        ioc_.stop();
+        stop_thread();
+    }
 
     tun2socks::proxy_policy_impl& proxy_policy()
     {
         return proxy_policy_;
     }
+    tuntap_type& tuntap()
+    {
+        return tuntap_;
+    }
+    // The functions are called on the thread of the stack that carries the
+    // connection.
     void set_connection_open_function(connection::open_function handle)
     {
-        ioc_.dispatch([this, handle]() {
-            conn_open_func_ = handle;
-        });
+        std::lock_guard<std::mutex> lock(conn_func_mutex_);
+        conn_open_func_ = handle;
     }
     void set_connection_close_function(connection::open_function handle)
     {
-        ioc_.dispatch([this, handle]() {
-            conn_close_func_ = handle;
-        });
+        std::lock_guard<std::mutex> lock(conn_func_mutex_);
+        conn_close_func_ = handle;
     }
     std::vector<connection::weak_ptr> connections()
     {
         if (!is_runing())
             return {};
 
-        auto result = std::make_shared<std::promise<std::vector<connection::weak_ptr>>>();
-        ioc_.dispatch([this, result]() mutable -> void {
-            std::vector<connection::weak_ptr> items;
-            for (const auto& v : conns_)
-                items.push_back(v);
-
-            result->set_value(items);
-        });
-        return result->get_future().get();
+        std::vector<connection::weak_ptr> items;
+        for (auto& shard : shards_) {
+            auto result = std::make_shared<std::promise<std::vector<connection::weak_ptr>>>();
+            shard->get_io_context().dispatch([&shard, result]() mutable -> void {
+                std::vector<connection::weak_ptr> items;
+                for (const auto& v : shard->conns_)
+                    items.push_back(v);
+
+                result->set_value(items);
+            });
+            auto part = result->get_future().get();
+            items.insert(items.end(), part.begin(), part.end());
+        }
+        return items;
     }
 
 private:
@@ -66,86 +101,70 @@ private:
     {
         ioc_.poll();
 
-        default_adapter_ = route::get_default_adapter();
-        if (default_adapter_) {
-            spdlog::info("Default network interface name: {} v4: {} v6: {}",
-                         default_adapter_->if_name,
-                         default_adapter_->v4_address().to_string(),
-                         default_adapter_->v6_address().to_string());
-        }
-        else {
-            spdlog::warn("Failed to obtain default network adapter");
+        // An in-process device has no interface the system routes through.
+        constexpr bool virtual_device = tuntap::is_virtual_device<typename tuntap_type::device_type>::value;
+
+        if constexpr (!virtual_device) {
+            default_adapter_ = route::get_default_adapter();
+            if (default_adapter_) {
+                spdlog::info("Default network interface name: {} v4: {} v6: {}",
+                             default_adapter_->if_name,
+                             default_adapter_->v4_address().to_string(),
+                             default_adapter_->v6_address().to_string());
+            }
+            else {
+                spdlog::warn("Failed to obtain default network adapter");
+            }
         }
 
         boost::system::error_code ec;
         tuntap_.open(tun_param_, ec);
         boost::asio::detail::throw_error(ec);
 
-        route::init_route(tun_param_);
+        if constexpr (!virtual_device)
+            route::init_route(tun_param_);
 
-        lwip::instance().init(ioc_);
+        // Stack 0 runs on ioc_, every further stack gets its own io_context
+        // and thread. TUN packets are spread over them by a flow hash.
+        auto stacks = std::max<std::size_t>(1, tun_param_.stacks);
+        for (std::size_t i = 0; i < stacks; ++i)
+            shards_.push_back(std::make_unique<stack_shard>(*this, i == 0 ? nullptr : std::make_unique<boost::asio::io_context>(1)));
 
-        auto tcp_accepter = lwip::tcp_accepter::instance();
-        tcp_accepter->set_accept_function([this, tcp_accepter](lwip::tcp_conn::ptr newpcb) {
-            auto proxy = std::make_shared<tcp_proxy>(ioc_,
-                                                     newpcb,
-                                                     *this);
-
-            proxy->start();
-            conns_.insert(proxy);
-            if (conn_open_func_)
-                conn_open_func_(proxy);
-        });
-
-        auto udp_creator = lwip::udp_creator::instance();
-        udp_creator->set_udp_create_function([this, udp_creator](lwip::udp_conn::ptr newpcb) {
-            auto proxy = std::make_shared<udp_proxy>(ioc_,
-                                                     newpcb,
-                                                     *this);
-            proxy->start();
-            conns_.insert(proxy);
-
-            if (conn_open_func_)
-                conn_open_func_(proxy);
-        });
-
-        lwip::instance().set_ip_output([this](const wrapper::pbuf_buffer& buffer) {
-            bool write_in_process = !send_queue_.empty();
-            send_queue_.push_back(buffer);
-            if (write_in_process)
-                return;
-
-            boost::asio::co_spawn(
-                ioc_,
-                [this]() -> boost::asio::awaitable<void> {
-                    boost::system::error_code ec;
-                    while (!send_queue_.empty()) {
-                        const auto& buffer = send_queue_.front();
-                        auto        bytes  = co_await tuntap_.async_write_some(buffer.const_data(), ec);
-                        send_queue_.pop_front();
-
-                        if (ec)
-                            spdlog::warn("Write IP Packet to tuntap Device Failed: {0}", ec.message());
-                    }
-                },
-                boost::asio::detached);
-        });
+        init_stack(*shards_.front());
+        for (std::size_t i = 1; i < stacks; ++i)
+            start_stack(*shards_[i]);
 
         boost::asio::co_spawn(
             ioc_, [this]() -> boost::asio::awaitable<void> {
                 boost::system::error_code ec;
                 for (;;) {
-                    wrapper::pbuf_buffer buffer(1500);
-
-                    auto bytes = co_await tuntap_.async_read_some(buffer.mutable_data(), ec);
+                    // Pooled pbufs must be freed on the thread that owns the
+                    // pool, packets handed to other stacks are heap pbufs.
+                    auto buffer = co_await tuntap_.async_read_packet(
+                        [this]() {
+                            return shards_.size() == 1 ? wrapper::pbuf_buffer::pooled(read_buffer_size())
+                                                       : wrapper::pbuf_buffer(read_buffer_size());
+                        },
+                        ec);
                     if (ec)
                         co_return;
 
-                    buffer.realloc(bytes);
-                    lwip::instance().ip_input(buffer);
+                    auto& shard = select_stack(buffer.const_data());
+                    if (shard.is_local()) {
+                        lwip::instance().ip_input(buffer);
+                        continue;
+                    }
+                    boost::asio::post(shard.get_io_context(), [p = buffer.release()]() {
+                        lwip::instance().ip_input(wrapper::pbuf_buffer::adopt(p));
+                    });
                 }
             },
             boost::asio::detached);
+
+#ifdef OS_LINUX
+        for (std::size_t queue = 1; queue < tuntap_.queue_count(); ++queue)
+            start_queue_reader(queue);
+#endif
         return true;
     }
     virtual bool on_thread_run() override
@@ -155,9 +174,32 @@ private:
         ioc_.run(ec);
         return false;
     }
+    virtual void on_thread_end() override
+    {
+        for (auto& ioc : queue_iocs_)
+            ioc->stop();
+
+        for (auto& td : queue_threads_) {
+            if (td.joinable())
+                td.join();
+        }
+        queue_threads_.clear();
+        queue_iocs_.clear();
+
+        // Suspended coroutines of stack 0 hold this thread's lwIP state and
+        // pooled pbufs, like the other stacks they go away on its thread.
+        for (auto& shard : shards_) {
+            if (shard->is_local())
+                shard->stop_conns();
+        }
+        ioc_.shutdown();
+        pop_sent(send_queue_.size());
+
+        stop_stacks();
+    }
 
     boost::asio::awaitable<tcp_socket_ptr> create_proxy_socket(
-        connection::ptr conn) override
+        connection::ptr conn)
     {
         auto socket = std::make_shared<boost::asio::ip::tcp::socket>(
             co_await boost::asio::this_coro::executor);
@@ -191,7 +233,7 @@ private:
     }
     boost::asio::awaitable<udp_socket_ptr> create_proxy_socket(
         connection::ptr                 conn,
-        boost::asio::ip::udp::endpoint& proxy_endpoint) override
+        boost::asio::ip::udp::endpoint& proxy_endpoint)
     {
         auto socket = std::make_shared<boost::asio::ip::udp::socket>(
             co_await boost::asio::this_coro::executor);
@@ -219,19 +261,356 @@ private:
         }
         co_return socket;
     }
-    void remove_conn(connection::ptr conn) override
+private:
+    // One lwIP instance and the connections it carries. lwIP keeps its state
+    // in thread local globals, so everything of a stack runs on its own
+    // io_context; stack 0 shares ioc_ with the device.
+    class stack_shard : public core_impl_api {
+    public:
+        stack_shard(basic_core_impl& core, std::unique_ptr<boost::asio::io_context> ioc)
+            : core_(core),
+              own_ioc_(std::move(ioc)),
+              ioc_(own_ioc_ ? *own_ioc_ : core.ioc_)
+        {
+        }
+
+        inline boost::asio::io_context& get_io_context() noexcept
+        {
+            return ioc_;
+        }
+        inline bool is_local() const noexcept
+        {
+            return &ioc_ == &core_.ioc_;
+        }
+
+        boost::asio::awaitable<tcp_socket_ptr> create_proxy_socket(
+            connection::ptr conn) override
+        {
+            return core_.create_proxy_socket(conn);
+        }
+        boost::asio::awaitable<udp_socket_ptr> create_proxy_socket(
+            connection::ptr                 conn,
+            boost::asio::ip::udp::endpoint& proxy_endpoint) override
+        {
+            return core_.create_proxy_socket(conn, proxy_endpoint);
+        }
+        void add_conn(connection::ptr conn)
+        {
+            conns_.insert(conn);
+            if (auto f = core_.connection_open_function())
+                f(conn);
+        }
+        void remove_conn(connection::ptr conn) override
+        {
+            auto iter = conns_.find(conn);
+            if (iter == conns_.end())
+                return;
+
+            if (auto f = core_.connection_close_function())
+                f(conn);
+
+            conns_.erase(iter);
+        }
+        // Connections keep themselves alive until stopped, this has to run
+        // before their io_context goes away.
+        void stop_conns()
+        {
+            auto conns = conns_;
+            for (auto& conn : conns)
+                conn->stop();
+            conns_.clear();
+        }
+
+    private:
+        friend class basic_core_impl;
+
+        basic_core_impl&                         core_;
+        std::unique_ptr<boost::asio::io_context> own_ioc_;
+        boost::asio::io_context&                 ioc_;
+        std::thread                              thread_;
+        std::unordered_set<connection::ptr>      conns_;
+    };
+
+    // Runs on the stack's thread.
+    void init_stack(stack_shard& shard)
+    {
+        lwip::instance().set_tso(tun_param_.offload);
+        lwip::instance().set_mtu(tun_param_.mtu);
+        lwip::instance().set_verify_checksum(tun_param_.verify_checksum);
+        lwip::instance().set_connect_before_accept(tun_param_.connect_before_accept);
+        lwip::instance().init(shard.get_io_context());
+        wrapper::pbuf_pool::instance().set_slot_size(read_buffer_size());
+
+        auto tcp_accepter = lwip::tcp_accepter::instance();
+        tcp_accepter->set_accept_function([&shard, tcp_accepter](lwip::tcp_conn::ptr newpcb) {
+            auto proxy = std::make_shared<tcp_proxy>(shard.get_io_context(),
+                                                     newpcb,
+                                                     shard);
+            proxy->start();
+            shard.add_conn(proxy);
+        });
+
+        auto udp_creator = lwip::udp_creator::instance();
+        udp_creator->set_udp_create_function([&shard, udp_creator](lwip::udp_conn::ptr newpcb) {
+            auto proxy = std::make_shared<udp_proxy>(shard.get_io_context(),
+                                                     newpcb,
+                                                     shard);
+            proxy->start();
+            shard.add_conn(proxy);
+        });
+
+        if (shard.is_local()) {
+            // TCP segments are written as the chains lwIP built, data written
+            // by reference is not copied.
+            lwip::instance().set_ip_output([this](const wrapper::pbuf_buffer& buffer, uint16_t gso_mss) {
+                write_packet(buffer, gso_mss, true);
+            });
+            return;
+        }
+        // The pbuf still belongs to this stack's lwIP, the device thread gets
+        // a private copy.
+        lwip::instance().set_ip_output([this](const wrapper::pbuf_buffer& buffer, uint16_t gso_mss) {
+            wrapper::pbuf_buffer copy(static_cast<uint16_t>(buffer.len()));
+            pbuf_copy(&copy, &buffer);
+            boost::asio::post(ioc_, [this, p = copy.release(), gso_mss]() {
+                write_packet(wrapper::pbuf_buffer::adopt(p), gso_mss, false);
+            });
+        });
+    }
+    void start_stack(stack_shard& shard)
     {
-        auto iter = conns_.find(conn);
-        if (iter == conns_.end())
+        boost::asio::post(shard.get_io_context(), [this, &shard]() {
+            init_stack(shard);
+        });
+        shard.thread_ = std::thread([&shard]() {
+            {
+                auto work = boost::asio::make_work_guard(*shard.own_ioc_);
+
+                boost::system::error_code ec;
+                shard.own_ioc_->run(ec);
+            }
+            // Connections and suspended coroutines touch lwIP, they have to
+            // go away on this thread.
+            shard.stop_conns();
+            shard.own_ioc_.reset();
+        });
+    }
+    void stop_stacks()
+    {
+        for (auto& shard : shards_) {
+            if (shard->is_local())
+                continue;
+
+            // Stopped from its own thread, which may free the io_context
+            // as soon as run() returns.
+            auto& ioc = shard->get_io_context();
+            boost::asio::post(ioc, [&ioc]() {
+                ioc.stop();
+            });
+            if (shard->thread_.joinable())
+                shard->thread_.join();
+        }
+        shards_.clear();
+
+        log_memory_stats();
+    }
+
+    // Peak usage of each size class of the lwIP slab allocator.
+    static void log_memory_stats()
+    {
+        std::array<struct sys_arch_mem_stats, 64> stats;
+        auto count = std::min(sys_arch_mem_stats(stats.data(), stats.size()), stats.size());
+        for (std::size_t i = 0; i < count; ++i) {
+            const auto& s = stats[i];
+            if (s.max == 0)
+                continue;
+
+            spdlog::debug("lwIP memory class {}: {} used, {} peak, {} cached",
+                          s.size ? std::to_string(s.size) : std::string("large"),
+                          s.used,
+                          s.max,
+                          s.cached);
+        }
+    }
+
+    // Symmetric over source and destination, so both directions of a flow
+    // pick the same stack. Fragments only hash the addresses, they may not
+    // carry the ports.
+    stack_shard& select_stack(boost::asio::const_buffer packet)
+    {
+        if (shards_.size() == 1)
+            return *shards_.front();
+
+        auto        data = static_cast<const uint8_t*>(packet.data());
+        std::size_t size = packet.size();
+
+        std::size_t addr_len = 0, src = 0, hlen = 0;
+        uint8_t     proto     = 0;
+        bool        fragment  = false;
+        if (size >= 20 && (data[0] >> 4) == 4) {
+            addr_len = 4;
+            src      = 12;
+            hlen     = (data[0] & 0x0f) * 4;
+            proto    = data[9];
+            fragment = (data[6] & 0x3f) != 0 || data[7] != 0;
+        }
+        else if (size >= 40 && (data[0] >> 4) == 6) {
+            addr_len = 16;
+            src      = 8;
+            hlen     = 40;
+            proto    = data[6];
+        }
+        else {
+            return *shards_.front();
+        }
+
+        auto endpoint_hash = [&](std::size_t addr, std::size_t port) {
+            uint64_t h = 14695981039346656037ull;
+            for (std::size_t i = 0; i < addr_len; ++i)
+                h = (h ^ data[addr + i]) * 1099511628211ull;
+            if (port != 0)
+                h = (h ^ ((uint32_t(data[port]) << 8) | data[port + 1])) * 1099511628211ull;
+            return h;
+        };
+
+        std::size_t sport = 0, dport = 0;
+        bool        ports = !fragment && (proto == IP_PROTO_TCP || proto == IP_PROTO_UDP) && size >= hlen + 4;
+        if (ports) {
+            sport = hlen;
+            dport = hlen + 2;
+        }
+
+        uint64_t h = endpoint_hash(src, sport) + endpoint_hash(src + addr_len, dport);
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdull;
+        h ^= h >> 33;
+        return *shards_[h % shards_.size()];
+    }
+
+    // Only stack 0's own packets count as its queued outputs, a copy from
+    // another stack is not something its lwIP waits to retire.
+    struct queued_packet
+    {
+        wrapper::pbuf_buffer buffer;
+        uint16_t             gso_mss;
+        bool                 local;
+    };
+    // What the device gets: the buffers of a pbuf chain, and for a TSO
+    // segment the MSS its GSO packet is cut at.
+    struct output_packet : std::span<const boost::asio::const_buffer>
+    {
+        uint16_t gso_mss = 0;
+    };
+
+    void write_packet(const wrapper::pbuf_buffer& buffer, uint16_t gso_mss, bool local)
+    {
+        bool write_in_process = !send_queue_.empty();
+        send_queue_.push_back(queued_packet{buffer, gso_mss, local});
+        if (local)
+            lwip::instance().output_queued();
+        if (write_in_process)
             return;
 
-        if (conn_close_func_)
-            conn_close_func_(conn);
+        // co_spawn starts on a post, so everything lwIP emits during the
+        // current handler is already queued when the first batch goes out.
+        boost::asio::co_spawn(
+            ioc_,
+            [this]() -> boost::asio::awaitable<void> {
+                std::vector<boost::asio::const_buffer> fragments;
+                std::vector<std::size_t>               ends;
+                std::vector<output_packet>             packets;
+                while (!send_queue_.empty()) {
+                    fragments.clear();
+                    ends.clear();
+                    for (const auto& packet : send_queue_) {
+                        packet.buffer.append_buffers(fragments);
+                        ends.push_back(fragments.size());
+                    }
+                    packets.clear();
+                    for (std::size_t i = 0, begin = 0; i < ends.size(); begin = ends[i++])
+                        packets.push_back({{fragments.data() + begin, ends[i] - begin}, send_queue_[i].gso_mss});
+
+                    boost::system::error_code ec;
+                    auto count = co_await tuntap_.async_write_packets(packets, ec);
+                    if (ec)
+                        spdlog::warn("Write IP Packet to tuntap Device Failed: {0}", ec.message());
+
+                    // The packets the device didn't get to go out with the next
+                    // batch. A device that takes none has its batch dropped
+                    // rather than retried forever.
+                    if (count == 0)
+                        count = packets.size();
+                    pop_sent(count);
+                }
+            },
+            boost::asio::detached);
+    }
 
-        conns_.erase(iter);
+    // The first `count` packets were written or given up on.
+    void pop_sent(std::size_t count)
+    {
+        auto end   = send_queue_.begin() + count;
+        auto local = std::count_if(send_queue_.begin(), end, [](const queued_packet& packet) {
+            return packet.local;
+        });
+        send_queue_.erase(send_queue_.begin(), end);
+        lwip::instance().output_written(local);
+    }
+
+    connection::open_function connection_open_function()
+    {
+        std::lock_guard<std::mutex> lock(conn_func_mutex_);
+        return conn_open_func_;
+    }
+    connection::close_function connection_close_function()
+    {
+        std::lock_guard<std::mutex> lock(conn_func_mutex_);
+        return conn_close_func_;
+    }
+
+    // With offload enabled the device hands us TSO super packets of up to 64K.
+    inline uint16_t read_buffer_size() const
+    {
+        return tun_param_.offload ? 0xffff : tun_param_.mtu;
+    }
+
+    // Each extra TUN queue gets its own io_context and thread so the read
+    // syscalls of different queues run in parallel. lwIP is single threaded,
+    // the packets are handed over to ioc_ before they reach ip_input.
+    void start_queue_reader(std::size_t queue)
+    {
+        auto& ioc = *queue_iocs_.emplace_back(std::make_unique<boost::asio::io_context>(1));
+        tuntap_.bind_queue_executor(queue, ioc.get_executor());
+
+        boost::asio::co_spawn(
+            ioc, [this, queue]() -> boost::asio::awaitable<void> {
+                boost::system::error_code ec;
+                for (;;) {
+                    // The pbuf pools belong to the stack threads, this one
+                    // reads straight into a heap pbuf.
+                    auto buffer = co_await tuntap_.async_read_packet(
+                        queue,
+                        [this]() {
+                            return wrapper::pbuf_buffer(read_buffer_size());
+                        },
+                        ec);
+                    if (ec)
+                        co_return;
+
+                    auto& shard = select_stack(buffer.const_data());
+                    boost::asio::post(shard.get_io_context(), [p = buffer.release()]() {
+                        lwip::instance().ip_input(wrapper::pbuf_buffer::adopt(p));
+                    });
+                }
+            },
+            boost::asio::detached);
+
+        queue_threads_.emplace_back([&ioc]() {
+            boost::system::error_code ec;
+            ioc.run(ec);
+        });
     }
 
-private:
     template <typename Stream, typename InternetProtocol>
     inline void open_bind_socket(Stream&                                                  sock,
                                  const boost::asio::ip::basic_endpoint<InternetProtocol>& dest,
@@ -325,18 +704,25 @@ private:
     }
 
 private:
-    boost::asio::io_context          ioc_;
-    tuntap::tuntap                   tuntap_;
+    core_io_context                  ioc_;
+    tuntap_type                      tuntap_;
     parameter::socks5_server         socks5_proxy_;
     parameter::tun_device            tun_param_;
-    std::deque<wrapper::pbuf_buffer> send_queue_;
+    std::deque<queued_packet>        send_queue_;
     proxy_policy_impl                proxy_policy_;
 
-    std::unordered_set<connection::ptr> conns_;
+    std::vector<std::unique_ptr<stack_shard>> shards_;
 
+    std::mutex                 conn_func_mutex_;
     connection::open_function  conn_open_func_;
     connection::close_function conn_close_func_;
 
     std::optional<route::adapter_info> default_adapter_;
+
+    std::vector<std::unique_ptr<boost::asio::io_context>> queue_iocs_;
+    std::vector<std::thread>                               queue_threads_;
+};
+
+class core_impl : public basic_core_impl<tuntap::tuntap> {
 };
 }  // namespace tun2socks
\ No newline at end of file
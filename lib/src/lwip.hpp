@@ -2,18 +2,25 @@
 
 #include <boost/asio.hpp>
 #include <boost/bind.hpp>
+#include <lwip/inet_chksum.h>
 #include <lwip/init.h>
+#include <lwip/ip4.h>
 #include <lwip/netif.h>
+#include <lwip/priv/tcp_priv.h>
 #include <lwip/sys.h>
 #include <lwip/tcp.h>
 #include <lwip/timeouts.h>
 #include <lwip/udp.h>
 
+#include <array>
+#include <deque>
 #include <memory>
 #include <mutex>
 #include <set>
 #include <thread>
 #include <time.h>
+#include <unordered_map>
+#include <vector>
 
 #include "address_pair.hpp"
 #include "endpoint_pair.hpp"
@@ -24,12 +31,16 @@ namespace tun2socks {
 
 class lwip {
 public:
-    using ip_packet_output_function = std::function<void(wrapper::pbuf_buffer)>;
+    // The packet may be a chain pointing into buffers written by reference.
+    // It can be kept until it is written, see output_queued(). A TCP segment
+    // from a TSO connection comes with the MSS to cut it at, 0 otherwise.
+    using ip_packet_output_function = std::function<void(const wrapper::pbuf_buffer&, uint16_t gso_mss)>;
 
 public:
     inline static lwip& instance()
     {
-        static lwip _stack;
+        // One stack per thread, matching lwIP's thread local globals.
+        static thread_local lwip _stack;
         return _stack;
     }
     inline static boost::asio::ip::address address_from_lwip(const ip_addr_t& addr)
@@ -80,6 +91,7 @@ public:
         using ptr = std::shared_ptr<tcp_conn>;
 
         using recv_function = std::function<err_t(const wrapper::pbuf_buffer&, err_t)>;
+        using sent_function = std::function<void(std::size_t)>;
 
     public:
         tcp_conn(struct tcp_pcb* pcb)
@@ -100,38 +112,108 @@ public:
                 auto self = (tcp_conn*)arg;
                 self->on_recv(NULL, err);
             });
+
+            // The TUN device accepts GSO packets, so hand it segments as large as
+            // lwIP allows. The device cuts them back to the MSS the client
+            // announced, see gso_mss.
+            if (lwip::instance().tso_) {
+                pcb_->gso_mss = pcb_->mss;
+                pcb_->mss     = TCP_MSS;
+                pcb_->cwnd = std::min<tcpwnd_size_t>(4 * pcb_->mss, std::max<tcpwnd_size_t>(2 * pcb_->mss, 4380));
+            }
         }
         virtual ~tcp_conn()
         {
+            if (pending_)
+                pbuf_free(pending_);
             tcp_arg(pcb_, NULL);
             tcp_recv(pcb_, NULL);
             tcp_sent(pcb_, NULL);
             tcp_err(pcb_, NULL);
             tcp_shutdown(pcb_, 1, 1);
             tcp_close(pcb_);
+
+            // lwIP still sends what is queued, the buffers stay with the pcb.
+            if (!written_.empty() && sys_arch_pcb_is_watch(pcb_))
+                written_buffers::orphan(pcb_, std::move(written_));
         }
 
     public:
         inline std::size_t buf_len() const
         {
-            return std::min<uint16_t>(tcp_mss(pcb_), tcp_sndbuf(pcb_));
+            return std::min<std::size_t>(tcp_mss(pcb_), tcp_sndbuf(pcb_));
+        }
+        // Whether tcp_write has room for buf_len() bytes. Once it has not,
+        // the sent callback reports when acknowledged data frees some.
+        inline bool writable() const
+        {
+            return tcp_sndbuf(pcb_) > 0 && tcp_sndqueuelen(pcb_) + 2 <= TCP_SND_QUEUELEN;
         }
         inline void recved(uint16_t len)
         {
             tcp_recved(pcb_, len);
         }
+        inline std::size_t mss() const
+        {
+            return tcp_mss(pcb_);
+        }
+        inline std::size_t rcv_wnd() const
+        {
+            return pcb_->rcv_wnd;
+        }
+        inline std::size_t rcv_wnd_max() const
+        {
+            return TCP_WND_MAX(pcb_);
+        }
+        // Without window scaling the peer can't be offered more than 64K.
+        inline std::size_t rcv_wnd_limit() const
+        {
+            return (pcb_->flags & TF_WND_SCALE) ? TCP_WND_LIMIT : 0xffff;
+        }
+        // Raises the receive window ceiling and announces the extra space.
+        void grow_rcv_wnd(std::size_t bytes)
+        {
+            pcb_->rcv_wnd_max += (tcpwnd_size_t)bytes;
+            pcb_->rcv_wnd += (tcpwnd_size_t)bytes;
+            tcp_recved(pcb_, 0);
+        }
+        inline void grow_snd_buf(std::size_t bytes)
+        {
+            pcb_->snd_buf += (tcpwnd_size_t)bytes;
+        }
         inline err_t write(const void* dataptr, uint16_t len)
         {
             auto err = tcp_write(pcb_, dataptr, len, TCP_WRITE_FLAG_COPY);
             if (err != ERR_OK)
                 return err;
 
+            // Writes of the same batch are sent together.
+            lwip::instance().begin_batch();
+            return output();
+        }
+        // Queues the buffer by reference instead of copying it, it is held
+        // until no unacknowledged segment refers to it anymore.
+        inline err_t write(const wrapper::pbuf_buffer& buffer)
+        {
+            auto data = buffer.const_data();
+            auto err  = tcp_write(pcb_, data.data(), (u16_t)data.size(), 0);
+            if (err != ERR_OK)
+                return err;
+
+            written_.push(buffer, pcb_->snd_lbb);
+            lwip::instance().begin_batch();
             return output();
         }
         inline err_t output()
         {
             return tcp_output(pcb_);
         }
+        // Completes the handshake of a connection accepted on its SYN.
+        // Closing it before answers the SYN with a RST.
+        inline void establish()
+        {
+            tcp_syn_release(pcb_);
+        }
         inline tcp_endpoint_pair endp_pair() const
         {
             return lwip::create_endpoint(pcb_);
@@ -140,34 +222,146 @@ public:
         {
             recv_func_ = f;
         }
+        void set_sent_function(sent_function f)
+        {
+            sent_func_ = f;
+        }
 
     private:
+        friend class lwip;
+
+        // Buffers written by reference with the sequence number following
+        // their last byte.
+        class written_buffers {
+        public:
+            written_buffers()                  = default;
+            written_buffers(written_buffers&&) = default;
+            ~written_buffers()
+            {
+                for (const auto& buffer : buffers_)
+                    lwip::instance().retire(buffer.first);
+            }
+
+            bool empty() const
+            {
+                return buffers_.empty();
+            }
+            void push(const wrapper::pbuf_buffer& buffer, u32_t end)
+            {
+                buffers_.emplace_back(buffer, end);
+            }
+            // Drops what lies before the oldest queued segment. A segment is
+            // only freed once it is acknowledged as a whole, a partial ACK of
+            // a large segment keeps all buffers it spans.
+            void release(const struct tcp_pcb* pcb)
+            {
+                auto oldest = pcb->snd_lbb;
+                for (auto seg : {pcb->unacked, pcb->unsent}) {
+                    if (seg && TCP_SEQ_LT(lwip_ntohl(seg->tcphdr->seqno), oldest))
+                        oldest = lwip_ntohl(seg->tcphdr->seqno);
+                }
+                while (!buffers_.empty() && TCP_SEQ_LEQ(buffers_.front().second, oldest)) {
+                    lwip::instance().retire(buffers_.front().first);
+                    buffers_.pop_front();
+                }
+            }
+
+            // Keeps the buffers of a closed connection until lwIP frees the
+            // pcb. Not every way a pcb goes away reports an error, so they
+            // hang off an ext arg slot whose destroy callback always runs.
+            static void orphan(struct tcp_pcb* pcb, written_buffers&& buffers)
+            {
+                static const tcp_ext_arg_callbacks callbacks = {
+                    [](u8_t, void* data) {
+                        delete (written_buffers*)data;
+                    },
+                    nullptr};
+                static const u8_t id = tcp_ext_arg_alloc_id();
+
+                auto self = new written_buffers(std::move(buffers));
+                tcp_ext_arg_set_callbacks(pcb, id, &callbacks);
+                tcp_ext_arg_set(pcb, id, self);
+
+                // Acknowledged buffers are released early all the same.
+                ::tcp_arg(pcb, self);
+                ::tcp_sent(pcb, [](void* arg, struct tcp_pcb* pcb, u16_t) -> err_t {
+                    ((written_buffers*)arg)->release(pcb);
+                    return ERR_OK;
+                });
+            }
+
+        private:
+            std::deque<std::pair<wrapper::pbuf_buffer, u32_t>> buffers_;
+        };
+
+        // In-order segments are chained up and handed to the application
+        // once per read batch, see lwip::defer_recv.
         err_t on_recv(struct pbuf* p, err_t err)
         {
             if (!recv_func_)
                 return ERR_MEM;
 
             if (err != ERR_OK) {
+                // The pcb is gone, so is the connection the data was for.
+                if (pending_) {
+                    pbuf_free(pending_);
+                    pending_ = NULL;
+                }
                 recv_func_(wrapper::pbuf_buffer(), err);
                 return ERR_OK;
             }
 
-            auto buffer = wrapper::pbuf_buffer::smart_copy(p);
+            if (!p) {
+                auto self = shared_from_this();
+                deliver();
+                return recv_func_(wrapper::pbuf_buffer(), err);
+            }
+
+            // A chain can't be longer than 64K.
+            if (pending_ && pending_->tot_len + p->tot_len > 0xffff) {
+                auto self = shared_from_this();
+                deliver();
+            }
+            if (pending_) {
+                pbuf_cat(pending_, p);
+                return ERR_OK;
+            }
+            pending_ = p;
+            lwip::instance().defer_recv(weak_from_this());
+            return ERR_OK;
+        }
+        void deliver()
+        {
+            if (!pending_ || !recv_func_)
+                return;
+
+            auto p   = pending_;
+            pending_ = NULL;
 
-            err = recv_func_(buffer, err);
-            if (err == ERR_OK && p)
-                pbuf_free(p);
+            auto buffer = wrapper::pbuf_buffer::adopt(p);
+            if (recv_func_(buffer, ERR_OK) == ERR_OK)
+                return;
 
-            return err;
+            // Not taken yet, lwIP retries it from its fast timer.
+            if (pcb_->refused_data)
+                pbuf_cat(pcb_->refused_data, buffer.release());
+            else
+                pcb_->refused_data = buffer.release();
         }
         err_t on_sent(u16_t len)
         {
+            written_.release(pcb_);
+            if (sent_func_)
+                sent_func_(len);
             return ERR_OK;
         }
 
     private:
         struct tcp_pcb* pcb_;
         recv_function   recv_func_;
+        sent_function   sent_func_;
+        struct pbuf*    pending_ = NULL;
+        written_buffers written_;
     };
 
     class tcp_accepter : public std::enable_shared_from_this<tcp_accepter> {
@@ -190,6 +384,12 @@ public:
                 auto self = (tcp_accepter*)arg;
                 return self->on_accept(new_conn);
             });
+            if (lwip::instance().connect_before_accept_) {
+                ::tcp_syn(pcb_, [](void* arg, struct tcp_pcb* new_conn) -> err_t {
+                    auto self = (tcp_accepter*)arg;
+                    return self->on_accept(new_conn);
+                });
+            }
         }
         virtual ~tcp_accepter()
         {
@@ -204,7 +404,7 @@ public:
     public:
         static std::shared_ptr<tcp_accepter> instance()
         {
-            static std::weak_ptr<tcp_accepter> _instance;
+            static thread_local std::weak_ptr<tcp_accepter> _instance;
 
             auto obj = _instance.lock();
             if (obj)
@@ -232,6 +432,36 @@ public:
         accept_function accept_func_;
     };
 
+    // Identifies an established UDP flow by the addresses and ports of the
+    // packets the client sends into the TUN device, ports in host order.
+    struct udp_flow_key
+    {
+        std::array<uint8_t, 16> src{};
+        std::array<uint8_t, 16> dest{};
+        uint16_t                src_port  = 0;
+        uint16_t                dest_port = 0;
+        bool                    v6        = false;
+
+        bool operator==(const udp_flow_key&) const = default;
+    };
+    struct udp_flow_hash
+    {
+        std::size_t operator()(const udp_flow_key& key) const noexcept
+        {
+            // FNV-1a over the fields, the table is looked up for every packet.
+            std::size_t h    = 14695981039346656037ull;
+            auto        hash = [&h](const uint8_t* data, std::size_t size) {
+                for (std::size_t i = 0; i < size; ++i)
+                    h = (h ^ data[i]) * 1099511628211ull;
+            };
+            hash(key.src.data(), key.v6 ? 16 : 4);
+            hash(key.dest.data(), key.v6 ? 16 : 4);
+            hash(reinterpret_cast<const uint8_t*>(&key.src_port), sizeof(key.src_port));
+            hash(reinterpret_cast<const uint8_t*>(&key.dest_port), sizeof(key.dest_port));
+            return h;
+        }
+    };
+
     class udp_conn : public std::enable_shared_from_this<udp_conn> {
     public:
         using recv_function = std::function<void(const wrapper::pbuf_buffer&, const boost::asio::ip::udp::endpoint&)>;
@@ -239,7 +469,8 @@ public:
 
     public:
         explicit udp_conn(struct udp_pcb* pcb)
-            : pcb_(pcb)
+            : pcb_(pcb),
+              remote_(address_from_lwip(pcb->remote_ip), pcb->remote_port)
         {
             ::udp_recv(
                 pcb_,
@@ -249,9 +480,18 @@ public:
                     self->on_recv(p, addr, port);
                 },
                 this);
+
+            // Later packets of the flow bypass lwIP, see lwip::udp_fast_input.
+            build_header();
+            lwip::instance().udp_flows_.insert_or_assign(key_, this);
         }
         ~udp_conn()
         {
+            auto& flows = lwip::instance().udp_flows_;
+            auto  it    = flows.find(key_);
+            if (it != flows.end() && it->second == this)
+                flows.erase(it);
+
             udp_recv(pcb_, NULL, NULL);
             udp_disconnect(pcb_);
             udp_remove(pcb_);
@@ -260,6 +500,9 @@ public:
     public:
         err_t send(const wrapper::pbuf_buffer& buf)
         {
+            if (fast_send(&buf))
+                return ERR_OK;
+
             return udp_send(pcb_, &buf);
         }
         err_t send_to(const wrapper::pbuf_buffer& buf, const boost::asio::ip::udp::endpoint& to)
@@ -278,6 +521,8 @@ public:
         }
 
     private:
+        friend class lwip;
+
         void on_recv(struct pbuf* p, const ip_addr_t* addr, u16_t port)
         {
             auto buffer = wrapper::pbuf_buffer::smart_copy(p);
@@ -288,11 +533,128 @@ public:
             boost::asio::ip::udp::endpoint from(address_from_lwip(*addr), port);
             recv_func_(buffer, from);
         }
+        // Payload of a packet the classifier matched to this flow.
+        void on_fast_recv(const wrapper::pbuf_buffer& buffer)
+        {
+            if (recv_func_)
+                recv_func_(buffer, remote_);
+        }
+
+        // Builds the IP and UDP headers of the replies once, only the lengths,
+        // the IPv4 id and the checksums change per packet.
+        void build_header()
+        {
+            bool v6        = IP_IS_V6_VAL(pcb_->local_ip);
+            key_.v6        = v6;
+            key_.src_port  = pcb_->remote_port;
+            key_.dest_port = pcb_->local_port;
+
+            uint8_t* h = header_.data();
+            if (v6) {
+                memcpy(key_.src.data(), ip_2_ip6(&pcb_->remote_ip)->addr, 16);
+                memcpy(key_.dest.data(), ip_2_ip6(&pcb_->local_ip)->addr, 16);
+
+                header_len_ = IP6_HLEN + UDP_HLEN;
+                h[0]        = 0x60 | (pcb_->tos >> 4);
+                h[1]        = uint8_t(pcb_->tos << 4);
+                h[6]        = IP_PROTO_UDP;
+                h[7]        = pcb_->ttl;
+                memcpy(h + 8, key_.dest.data(), 16);
+                memcpy(h + 24, key_.src.data(), 16);
+            }
+            else {
+                memcpy(key_.src.data(), &ip_2_ip4(&pcb_->remote_ip)->addr, 4);
+                memcpy(key_.dest.data(), &ip_2_ip4(&pcb_->local_ip)->addr, 4);
+
+                header_len_ = IP_HLEN + UDP_HLEN;
+                h[0]        = 0x45;
+                h[1]        = pcb_->tos;
+                h[8]        = pcb_->ttl;
+                h[9]        = IP_PROTO_UDP;
+                memcpy(h + 12, key_.dest.data(), 4);
+                memcpy(h + 16, key_.src.data(), 4);
+                ip_sum_ = sum(h, IP_HLEN);
+            }
+
+            uint8_t* udp = h + header_len_ - UDP_HLEN;
+            udp[0]       = uint8_t(pcb_->local_port >> 8);
+            udp[1]       = uint8_t(pcb_->local_port);
+            udp[2]       = uint8_t(pcb_->remote_port >> 8);
+            udp[3]       = uint8_t(pcb_->remote_port);
+
+            // Pseudo header without the length, plus the ports.
+            std::size_t addr_len = v6 ? 16 : 4;
+            uint8_t     proto[2] = {0, IP_PROTO_UDP};
+            udp_sum_             = uint32_t(sum(key_.src.data(), addr_len)) + sum(key_.dest.data(), addr_len) +
+                       sum(proto, sizeof(proto)) + sum(udp, 4);
+        }
+
+        bool fast_send(struct pbuf* p)
+        {
+            auto& stack = lwip::instance();
+
+            std::size_t payload_len = p->tot_len;
+            std::size_t total       = payload_len + header_len_;
+            if (p->next || total > 0xffff ||
+                (stack.loopback_->mtu != 0 && total > stack.loopback_->mtu) ||
+                pbuf_add_header(p, header_len_) != 0)
+                return false;
+
+            uint8_t* h = static_cast<uint8_t*>(p->payload);
+            memcpy(h, header_.data(), header_len_);
+
+            uint8_t* udp     = h + header_len_ - UDP_HLEN;
+            uint16_t udp_len = lwip_htons(uint16_t(payload_len + UDP_HLEN));
+            memcpy(udp + 4, &udp_len, 2);
+
+            // An offloading device completes the checksum itself.
+            uint16_t chksum = 0;
+            if (stack.loopback_->chksum_flags & NETIF_CHECKSUM_GEN_UDP) {
+                uint32_t acc = udp_sum_ + udp_len + udp_len + sum(udp + UDP_HLEN, payload_len);
+                chksum       = fold(acc);
+                if (chksum == 0)
+                    chksum = 0xffff;
+            }
+            memcpy(udp + 6, &chksum, 2);
+
+            if (key_.v6) {
+                memcpy(h + 4, &udp_len, 2);
+            }
+            else {
+                uint16_t len = lwip_htons(uint16_t(total));
+                uint16_t id  = lwip_htons(ip_id++);
+                memcpy(h + 2, &len, 2);
+                memcpy(h + 4, &id, 2);
+
+                uint16_t ip_chksum = fold(uint32_t(ip_sum_) + len + id);
+                memcpy(h + 10, &ip_chksum, 2);
+            }
+
+            stack._on_ip_output(p);
+            return true;
+        }
+        // One's complement sum of the data, not yet inverted.
+        static uint16_t sum(const void* data, std::size_t size)
+        {
+            return uint16_t(~inet_chksum(data, uint16_t(size)));
+        }
+        static uint16_t fold(uint32_t sum)
+        {
+            while (sum >> 16)
+                sum = (sum & 0xffff) + (sum >> 16);
+            return uint16_t(~sum);
+        }
 
     private:
-        struct udp_pcb*   pcb_;
-        recv_function     recv_func_;
-        udp_endpoint_pair endp_pair_;
+        struct udp_pcb*                          pcb_;
+        recv_function                            recv_func_;
+        udp_endpoint_pair                        endp_pair_;
+        boost::asio::ip::udp::endpoint           remote_;
+        udp_flow_key                             key_;
+        std::array<uint8_t, IP6_HLEN + UDP_HLEN> header_{};
+        std::size_t                              header_len_ = 0;
+        uint16_t                                 ip_sum_     = 0;
+        uint32_t                                 udp_sum_    = 0;
     };
 
     class udp_creator : public std::enable_shared_from_this<udp_creator> {
@@ -317,7 +679,7 @@ public:
     public:
         static std::shared_ptr<udp_creator> instance()
         {
-            static std::weak_ptr<udp_creator> _instance;
+            static thread_local std::weak_ptr<udp_creator> _instance;
 
             auto obj = _instance.lock();
             if (obj)
@@ -354,6 +716,26 @@ public:
         loopback_        = netif_list;
         loopback_->state = this;
 
+        // Segments are sized to the TUN MTU, unless the device takes GSO packets,
+        // then lwIP must neither clamp the MSS nor fragment.
+        if (!tso_) {
+            loopback_->mtu = mtu_;
+#if LWIP_IPV6 && LWIP_ND6_ALLOW_RA_UPDATES
+            loopback_->mtu6 = mtu_;
+#endif
+        }
+
+        // Inbound packets come from the local kernel. With TSO the device
+        // also completes the transport checksums of outbound packets, see
+        // vnet_prepare_packets.
+        u16_t chksum_flags = NETIF_CHECKSUM_ENABLE_ALL;
+        if (!verify_checksum_)
+            chksum_flags &= ~(NETIF_CHECKSUM_CHECK_IP | NETIF_CHECKSUM_CHECK_UDP | NETIF_CHECKSUM_CHECK_TCP |
+                              NETIF_CHECKSUM_CHECK_ICMP | NETIF_CHECKSUM_CHECK_ICMP6);
+        if (tso_)
+            chksum_flags &= ~(NETIF_CHECKSUM_GEN_UDP | NETIF_CHECKSUM_GEN_TCP);
+        NETIF_SET_CHECKSUM_CTRL(loopback_, chksum_flags);
+
         loopback_->output = [](struct netif*     netif,
                                struct pbuf*      p,
                                const ip4_addr_t* ipaddr) -> err_t {
@@ -371,16 +753,29 @@ public:
             return ERR_OK;
         };
 
+        // Sleeps until the next lwIP timeout is due. Registering an earlier
+        // one cancels the wait, so the deadline is recomputed.
+        sys_timeouts_set_changed_callback(&lwip::on_timeouts_changed, this);
+
+        ctx_ = &ctx;
+
         boost::asio::co_spawn(
             ctx,
-            []() -> boost::asio::awaitable<void> {
+            [this]() -> boost::asio::awaitable<void> {
+                boost::asio::steady_timer timer(co_await boost::asio::this_coro::executor);
+                timer_ = &timer;
+                std::shared_ptr<void> detach(nullptr, [this](void*) { timer_ = nullptr; });
+
                 for (;;) {
+                    auto sleeptime = ::sys_timeouts_sleeptime();
+                    if (sleeptime == SYS_TIMEOUTS_SLEEPTIME_INFINITE)
+                        timer.expires_at(boost::asio::steady_timer::time_point::max());
+                    else
+                        timer.expires_after(std::chrono::milliseconds(sleeptime));
+
                     boost::system::error_code ec;
-                    boost::asio::steady_timer update_timer(
-                        co_await boost::asio::this_coro::executor);
-                    update_timer.expires_from_now(std::chrono::milliseconds(1));
-                    co_await update_timer.async_wait(net_awaitable[ec]);
-                    if (ec)
+                    co_await timer.async_wait(net_awaitable[ec]);
+                    if (ec && ec != boost::asio::error::operation_aborted)
                         co_return;
                     ::sys_check_timeouts();
                 }
@@ -389,6 +784,11 @@ public:
     }
     inline err_t ip_input(wrapper::pbuf_buffer buffer)
     {
+        ++inputs_;
+        if (!udp_flows_.empty() && udp_fast_input(buffer))
+            return ERR_OK;
+
+        begin_batch();
         return loopback_->input(buffer.release(), loopback_);
     }
 
@@ -397,14 +797,191 @@ public:
         ip_output_func_ = f;
     }
 
+    // Queued output packets may still point into buffers written by
+    // reference. Buffers released meanwhile are retired until every packet
+    // queued before was reported written.
+    inline void output_queued()
+    {
+        ++outputs_queued_;
+    }
+    inline void output_written(std::size_t count)
+    {
+        outputs_written_ += count;
+        while (!retired_.empty() && retired_.front().second <= outputs_written_)
+            retired_.pop_front();
+    }
+
+    inline void set_tso(bool enable)
+    {
+        tso_ = enable;
+    }
+
+    inline void set_mtu(uint16_t mtu)
+    {
+        mtu_ = mtu;
+    }
+
+    inline void set_verify_checksum(bool enable)
+    {
+        verify_checksum_ = enable;
+    }
+
+    // Connections are handed out on their SYN, the SYN|ACK waits for
+    // tcp_conn::establish.
+    inline void set_connect_before_accept(bool enable)
+    {
+        connect_before_accept_ = enable;
+    }
+
 private:
+    // A read batch lasts as long as the reader keeps finding packets, up to
+    // max_batch_packets. Until it ends received TCP data is held back and
+    // tcp_output only marks the pcb, so the segments of a batch reach the
+    // application as one chain and are answered by one ACK.
+    void begin_batch()
+    {
+        if (batch_scheduled_)
+            return;
+
+        // The packet being processed counts as new, the reader always gets
+        // one more turn.
+        batch_scheduled_ = true;
+        batch_start_     = inputs_;
+        batch_seen_      = inputs_ - 1;
+        tcp_output_set_deferred(1);
+        boost::asio::post(*ctx_, [this]() { on_batch_end(); });
+    }
+    void defer_recv(std::weak_ptr<tcp_conn> conn)
+    {
+        recv_pending_.push_back(std::move(conn));
+        begin_batch();
+    }
+    void on_batch_end()
+    {
+        if (inputs_ != batch_seen_ && inputs_ - batch_start_ < max_batch_packets) {
+            batch_seen_ = inputs_;
+            boost::asio::post(*ctx_, [this]() { on_batch_end(); });
+            return;
+        }
+        batch_scheduled_ = false;
+
+        auto pending = std::move(recv_pending_);
+        recv_pending_.clear();
+        for (auto& conn : pending) {
+            if (auto c = conn.lock())
+                c->deliver();
+        }
+        tcp_output_flush();
+    }
+
+    // Hands datagrams of established UDP flows straight to their connection.
+    // The packets come from the local stack through the TUN device, so unless
+    // verify_checksum is set the checksums lwIP would verify are skipped.
+    // Fragments, IPv6 extension headers, unknown flows and bad checksums take
+    // the regular lwIP path.
+    bool udp_fast_input(wrapper::pbuf_buffer& buffer)
+    {
+        auto p = &buffer;
+        if (p->next)
+            return false;
+
+        auto         data = static_cast<const uint8_t*>(p->payload);
+        std::size_t  size = p->len;
+        udp_flow_key key;
+        std::size_t  hlen;
+        if (size >= IP_HLEN + UDP_HLEN && (data[0] >> 4) == 4) {
+            hlen       = (data[0] & 0x0f) * 4;
+            auto total = std::size_t(data[2]) << 8 | data[3];
+            if (data[9] != IP_PROTO_UDP || hlen < IP_HLEN || total > size || total < hlen + UDP_HLEN ||
+                (data[6] & 0x3f) != 0 || data[7] != 0)
+                return false;
+
+            memcpy(key.src.data(), data + 12, 4);
+            memcpy(key.dest.data(), data + 16, 4);
+            size = total;
+        }
+        else if (size >= IP6_HLEN + UDP_HLEN && (data[0] >> 4) == 6) {
+            hlen       = IP6_HLEN;
+            auto total = IP6_HLEN + (std::size_t(data[4]) << 8 | data[5]);
+            if (data[6] != IP_PROTO_UDP || total > size || total < hlen + UDP_HLEN)
+                return false;
+
+            key.v6 = true;
+            memcpy(key.src.data(), data + 8, 16);
+            memcpy(key.dest.data(), data + 24, 16);
+            size = total;
+        }
+        else {
+            return false;
+        }
+
+        const uint8_t* udp     = data + hlen;
+        auto           udp_len = std::size_t(udp[4]) << 8 | udp[5];
+        if (udp_len < UDP_HLEN || hlen + udp_len > size)
+            return false;
+
+        key.src_port  = uint16_t(udp[0] << 8 | udp[1]);
+        key.dest_port = uint16_t(udp[2] << 8 | udp[3]);
+
+        auto it = udp_flows_.find(key);
+        if (it == udp_flows_.end())
+            return false;
+
+        pbuf_realloc(p, uint16_t(hlen + udp_len));
+        if (verify_checksum_ && !checksums_valid(p, hlen, key.v6))
+            return false;
+
+        pbuf_remove_header(p, hlen + UDP_HLEN);
+        it->second->on_fast_recv(buffer);
+        return true;
+    }
+    // The checks ip4_input and udp_input make, p holds the IP header and the
+    // UDP datagram and nothing beyond.
+    static bool checksums_valid(struct pbuf* p, std::size_t hlen, bool v6)
+    {
+        auto data = static_cast<const uint8_t*>(p->payload);
+        auto udp  = data + hlen;
+        if (!v6) {
+            if (inet_chksum(data, u16_t(hlen)) != 0)
+                return false;
+            // Zero means the sender did not compute one.
+            if (udp[6] == 0 && udp[7] == 0)
+                return true;
+        }
+
+        // The UDP sum covers the datagram and a pseudo header of the
+        // addresses, which stay readable once the IP header is hidden. Pool
+        // slots are PBUF_REF, only the forced variant takes it back.
+        u16_t sum;
+        pbuf_remove_header(p, hlen);
+        if (v6) {
+            ip6_addr_t src{}, dest{};
+            memcpy(src.addr, data + 8, 16);
+            memcpy(dest.addr, data + 24, 16);
+            sum = ip6_chksum_pseudo(p, IP_PROTO_UDP, p->tot_len, &src, &dest);
+        }
+        else {
+            ip4_addr_t src, dest;
+            memcpy(&src.addr, data + 12, 4);
+            memcpy(&dest.addr, data + 16, 4);
+            sum = inet_chksum_pseudo(p, IP_PROTO_UDP, p->tot_len, &src, &dest);
+        }
+        pbuf_add_header_force(p, hlen);
+        return sum == 0;
+    }
+
+    void retire(const wrapper::pbuf_buffer& buffer)
+    {
+        if (outputs_written_ != outputs_queued_)
+            retired_.emplace_back(buffer, outputs_queued_);
+    }
+
     void _on_ip_output(struct pbuf* p)
     {
         if (!ip_output_func_)
             return;
 
-        auto buffer = wrapper::pbuf_buffer::smart_copy(p);
-        ip_output_func_(buffer);
+        ip_output_func_(wrapper::pbuf_buffer(p), tcp_output_gso_mss);
     }
 
 private:
@@ -413,8 +990,37 @@ private:
     {
     }
 
+    static void on_timeouts_changed(void* arg)
+    {
+        auto self = static_cast<lwip*>(arg);
+        if (self->timer_)
+            self->timer_->cancel();
+    }
+
 private:
+    static constexpr std::size_t max_batch_packets = 64;
+
     netif*                    loopback_;
     ip_packet_output_function ip_output_func_;
+    boost::asio::io_context*  ctx_ = nullptr;
+
+    std::vector<std::weak_ptr<tcp_conn>> recv_pending_;
+    std::size_t                          inputs_          = 0;
+    std::size_t                          batch_start_     = 0;
+    std::size_t                          batch_seen_      = 0;
+    bool                                 batch_scheduled_ = false;
+
+    boost::asio::steady_timer* timer_ = nullptr;
+
+    std::deque<std::pair<wrapper::pbuf_buffer, std::size_t>> retired_;
+    std::size_t                                              outputs_queued_  = 0;
+    std::size_t                                              outputs_written_ = 0;
+
+    std::unordered_map<udp_flow_key, udp_conn*, udp_flow_hash> udp_flows_;
+
+    bool     tso_                   = false;
+    bool     verify_checksum_       = false;
+    bool     connect_before_accept_ = false;
+    uint16_t mtu_                   = 1500;
 };
 }  // namespace tun2socks
\ No newline at end of file
@@ -2,11 +2,107 @@
 #define TUN2SOCKS_PBUF_HPP
 
 #include "lwip/pbuf.h"
+#include <algorithm>
 #include <boost/asio/buffer.hpp>
 #include <cstdint>
+#include <memory>
+#include <new>
+#include <vector>
 namespace tun2socks {
 namespace wrapper {
 
+#if !LWIP_SUPPORT_CUSTOM_PBUF
+#    error "pbuf_pool needs LWIP_SUPPORT_CUSTOM_PBUF"
+#endif
+
+    // Receive buffers carved from large chunks and handed out as custom
+    // PBUF_REF pbufs. Freeing such a pbuf puts its slot back on a LIFO free
+    // list, so reads neither malloc nor free and reuse cache-warm memory.
+    // Like lwIP itself it is only used from the stack's thread, every stack
+    // thread has a pool of its own.
+    class pbuf_pool {
+    public:
+        inline static pbuf_pool& instance()
+        {
+            static thread_local pbuf_pool _pool;
+            return _pool;
+        }
+
+        // Takes effect until the first slot is handed out.
+        void set_slot_size(std::size_t size)
+        {
+            if (chunks_.empty())
+                slot_size_ = size;
+        }
+
+        // Returns nullptr when length does not fit a slot.
+        pbuf* alloc(uint16_t length)
+        {
+            if (length > slot_size_)
+                return nullptr;
+
+            if (!free_)
+                grow();
+
+            auto s = free_;
+            free_  = s->next;
+
+            s->custom.custom_free_function = &pbuf_pool::free_slot;
+            return pbuf_alloced_custom(PBUF_RAW,
+                                       length,
+                                       PBUF_REF,
+                                       &s->custom,
+                                       s + 1,
+                                       static_cast<uint16_t>(slot_size_));
+        }
+
+    private:
+        static constexpr std::size_t cache_line = 64;
+
+        struct slot
+        {
+            struct pbuf_custom custom;
+            slot*              next;
+        };
+
+        static void free_slot(pbuf* p)
+        {
+            // The pbuf is the first member of the slot.
+            auto s = reinterpret_cast<slot*>(p);
+
+            auto& pool = instance();
+            s->next    = pool.free_;
+            pool.free_ = s;
+        }
+
+        void grow()
+        {
+            // Slots start on cache lines, chunks are about 1 MiB.
+            std::size_t stride = (sizeof(slot) + slot_size_ + cache_line - 1) / cache_line * cache_line;
+            std::size_t count  = std::max<std::size_t>(1, (1 << 20) / stride);
+
+            auto& chunk = chunks_.emplace_back(new (std::align_val_t(cache_line)) uint8_t[stride * count]);
+            for (std::size_t i = 0; i < count; ++i) {
+                auto s  = new (chunk.get() + i * stride) slot{};
+                s->next = free_;
+                free_   = s;
+            }
+        }
+
+        struct chunk_deleter
+        {
+            void operator()(uint8_t* p) const
+            {
+                ::operator delete[](p, std::align_val_t(cache_line));
+            }
+        };
+
+    private:
+        std::vector<std::unique_ptr<uint8_t[], chunk_deleter>> chunks_;
+        slot*                                                  free_      = nullptr;
+        std::size_t                                            slot_size_ = 0xffff;
+    };
+
     class pbuf_buffer {
     public:
         pbuf_buffer() = default;
@@ -19,7 +115,7 @@ namespace wrapper {
                     pbuf_layer layer = pbuf_layer::PBUF_RAW,
                     pbuf_type  ty    = pbuf_type::PBUF_RAM)
         {
-            data_ = pbuf_alloc(pbuf_layer::PBUF_RAW, length, ty);
+            data_ = pbuf_alloc(layer, length, ty);
         }
         ~pbuf_buffer()
         {
@@ -56,6 +152,22 @@ namespace wrapper {
         {
             return data_->tot_len;
         }
+        // A pbuf_pool slot when length fits one, a heap pbuf otherwise.
+        static pbuf_buffer pooled(uint16_t length)
+        {
+            pbuf_buffer buffer;
+            buffer.data_ = pbuf_pool::instance().alloc(length);
+            if (!buffer.data_)
+                buffer.data_ = pbuf_alloc(pbuf_layer::PBUF_RAW, length, pbuf_type::PBUF_RAM);
+            return buffer;
+        }
+        // Takes over a reference obtained from release().
+        static pbuf_buffer adopt(pbuf* p)
+        {
+            pbuf_buffer buffer;
+            buffer.data_ = p;
+            return buffer;
+        }
         static pbuf_buffer smart_copy(pbuf* p)
         {
             if (!p)
@@ -91,6 +203,20 @@ namespace wrapper {
         {
             return boost::asio::const_buffer(data_->payload, data_->tot_len);
         }
+        // One buffer per pbuf, lets a chain be written without copying it.
+        std::vector<boost::asio::const_buffer> const_buffers() const
+        {
+            std::vector<boost::asio::const_buffer> buffers;
+            append_buffers(buffers);
+            return buffers;
+        }
+        void append_buffers(std::vector<boost::asio::const_buffer>& buffers) const
+        {
+            for (auto q = data_; q; q = q->next) {
+                if (q->len)
+                    buffers.emplace_back(q->payload, q->len);
+            }
+        }
 
     private:
         pbuf* data_ = nullptr;
@@ -3,6 +3,8 @@
 #include <atomic>
 #include <boost/asio.hpp>
 #include <filesystem>
+#include <mutex>
+#include <shared_mutex>
 #include <spdlog/spdlog.h>
 #include <string>
 #include <tun2socks/proxy_policy.h>
@@ -17,8 +19,11 @@ public:
     {
     }
 
+    // Called from every stack thread.
     inline bool is_direct(connection::ptr conn)
     {
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+
         auto dest_endp = conn->remote_endpoint();
         auto src_endp  = conn->local_endpoint();
         auto proc_info = conn->get_process_info();
@@ -70,12 +75,14 @@ public:
     {
         auto p = std::filesystem::path(path).lexically_normal().string();
         ioc_.dispatch([this, p, direct]() {
+            std::unique_lock<std::shared_mutex> lock(mutex_);
             process_path_[p] = direct;
         });
     }
     void set_process(uint32_t pid, bool direct) override
     {
         ioc_.dispatch([this, pid, direct]() {
+            std::unique_lock<std::shared_mutex> lock(mutex_);
             process_pid_[pid] = direct;
         });
     }
@@ -83,6 +90,7 @@ public:
     {
         auto _addr = boost::asio::ip::make_address(addr);
         ioc_.dispatch([this, _addr, direct]() {
+            std::unique_lock<std::shared_mutex> lock(mutex_);
             addresses_[_addr] = direct;
         });
     }
@@ -90,12 +98,14 @@ public:
     {
         auto p = std::filesystem::path(path).lexically_normal().string();
         ioc_.dispatch([this, p]() {
+            std::unique_lock<std::shared_mutex> lock(mutex_);
             process_path_.erase(p);
         });
     }
     void remove_process(uint32_t pid) override
     {
         ioc_.dispatch([this, pid]() {
+            std::unique_lock<std::shared_mutex> lock(mutex_);
             process_pid_.erase(pid);
         });
     }
@@ -104,6 +114,7 @@ public:
     {
         auto _addr = boost::asio::ip::make_address(addr);
         ioc_.dispatch([this, _addr]() {
+            std::unique_lock<std::shared_mutex> lock(mutex_);
             addresses_.erase(_addr);
         });
     }
@@ -116,6 +127,7 @@ public:
     void clear() override
     {
         ioc_.dispatch([this]() {
+            std::unique_lock<std::shared_mutex> lock(mutex_);
             process_path_.clear();
             addresses_.clear();
             process_pid_.clear();
@@ -124,6 +136,7 @@ public:
 
 private:
     boost::asio::io_context&                           ioc_;
+    std::shared_mutex                                  mutex_;
     std::atomic_bool                                   default_direct_ = false;
     std::unordered_map<uint32_t, bool>                 process_pid_;
     std::unordered_map<std::string, bool>              process_path_;
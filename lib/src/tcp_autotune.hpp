@@ -0,0 +1,148 @@
+#pragma once
+#include "core_impl_api.h"
+#include "lwip.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+
+#ifdef OS_LINUX
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+
+namespace tun2socks {
+
+// Grows the receive window and send buffer of a proxied connection once it
+// moves more than half of them per upstream round trip, in the spirit of
+// the Linux receive buffer auto-tuning. What is added on top of TCP_WND and
+// TCP_SND_BUF is charged to a budget shared by every connection.
+class tcp_autotune {
+public:
+    using clock = std::chrono::steady_clock;
+
+    static constexpr std::size_t memory_budget = 256 * 1024 * 1024;
+
+    static constexpr clock::duration default_rtt = std::chrono::milliseconds(50);
+    static constexpr clock::duration min_rtt     = std::chrono::milliseconds(1);
+
+public:
+    explicit tcp_autotune(const lwip::tcp_conn& conn)
+        : rcv_(conn.rcv_wnd_max()),
+          snd_(TCP_SND_BUF)
+    {
+    }
+    ~tcp_autotune()
+    {
+        used_.fetch_sub(rcv_.reserved + snd_.reserved, std::memory_order_relaxed);
+    }
+
+    void attach(core_impl_api::tcp_socket_ptr socket)
+    {
+        socket_ = std::move(socket);
+        update_rtt();
+    }
+
+    // Upload: a segment was queued for the upstream socket.
+    void on_received(const lwip::tcp_conn& conn)
+    {
+        if (conn.rcv_wnd() * 2 <= conn.rcv_wnd_max())
+            rcv_.limited = true;
+    }
+    // Upload: bytes were written upstream and handed back to the window.
+    void on_consumed(lwip::tcp_conn& conn, std::size_t bytes)
+    {
+        if (auto grow = sample(rcv_, bytes, conn.rcv_wnd_limit()))
+            conn.grow_rcv_wnd(grow);
+    }
+    // Download: about to read as much as the send buffer has room for.
+    void on_sending(const lwip::tcp_conn& conn)
+    {
+        if (conn.buf_len() < conn.mss())
+            snd_.limited = true;
+    }
+    // Download: bytes were queued on the lwIP connection.
+    void on_sent(lwip::tcp_conn& conn, std::size_t bytes)
+    {
+        if (auto grow = sample(snd_, bytes, TCP_SND_BUF_LIMIT))
+            conn.grow_snd_buf(grow);
+    }
+
+private:
+    struct direction
+    {
+        explicit direction(std::size_t size)
+            : size(size)
+        {
+        }
+        std::size_t       size;
+        std::size_t       reserved = 0;
+        std::size_t       copied   = 0;
+        bool              limited  = false;
+        clock::time_point start    = clock::now();
+    };
+
+    // Returns how many bytes the direction grew by at the end of a round trip.
+    std::size_t sample(direction& d, std::size_t bytes, std::size_t limit)
+    {
+        d.copied += bytes;
+
+        auto now     = clock::now();
+        auto elapsed = now - d.start;
+        if (elapsed < rtt_)
+            return 0;
+
+        std::size_t grow = 0;
+        if (d.limited) {
+            auto per_rtt = d.copied * rtt_.count() / elapsed.count();
+            auto target  = std::min<std::size_t>(2 * per_rtt, limit);
+            if (target > d.size)
+                grow = reserve(target - d.size);
+        }
+        d.size += grow;
+        d.reserved += grow;
+        d.copied  = 0;
+        d.limited = false;
+        d.start   = now;
+
+        update_rtt();
+        return grow;
+    }
+
+    void update_rtt()
+    {
+        rtt_ = std::max(upstream_rtt(), min_rtt);
+    }
+
+    clock::duration upstream_rtt() const
+    {
+#ifdef OS_LINUX
+        tcp_info  info{};
+        socklen_t len = sizeof(info);
+        if (socket_ && ::getsockopt(socket_->native_handle(), IPPROTO_TCP, TCP_INFO, &info, &len) == 0 && info.tcpi_rtt)
+            return std::chrono::microseconds(info.tcpi_rtt);
+#endif
+        return default_rtt;
+    }
+
+    static std::size_t reserve(std::size_t bytes)
+    {
+        auto used = used_.load(std::memory_order_relaxed);
+        for (;;) {
+            if (used >= memory_budget)
+                return 0;
+
+            auto grant = std::min(bytes, memory_budget - used);
+            if (used_.compare_exchange_weak(used, used + grant, std::memory_order_relaxed))
+                return grant;
+        }
+    }
+
+private:
+    inline static std::atomic<std::size_t> used_{0};
+
+    core_impl_api::tcp_socket_ptr socket_;
+    clock::duration               rtt_ = default_rtt;
+    direction                     rcv_;
+    direction                     snd_;
+};
+}  // namespace tun2socks
@@ -7,6 +7,7 @@
 #include "lwip.hpp"
 #include "pbuf.hpp"
 #include "socks_client/socks_client.hpp"
+#include "tcp_autotune.hpp"
 #include <boost/asio.hpp>
 #include <memory>
 #include <queue>
@@ -14,12 +15,19 @@
 namespace tun2socks {
 
 class tcp_proxy : public tcp_basic_connection {
+public:
+    // How long a write that failed for lack of memory waits before it is
+    // retried, unless an ACK frees memory earlier.
+    static constexpr auto write_retry_interval = std::chrono::milliseconds(250);
+
 public:
     explicit tcp_proxy(boost::asio::io_context& ioc,
                        lwip::tcp_conn::ptr      conn,
                        core_impl_api&           core)
         : tcp_basic_connection(ioc, core, conn->endp_pair()),
-          conn_(conn)
+          conn_(conn),
+          sent_timer_(ioc),
+          autotune_(*conn)
     {
         spdlog::info("TCP proxy: {}", conn->endp_pair().to_string());
     }
@@ -38,30 +46,47 @@ protected:
                     return ERR_OK;
                 }
 
-                if (!socket_)
-                    return ERR_MEM;
+                autotune_.on_received(*conn_);
 
+                // Data that arrives before the upstream is connected waits in
+                // the queue. It only goes back to the receive window once it
+                // was written, so the window bounds how much can pile up.
                 auto write_in_process = !write_queue_.empty();
                 write_queue_.push_back(buffer);
-                if (!write_in_process)
+                if (socket_ && !write_in_process)
                     start_write_to_proxy();
 
                 return ERR_OK;
             });
+        conn_->set_sent_function([this, self = shared_from_this()](std::size_t) {
+            sent_timer_.cancel();
+        });
 
         boost::asio::co_spawn(
             get_io_context(),
             [this, self = shared_from_this()]() -> boost::asio::awaitable<void> {
                 socket_ = co_await core_api().create_proxy_socket(shared_from_this());
-                if (!socket_) {
+                if (!socket_ || !conn_) {
                     stop();
                     co_return;
                 }
+                conn_->establish();
+                autotune_.attach(socket_);
+                if (!write_queue_.empty())
+                    start_write_to_proxy();
 
                 boost::system::error_code ec;
 
                 for (; conn_;) {
-                    wrapper::pbuf_buffer buffer(conn_->buf_len());
+                    autotune_.on_sending(*conn_);
+                    // Upstream reads pause while the send buffer is full, so a
+                    // slow local reader throttles the upstream.
+                    if (!conn_->writable()) {
+                        co_await wait_sent(boost::asio::steady_timer::time_point::max());
+                        continue;
+                    }
+                    auto                 size = conn_->buf_len();
+                    wrapper::pbuf_buffer buffer(static_cast<uint16_t>(size));
 
                     auto bytes = co_await socket_->async_read_some(buffer.mutable_data(),
                                                                    net_awaitable[ec]);
@@ -71,13 +96,29 @@ protected:
                     }
                     buffer.realloc(bytes);
 
-                    auto data = buffer.const_data();
-
-                    err_t err = conn_->write(data.data(), data.size());
+                    // lwIP references the buffer until the peer acknowledged
+                    // it. Shrinking a buffer doesn't give memory back, so a
+                    // mostly empty one is cheaper to copy than to hold.
+                    auto by_reference = bytes * 2 >= size;
+                    auto write        = [&]() {
+                        if (by_reference)
+                            return conn_->write(buffer);
+                        auto data = buffer.const_data();
+                        return conn_->write(data.data(), data.size());
+                    };
+
+                    // Running out of memory is transient, the data is kept.
+                    err_t err;
+                    while ((err = write()) == ERR_MEM) {
+                        co_await wait_sent(boost::asio::steady_timer::clock_type::now() + write_retry_interval);
+                        if (!conn_)
+                            co_return;
+                    }
                     if (err != ERR_OK) {
                         stop();
                         co_return;
                     }
+                    autotune_.on_sent(*conn_, bytes);
                     update_download_bytes(bytes);
                 }
             },
@@ -88,6 +129,7 @@ protected:
         if (!conn_)
             return;
         conn_.reset();
+        sent_timer_.cancel();
 
         if (socket_) {
             boost::system::error_code ec;
@@ -97,6 +139,15 @@ protected:
     }
 
 private:
+    // Returns once lwIP reported acknowledged data, at the deadline or when
+    // the connection stops.
+    boost::asio::awaitable<void> wait_sent(boost::asio::steady_timer::time_point deadline)
+    {
+        boost::system::error_code ec;
+        sent_timer_.expires_at(deadline);
+        co_await sent_timer_.async_wait(net_awaitable[ec]);
+    }
+
     void start_write_to_proxy()
     {
         boost::asio::co_spawn(
@@ -104,7 +155,7 @@ private:
                 boost::system::error_code ec;
                 while (!write_queue_.empty()) {
                     const auto& buf   = write_queue_.front();
-                    auto        bytes = co_await boost::asio::async_write(*socket_, buf.const_data(), net_awaitable[ec]);
+                    auto        bytes = co_await boost::asio::async_write(*socket_, buf.const_buffers(), net_awaitable[ec]);
                     if (ec || !conn_) {
                         stop();
                         co_return;
@@ -112,6 +163,7 @@ private:
                     BOOST_ASSERT(bytes == buf.len());
                     write_queue_.pop_front();
                     conn_->recved(bytes);
+                    autotune_.on_consumed(*conn_, bytes);
                 }
             },
             boost::asio::detached);
@@ -121,5 +173,7 @@ private:
     lwip::tcp_conn::ptr              conn_;
     core_impl_api::tcp_socket_ptr    socket_;
     std::deque<wrapper::pbuf_buffer> write_queue_;
+    boost::asio::steady_timer        sent_timer_;
+    tcp_autotune                     autotune_;
 };
 }  // namespace tun2socks
\ No newline at end of file
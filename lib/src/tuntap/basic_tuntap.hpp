@@ -1,13 +1,22 @@
 #pragma once
+#include "pbuf.hpp"
 #include "use_awaitable.hpp"
 #include <boost/asio.hpp>
 #include <deque>
 #include <tun2socks/parameter.h>
+#include <type_traits>
 
 namespace tun2socks {
 
 namespace tuntap {
 
+    // Devices that only exist inside the process, the core skips the default
+    // adapter lookup and route setup for them.
+    template <typename Device>
+    struct is_virtual_device : std::false_type
+    {
+    };
+
     template <typename Device>
     class basic_tuntap {
     public:
@@ -30,6 +39,21 @@ namespace tuntap {
         {
             return device_.get_io_context();
         }
+        device_type& device() noexcept
+        {
+            return device_;
+        }
+
+        inline std::size_t queue_count() const
+        {
+            return device_.queue_count();
+        }
+
+        template <typename Executor>
+        inline void bind_queue_executor(std::size_t queue, const Executor& ex)
+        {
+            device_.bind_queue_executor(queue, ex);
+        }
 
         template <typename MutableBufferSequence>
         boost::asio::awaitable<std::size_t> async_read_some(const MutableBufferSequence& buffers,
@@ -38,6 +62,53 @@ namespace tuntap {
             return device_.async_read_some(buffers, ec);
         }
 
+        template <typename MutableBufferSequence>
+        boost::asio::awaitable<std::size_t> async_read_some(std::size_t                  queue,
+                                                            const MutableBufferSequence& buffers,
+                                                            boost::system::error_code&   ec)
+        {
+            return device_.async_read_some(queue, buffers, ec);
+        }
+
+        // Reads one packet into a pbuf. A device that owns its receive memory
+        // hands it out as is, the others read into the pbuf from `alloc()`.
+        template <typename Allocator>
+        boost::asio::awaitable<wrapper::pbuf_buffer> async_read_packet(Allocator                  alloc,
+                                                                       boost::system::error_code& ec)
+        {
+            if constexpr (requires { device_.async_read_packet(ec); }) {
+                co_return co_await device_.async_read_packet(ec);
+            }
+            else {
+                auto buffer = alloc();
+                auto bytes  = co_await device_.async_read_some(buffer.mutable_data(), ec);
+                if (ec)
+                    co_return wrapper::pbuf_buffer();
+
+                buffer.realloc(bytes);
+                co_return buffer;
+            }
+        }
+
+        template <typename Allocator>
+        boost::asio::awaitable<wrapper::pbuf_buffer> async_read_packet(std::size_t                queue,
+                                                                       Allocator                  alloc,
+                                                                       boost::system::error_code& ec)
+        {
+            if constexpr (requires { device_.async_read_packet(queue, ec); }) {
+                co_return co_await device_.async_read_packet(queue, ec);
+            }
+            else {
+                auto buffer = alloc();
+                auto bytes  = co_await device_.async_read_some(queue, buffer.mutable_data(), ec);
+                if (ec)
+                    co_return wrapper::pbuf_buffer();
+
+                buffer.realloc(bytes);
+                co_return buffer;
+            }
+        }
+
         template <typename ConstBufferSequence>
         boost::asio::awaitable<std::size_t> async_write_some(const ConstBufferSequence& buffers,
                                                              boost::system::error_code& ec)
@@ -45,6 +116,18 @@ namespace tuntap {
             return device_.async_write_some(buffers, ec);
         }
 
+        // Writes a batch of packets, each a buffer sequence. Returns how many
+        // packets from the front the device is done with, written or dropped.
+        // A packet the device refuses is dropped and reported through `ec`,
+        // the ones after it are still written. Packets past the returned count
+        // were not attempted, e.g. the device went away, the caller may retry.
+        template <typename ConstBufferRange>
+        boost::asio::awaitable<std::size_t> async_write_packets(const ConstBufferRange&    packets,
+                                                                boost::system::error_code& ec)
+        {
+            return device_.async_write_packets(packets, ec);
+        }
+
     private:
         device_type& device_;
     };
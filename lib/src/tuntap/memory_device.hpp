@@ -0,0 +1,143 @@
+#pragma once
+#include "basic_tuntap.hpp"
+#include "use_awaitable.hpp"
+#include <boost/asio.hpp>
+#include <deque>
+#include <functional>
+#include <tun2socks/parameter.h>
+#include <vector>
+
+namespace tun2socks {
+namespace tuntap {
+
+    // A packet device that lives in memory. Packets passed to inject() are read
+    // by the core, packets the core writes go to the output function. Runs the
+    // whole pipeline without root, a kernel TUN or routes.
+    class memory_device : public boost::asio::detail::service_base<memory_device> {
+    public:
+        using packet          = std::vector<uint8_t>;
+        using output_function = std::function<void(boost::asio::const_buffer)>;
+
+    public:
+        memory_device(boost::asio::io_context& ioc)
+            : boost::asio::detail::service_base<memory_device>(ioc), read_signal_(ioc)
+        {
+        }
+
+        inline void open(const parameter::tun_device& param, boost::system::error_code& ec)
+        {
+            open_ = true;
+        }
+        inline void close()
+        {
+            open_ = false;
+            read_signal_.cancel();
+        }
+
+        inline std::size_t queue_count() const
+        {
+            return 1;
+        }
+
+        template <typename Executor>
+        inline void bind_queue_executor(std::size_t queue, const Executor& ex)
+        {
+        }
+
+        // May be called from any thread, the packet is queued on the device's
+        // io_context.
+        void inject(packet p)
+        {
+            boost::asio::post(get_io_context(), [this, p = std::move(p)]() mutable {
+                inbound_.push_back(std::move(p));
+                read_signal_.cancel();
+            });
+        }
+        // Runs on the device's io_context for every packet the core writes. The
+        // buffer is only valid during the call.
+        void set_output_function(output_function f)
+        {
+            output_func_ = std::move(f);
+        }
+
+        template <typename MutableBufferSequence>
+        boost::asio::awaitable<std::size_t> async_read_some(const MutableBufferSequence& buffers,
+                                                            boost::system::error_code&   ec)
+        {
+            while (inbound_.empty()) {
+                if (!open_) {
+                    ec = boost::asio::error::bad_descriptor;
+                    co_return 0;
+                }
+                read_signal_.expires_at(boost::asio::steady_timer::time_point::max());
+                co_await read_signal_.async_wait(net_awaitable[ec]);
+                ec.clear();
+            }
+
+            auto p = std::move(inbound_.front());
+            inbound_.pop_front();
+            co_return boost::asio::buffer_copy(buffers, boost::asio::buffer(p));
+        }
+        template <typename MutableBufferSequence>
+        boost::asio::awaitable<std::size_t> async_read_some(std::size_t                  queue,
+                                                            const MutableBufferSequence& buffers,
+                                                            boost::system::error_code&   ec)
+        {
+            return async_read_some(buffers, ec);
+        }
+        template <typename ConstBufferSequence>
+        boost::asio::awaitable<std::size_t> async_write_some(const ConstBufferSequence& buffers,
+                                                             boost::system::error_code& ec)
+        {
+            output(buffers);
+            co_return boost::asio::buffer_size(buffers);
+        }
+        template <typename ConstBufferRange>
+        boost::asio::awaitable<std::size_t> async_write_packets(const ConstBufferRange&    packets,
+                                                                boost::system::error_code& ec)
+        {
+            std::size_t count = 0;
+            for (const auto& packet : packets) {
+                output(packet);
+                ++count;
+            }
+            co_return count;
+        }
+
+    private:
+        // The output function sees one contiguous packet, chains are copied.
+        template <typename ConstBufferSequence>
+        void output(const ConstBufferSequence& buffers)
+        {
+            if (!output_func_)
+                return;
+
+            auto begin = boost::asio::buffer_sequence_begin(buffers);
+            auto end   = boost::asio::buffer_sequence_end(buffers);
+            if (begin == end) {
+                output_func_(boost::asio::const_buffer());
+                return;
+            }
+            if (std::next(begin) == end) {
+                output_func_(boost::asio::const_buffer(*begin));
+                return;
+            }
+            scratch_.resize(boost::asio::buffer_size(buffers));
+            boost::asio::buffer_copy(boost::asio::buffer(scratch_), buffers);
+            output_func_(boost::asio::buffer(scratch_));
+        }
+
+    private:
+        boost::asio::steady_timer read_signal_;
+        std::deque<packet>        inbound_;
+        output_function           output_func_;
+        std::vector<uint8_t>      scratch_;
+        bool                      open_ = false;
+    };
+
+    template <>
+    struct is_virtual_device<memory_device> : std::true_type
+    {
+    };
+}  // namespace tuntap
+}  // namespace tun2socks
@@ -0,0 +1,488 @@
+#pragma once
+#include "basic_tuntap.hpp"
+#include "use_awaitable.hpp"
+#include <algorithm>
+#include <array>
+#include <boost/asio.hpp>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <spdlog/spdlog.h>
+#include <string>
+#include <tun2socks/parameter.h>
+#include <vector>
+
+namespace tun2socks {
+namespace tuntap {
+
+    namespace details {
+
+        constexpr uint32_t pcap_magic_micro = 0xa1b2c3d4;
+        constexpr uint32_t pcap_magic_nano  = 0xa1b23c4d;
+
+        constexpr uint32_t pcapng_block_shb = 0x0a0d0d0a;
+        constexpr uint32_t pcapng_block_idb = 0x00000001;
+        constexpr uint32_t pcapng_block_spb = 0x00000003;
+        constexpr uint32_t pcapng_block_epb = 0x00000006;
+        constexpr uint32_t pcapng_byte_order = 0x1a2b3c4d;
+
+        constexpr uint16_t linktype_ethernet = 1;
+        constexpr uint16_t linktype_raw      = 101;
+        constexpr uint16_t linktype_ipv4     = 228;
+        constexpr uint16_t linktype_ipv6     = 229;
+
+        inline uint16_t pcap_u16(const uint8_t* p, bool swap)
+        {
+            uint16_t v;
+            std::memcpy(&v, p, sizeof(v));
+            return swap ? uint16_t((v >> 8) | (v << 8)) : v;
+        }
+        inline uint32_t pcap_u32(const uint8_t* p, bool swap)
+        {
+            uint32_t v;
+            std::memcpy(&v, p, sizeof(v));
+            return swap ? ((v >> 24) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000) | (v << 24)) : v;
+        }
+
+        // Offset of the IP header in a frame of the given link type, or -1 when
+        // the frame does not carry IP.
+        inline int pcap_ip_offset(uint16_t linktype, const uint8_t* data, std::size_t size)
+        {
+            switch (linktype) {
+                case linktype_raw:
+                case linktype_ipv4:
+                case linktype_ipv6:
+                    return 0;
+                case linktype_ethernet: {
+                    if (size < 14)
+                        return -1;
+                    uint16_t type = (uint16_t(data[12]) << 8) | data[13];
+                    return (type == 0x0800 || type == 0x86dd) ? 14 : -1;
+                }
+                default:
+                    return -1;
+            }
+        }
+    }  // namespace details
+
+    // Replays a pcap or pcapng capture as the packets read from the device and
+    // records every packet written to it into a pcap with LINKTYPE_RAW. Makes
+    // performance runs repeatable without a network in the loop.
+    class pcap_device : public boost::asio::detail::service_base<pcap_device> {
+    public:
+        enum class timing {
+            // Feed packets as fast as the core reads them.
+            line_rate,
+            // Keep the gaps between packets of the capture.
+            original
+        };
+
+        struct statistics
+        {
+            std::size_t packets_in  = 0;
+            std::size_t bytes_in    = 0;
+            std::size_t packets_out = 0;
+            std::size_t bytes_out   = 0;
+            std::size_t skipped     = 0;
+
+            std::chrono::steady_clock::time_point replay_start;
+            std::chrono::steady_clock::time_point replay_end;
+            std::chrono::steady_clock::time_point last_output;
+        };
+
+    public:
+        pcap_device(boost::asio::io_context& ioc)
+            : boost::asio::detail::service_base<pcap_device>(ioc), timer_(ioc)
+        {
+        }
+        ~pcap_device()
+        {
+            close();
+        }
+
+        // Both must be set before the core opens the device. An empty path
+        // disables that direction.
+        void set_replay_file(const std::string& path, timing mode = timing::line_rate)
+        {
+            replay_path_ = path;
+            timing_      = mode;
+        }
+        void set_record_file(const std::string& path)
+        {
+            record_path_ = path;
+        }
+        const statistics& stats() const
+        {
+            return stats_;
+        }
+
+        inline void open(const parameter::tun_device& param, boost::system::error_code& ec)
+        {
+            // The whole capture is loaded up front so disk reads stay out of
+            // the measurement.
+            if (!replay_path_.empty()) {
+                if (!load(replay_path_, ec))
+                    return;
+
+                auto oversized = std::count_if(packets_.begin(), packets_.end(), [&param](const packet& p) {
+                    return p.data.size() > param.mtu;
+                });
+                if (oversized != 0)
+                    spdlog::warn("{0} packets of {1} are larger than the MTU of {2} and will be skipped",
+                                 oversized,
+                                 replay_path_,
+                                 param.mtu);
+            }
+
+            if (!record_path_.empty()) {
+                record_.open(record_path_, std::ios::binary | std::ios::trunc);
+                if (!record_) {
+                    ec = boost::asio::error::bad_descriptor;
+                    spdlog::error("Failed to create pcap record file: {0}", record_path_);
+                    return;
+                }
+                std::array<uint8_t, 24> header{};
+                write_u32(header.data(), details::pcap_magic_nano);
+                write_u16(header.data() + 4, 2);
+                write_u16(header.data() + 6, 4);
+                write_u32(header.data() + 16, 0xffff);
+                write_u32(header.data() + 20, details::linktype_raw);
+                record_.write(reinterpret_cast<const char*>(header.data()), header.size());
+            }
+            open_ = true;
+        }
+        inline void close()
+        {
+            if (!open_)
+                return;
+            open_ = false;
+            timer_.cancel();
+
+            if (record_.is_open())
+                record_.close();
+
+            if (stats_.packets_out != 0) {
+                auto elapsed = std::chrono::duration<double>(stats_.last_output - stats_.replay_start).count();
+                spdlog::info("pcap recorded {0} packets, {1} bytes, last one {2:.3f}s after replay start",
+                             stats_.packets_out,
+                             stats_.bytes_out,
+                             elapsed);
+            }
+        }
+
+        inline std::size_t queue_count() const
+        {
+            return 1;
+        }
+
+        template <typename Executor>
+        inline void bind_queue_executor(std::size_t queue, const Executor& ex)
+        {
+        }
+
+        template <typename MutableBufferSequence>
+        boost::asio::awaitable<std::size_t> async_read_some(const MutableBufferSequence& buffers,
+                                                            boost::system::error_code&   ec)
+        {
+            if (!open_) {
+                ec = boost::asio::error::bad_descriptor;
+                co_return 0;
+            }
+            if (next_ == 0)
+                stats_.replay_start = std::chrono::steady_clock::now();
+
+            for (;;) {
+                if (next_ == packets_.size()) {
+                    if (next_ != 0 && stats_.replay_end == std::chrono::steady_clock::time_point{})
+                        finish_replay();
+                    ec = boost::asio::error::eof;
+                    co_return 0;
+                }
+
+                const auto& p = packets_[next_];
+                if (timing_ == timing::original) {
+                    timer_.expires_at(stats_.replay_start + std::chrono::nanoseconds(p.timestamp - packets_.front().timestamp));
+                    co_await timer_.async_wait(net_awaitable[ec]);
+                    ec.clear();
+                }
+                else {
+                    // A device read completes through the io_context, without
+                    // this the reader would replay the whole capture before any
+                    // other handler, such as a UDP proxy's socket, got to run.
+                    co_await boost::asio::post(get_io_context(), boost::asio::use_awaitable);
+                }
+                if (!open_) {
+                    ec = boost::asio::error::bad_descriptor;
+                    co_return 0;
+                }
+                ++next_;
+
+                // A TUN device never hands out more than the read buffer
+                // holds, copying would cut the packet short.
+                if (p.data.size() > boost::asio::buffer_size(buffers)) {
+                    stats_.skipped++;
+                    continue;
+                }
+                stats_.packets_in++;
+                stats_.bytes_in += p.data.size();
+                co_return boost::asio::buffer_copy(buffers, boost::asio::buffer(p.data));
+            }
+        }
+        template <typename MutableBufferSequence>
+        boost::asio::awaitable<std::size_t> async_read_some(std::size_t                  queue,
+                                                            const MutableBufferSequence& buffers,
+                                                            boost::system::error_code&   ec)
+        {
+            return async_read_some(buffers, ec);
+        }
+        template <typename ConstBufferSequence>
+        boost::asio::awaitable<std::size_t> async_write_some(const ConstBufferSequence& buffers,
+                                                             boost::system::error_code& ec)
+        {
+            auto size = boost::asio::buffer_size(buffers);
+            if (record_.is_open()) {
+                write_record_header(size);
+                for (auto it = boost::asio::buffer_sequence_begin(buffers); it != boost::asio::buffer_sequence_end(buffers); ++it) {
+                    boost::asio::const_buffer b(*it);
+                    record_.write(static_cast<const char*>(b.data()), b.size());
+                }
+            }
+            stats_.packets_out++;
+            stats_.bytes_out += size;
+            stats_.last_output = std::chrono::steady_clock::now();
+            co_return size;
+        }
+        template <typename ConstBufferRange>
+        boost::asio::awaitable<std::size_t> async_write_packets(const ConstBufferRange&    packets,
+                                                                boost::system::error_code& ec)
+        {
+            std::size_t count = 0;
+            for (const auto& packet : packets) {
+                co_await async_write_some(packet, ec);
+                ++count;
+            }
+            co_return count;
+        }
+
+    private:
+        struct packet
+        {
+            // Nanoseconds since the epoch, as stored in the capture.
+            uint64_t             timestamp;
+            std::vector<uint8_t> data;
+        };
+
+        void finish_replay()
+        {
+            stats_.replay_end = std::chrono::steady_clock::now();
+
+            auto elapsed = std::chrono::duration<double>(stats_.replay_end - stats_.replay_start).count();
+            spdlog::info("pcap replay finished: {0} packets, {1} bytes in {2:.3f}s, {3:.0f} packets/s, {4:.1f} Mbit/s",
+                         stats_.packets_in,
+                         stats_.bytes_in,
+                         elapsed,
+                         elapsed > 0 ? stats_.packets_in / elapsed : 0.0,
+                         elapsed > 0 ? stats_.bytes_in * 8 / elapsed / 1e6 : 0.0);
+        }
+
+        void add_packet(uint16_t linktype, uint64_t timestamp, const uint8_t* data, std::size_t size)
+        {
+            int offset = details::pcap_ip_offset(linktype, data, size);
+            if (offset < 0) {
+                stats_.skipped++;
+                return;
+            }
+            packets_.push_back(packet{timestamp, std::vector<uint8_t>(data + offset, data + size)});
+        }
+
+        bool load(const std::string& path, boost::system::error_code& ec)
+        {
+            std::ifstream file(path, std::ios::binary);
+            if (!file) {
+                ec = boost::asio::error::not_found;
+                spdlog::error("Failed to open pcap replay file: {0}", path);
+                return false;
+            }
+            std::vector<uint8_t> content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+            bool ok = false;
+            if (content.size() >= 4) {
+                uint32_t magic = details::pcap_u32(content.data(), false);
+                ok             = magic == details::pcapng_block_shb ? load_pcapng(content) : load_pcap(content);
+            }
+            if (!ok) {
+                ec = boost::asio::error::invalid_argument;
+                spdlog::error("Unsupported or corrupted capture file: {0}", path);
+                return false;
+            }
+            spdlog::info("Loaded {0} packets from {1}, skipped {2} non-IP frames", packets_.size(), path, stats_.skipped);
+            return true;
+        }
+
+        bool load_pcap(const std::vector<uint8_t>& content)
+        {
+            if (content.size() < 24)
+                return false;
+
+            bool swap = false;
+            bool nano = false;
+            switch (details::pcap_u32(content.data(), false)) {
+                case details::pcap_magic_micro:
+                    break;
+                case details::pcap_magic_nano:
+                    nano = true;
+                    break;
+                default:
+                    swap = true;
+                    switch (details::pcap_u32(content.data(), true)) {
+                        case details::pcap_magic_micro:
+                            break;
+                        case details::pcap_magic_nano:
+                            nano = true;
+                            break;
+                        default:
+                            return false;
+                    }
+            }
+            auto linktype = uint16_t(details::pcap_u32(content.data() + 20, swap));
+
+            std::size_t pos = 24;
+            while (pos + 16 <= content.size()) {
+                const uint8_t* record = content.data() + pos;
+
+                uint64_t sec    = details::pcap_u32(record, swap);
+                uint64_t frac   = details::pcap_u32(record + 4, swap);
+                uint32_t caplen = details::pcap_u32(record + 8, swap);
+                if (pos + 16 + caplen > content.size())
+                    return false;
+
+                add_packet(linktype, sec * 1000000000 + (nano ? frac : frac * 1000), record + 16, caplen);
+                pos += 16 + caplen;
+            }
+            return true;
+        }
+
+        bool load_pcapng(const std::vector<uint8_t>& content)
+        {
+            struct interface
+            {
+                uint16_t linktype;
+                // Timestamp units per second.
+                uint64_t resolution;
+            };
+            std::vector<interface> interfaces;
+
+            bool        swap = false;
+            std::size_t pos  = 0;
+            while (pos + 12 <= content.size()) {
+                const uint8_t* block = content.data() + pos;
+
+                uint32_t type = details::pcap_u32(block, false);
+                if (type == details::pcapng_block_shb) {
+                    // The byte-order magic decides how the rest of the section
+                    // is read, the block type itself is a palindrome.
+                    uint32_t order = details::pcap_u32(block + 8, false);
+                    if (order == details::pcapng_byte_order)
+                        swap = false;
+                    else if (details::pcap_u32(block + 8, true) == details::pcapng_byte_order)
+                        swap = true;
+                    else
+                        return false;
+                    interfaces.clear();
+                }
+                else {
+                    type = details::pcap_u32(block, swap);
+                }
+
+                uint32_t length = details::pcap_u32(block + 4, swap);
+                if (length < 12 || length % 4 != 0 || pos + length > content.size())
+                    return false;
+
+                const uint8_t* body      = block + 8;
+                std::size_t    body_size = length - 12;
+
+                if (type == details::pcapng_block_idb && body_size >= 8) {
+                    interface iface{details::pcap_u16(body, swap), 1000000};
+
+                    // Options follow the fixed part, only if_tsresol matters.
+                    std::size_t opt = 8;
+                    while (opt + 4 <= body_size) {
+                        uint16_t code = details::pcap_u16(body + opt, swap);
+                        uint16_t len  = details::pcap_u16(body + opt + 2, swap);
+                        if (code == 0)
+                            break;
+                        if (code == 9 && len >= 1 && opt + 5 <= body_size) {
+                            uint8_t resol    = body[opt + 4];
+                            iface.resolution = 1;
+                            for (int i = 0; i < (resol & 0x7f); ++i)
+                                iface.resolution *= (resol & 0x80) ? 2 : 10;
+                        }
+                        opt += 4 + ((len + 3) & ~3u);
+                    }
+                    interfaces.push_back(iface);
+                }
+                else if (type == details::pcapng_block_epb && body_size >= 20) {
+                    uint32_t id     = details::pcap_u32(body, swap);
+                    uint64_t ts     = (uint64_t(details::pcap_u32(body + 4, swap)) << 32) | details::pcap_u32(body + 8, swap);
+                    uint32_t caplen = details::pcap_u32(body + 12, swap);
+                    if (id >= interfaces.size() || 20 + std::size_t(caplen) > body_size)
+                        return false;
+
+                    const auto& iface = interfaces[id];
+                    uint64_t    ns    = ts / iface.resolution * 1000000000 +
+                                  ts % iface.resolution * 1000000000 / iface.resolution;
+                    add_packet(iface.linktype, ns, body + 20, caplen);
+                }
+                else if (type == details::pcapng_block_spb && body_size >= 4 && !interfaces.empty()) {
+                    // Simple packets carry no timestamp, they replay back to back.
+                    uint32_t len = std::min<std::size_t>(details::pcap_u32(body, swap), body_size - 4);
+                    add_packet(interfaces.front().linktype,
+                               packets_.empty() ? 0 : packets_.back().timestamp,
+                               body + 4,
+                               len);
+                }
+                pos += length;
+            }
+            return true;
+        }
+
+        void write_record_header(std::size_t size)
+        {
+            auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          std::chrono::system_clock::now().time_since_epoch())
+                          .count();
+
+            std::array<uint8_t, 16> header;
+            write_u32(header.data(), uint32_t(ns / 1000000000));
+            write_u32(header.data() + 4, uint32_t(ns % 1000000000));
+            write_u32(header.data() + 8, uint32_t(size));
+            write_u32(header.data() + 12, uint32_t(size));
+            record_.write(reinterpret_cast<const char*>(header.data()), header.size());
+        }
+        static void write_u16(uint8_t* p, uint16_t v)
+        {
+            std::memcpy(p, &v, sizeof(v));
+        }
+        static void write_u32(uint8_t* p, uint32_t v)
+        {
+            std::memcpy(p, &v, sizeof(v));
+        }
+
+    private:
+        boost::asio::steady_timer timer_;
+        std::string               replay_path_;
+        std::string               record_path_;
+        timing                    timing_ = timing::line_rate;
+        std::vector<packet>       packets_;
+        std::size_t               next_ = 0;
+        std::ofstream             record_;
+        statistics                stats_;
+        bool                      open_ = false;
+    };
+
+    template <>
+    struct is_virtual_device<pcap_device> : std::true_type
+    {
+    };
+}  // namespace tuntap
+}  // namespace tun2socks
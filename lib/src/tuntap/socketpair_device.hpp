@@ -0,0 +1,152 @@
+#pragma once
+#include <tun2socks/platform.h>
+
+#ifndef OS_WINDOWS
+#    include "basic_tuntap.hpp"
+#    include "use_awaitable.hpp"
+#    include <boost/asio.hpp>
+#    include <sys/socket.h>
+#    include <sys/uio.h>
+#    include <tun2socks/parameter.h>
+#    include <unistd.h>
+#    include <vector>
+
+namespace tun2socks {
+namespace tuntap {
+
+    // A packet device on one end of an AF_UNIX socketpair. The other end,
+    // peer_handle(), behaves like a TUN fd: one IP packet per read or write,
+    // so a harness thread or another process can drive the core through it.
+    class socketpair_device : public boost::asio::detail::service_base<socketpair_device> {
+    public:
+        socketpair_device(boost::asio::io_context& ioc)
+            : boost::asio::detail::service_base<socketpair_device>(ioc), descriptor_(ioc)
+        {
+        }
+        ~socketpair_device()
+        {
+            close();
+        }
+
+        inline void open(const parameter::tun_device& param, boost::system::error_code& ec)
+        {
+            int fds[2];
+            // SOCK_SEQPACKET is not available for AF_UNIX everywhere, datagrams
+            // keep the packet boundaries as well.
+            if (::socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) < 0 &&
+                ::socketpair(AF_UNIX, SOCK_DGRAM, 0, fds) < 0) {
+                ec = boost::system::error_code(errno, boost::system::system_category());
+                return;
+            }
+
+            // Room for bursts of full sized packets in both directions.
+            int size = 4 * 1024 * 1024;
+            for (auto fd : fds) {
+                setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+                setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+            }
+
+            descriptor_.assign(fds[0], ec);
+            if (ec) {
+                ::close(fds[0]);
+                ::close(fds[1]);
+                return;
+            }
+            descriptor_.non_blocking(true, ec);
+            peer_ = fds[1];
+        }
+        inline void close()
+        {
+            boost::system::error_code ec;
+            descriptor_.close(ec);
+            if (peer_ != -1) {
+                ::close(peer_);
+                peer_ = -1;
+            }
+        }
+
+        // Stays owned by the device and is closed with it.
+        inline int peer_handle() const
+        {
+            return peer_;
+        }
+
+        inline std::size_t queue_count() const
+        {
+            return 1;
+        }
+
+        template <typename Executor>
+        inline void bind_queue_executor(std::size_t queue, const Executor& ex)
+        {
+        }
+
+        template <typename MutableBufferSequence>
+        boost::asio::awaitable<std::size_t> async_read_some(const MutableBufferSequence& buffers,
+                                                            boost::system::error_code&   ec)
+        {
+            auto bytes = co_await descriptor_.async_read_some(buffers, net_awaitable[ec]);
+            co_return bytes;
+        }
+        template <typename MutableBufferSequence>
+        boost::asio::awaitable<std::size_t> async_read_some(std::size_t                  queue,
+                                                            const MutableBufferSequence& buffers,
+                                                            boost::system::error_code&   ec)
+        {
+            return async_read_some(buffers, ec);
+        }
+        template <typename ConstBufferSequence>
+        boost::asio::awaitable<std::size_t> async_write_some(const ConstBufferSequence& buffers,
+                                                             boost::system::error_code& ec)
+        {
+            auto bytes = co_await descriptor_.async_write_some(buffers, net_awaitable[ec]);
+            co_return bytes;
+        }
+        template <typename ConstBufferRange>
+        boost::asio::awaitable<std::size_t> async_write_packets(const ConstBufferRange&    packets,
+                                                                boost::system::error_code& ec)
+        {
+            std::vector<iovec> iov;
+
+            std::size_t count = 0;
+            for (auto it = std::begin(packets), end = std::end(packets); it != end;) {
+                iov.clear();
+                for (auto b = boost::asio::buffer_sequence_begin(*it); b != boost::asio::buffer_sequence_end(*it); ++b) {
+                    boost::asio::const_buffer buffer(*b);
+                    iov.push_back({const_cast<void*>(buffer.data()), buffer.size()});
+                }
+                msghdr msg{};
+                msg.msg_iov    = iov.data();
+                msg.msg_iovlen = iov.size();
+
+                auto bytes = ::sendmsg(descriptor_.native_handle(), &msg, 0);
+                if (bytes < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        co_await descriptor_.async_wait(boost::asio::posix::stream_descriptor::wait_write,
+                                                        net_awaitable[ec]);
+                        if (ec)
+                            co_return count;
+                        continue;
+                    }
+                    ec = boost::system::error_code(errno, boost::system::system_category());
+                }
+                ++count;
+                ++it;
+            }
+            co_return count;
+        }
+
+    private:
+        boost::asio::posix::stream_descriptor descriptor_;
+        int                                   peer_ = -1;
+    };
+
+    template <>
+    struct is_virtual_device<socketpair_device> : std::true_type
+    {
+    };
+}  // namespace tuntap
+}  // namespace tun2socks
+#endif
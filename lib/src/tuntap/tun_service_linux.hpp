@@ -8,20 +8,38 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include <netlink/attr.h>
 #include <netlink/genl/genl.h>
 #include <netlink/netlink.h>
 #include <netlink/route/addr.h>
 
+#include <array>
 #include <boost/asio.hpp>
 #include <string>
 #include <tun2socks/parameter.h>
+#include <vector>
 
 namespace tun2socks {
 namespace tuntap {
 
     namespace details {
+        // struct virtio_net_hdr, <linux/virtio_net.h> does not compile as C++.
+        struct virtio_net_hdr
+        {
+            uint8_t  flags;
+            uint8_t  gso_type;
+            uint16_t hdr_len;
+            uint16_t gso_size;
+            uint16_t csum_start;
+            uint16_t csum_offset;
+        };
+        constexpr uint8_t VIRTIO_NET_HDR_F_NEEDS_CSUM = 1;
+        constexpr uint8_t VIRTIO_NET_HDR_GSO_NONE     = 0;
+        constexpr uint8_t VIRTIO_NET_HDR_GSO_TCPV4    = 1;
+        constexpr uint8_t VIRTIO_NET_HDR_GSO_TCPV6    = 4;
+
         inline static boost::system::error_code log_last_system_error(std::string_view prefix)
         {
             boost::system::error_code ec(errno, boost::system::system_category());
@@ -187,102 +205,544 @@ namespace tuntap {
             rtnl_addr_put(addr);
             nl_socket_free(sock);
         }
-    }  // namespace details
 
-    class tun_service_linux : public boost::asio::detail::service_base<tun_service_linux> {
-    public:
-        tun_service_linux(boost::asio::io_context& ioc)
-            : boost::asio::detail::service_base<tun_service_linux>(ioc),
-              stream_descriptor_(ioc)
+        inline static uint64_t checksum_add(const uint8_t* data, std::size_t len, uint64_t sum = 0)
+        {
+            for (; len > 1; data += 2, len -= 2)
+                sum += (uint32_t(data[0]) << 8) | data[1];
+            if (len)
+                sum += uint32_t(data[0]) << 8;
+            return sum;
+        }
+        inline static uint16_t checksum_fold(uint64_t sum)
         {
+            while (sum >> 16)
+                sum = (sum & 0xffff) + (sum >> 16);
+            return uint16_t(sum);
         }
 
-        inline void open(const parameter::tun_device& param, boost::system::error_code& ec)
+        // With TUN_F_CSUM the kernel may hand us packets whose transport checksum
+        // only covers the pseudo header, finish it when lwIP is to verify it.
+        inline static void vnet_complete_checksum(const virtio_net_hdr&       hdr,
+                                                  boost::asio::mutable_buffer packet)
         {
-            int fd      = -1;
-            int ctl_skt = -1;
-            try {
-                if ((fd = ::open("/dev/net/tun", O_RDWR)) == -1) {
-                    details::log_throw_last_system_error("open");
-                    return;
+            if (!(hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM))
+                return;
+
+            auto data = static_cast<uint8_t*>(packet.data());
+            auto pos  = std::size_t(hdr.csum_start) + hdr.csum_offset;
+            if (hdr.csum_start > packet.size() || pos + 2 > packet.size())
+                return;
+
+            uint16_t chksum = ~checksum_fold(checksum_add(data + hdr.csum_start,
+                                                          packet.size() - hdr.csum_start));
+            if (chksum == 0 && hdr.csum_offset == 6)
+                chksum = 0xffff;  // UDP, zero means no checksum
+
+            data[pos]     = uint8_t(chksum >> 8);
+            data[pos + 1] = uint8_t(chksum);
+        }
+
+        struct tcp_segment
+        {
+            const uint8_t* data    = nullptr;
+            std::size_t    size    = 0;
+            std::size_t    ip_hlen = 0;
+            std::size_t    hlen    = 0;
+            uint32_t       seq     = 0;
+        };
+
+        // A packet is a buffer sequence, lwIP builds its headers in the first
+        // buffer and may chain the payload behind.
+        template <typename ConstBufferSequence>
+        inline static boost::asio::const_buffer first_buffer(const ConstBufferSequence& packet)
+        {
+            auto it = boost::asio::buffer_sequence_begin(packet);
+            if (it == boost::asio::buffer_sequence_end(packet))
+                return boost::asio::const_buffer();
+            return boost::asio::const_buffer(*it);
+        }
+        // The MSS a TSO segment is to be cut at, if the packet carries one.
+        template <typename ConstBufferSequence>
+        inline static std::size_t packet_gso_mss(const ConstBufferSequence& packet)
+        {
+            if constexpr (requires { packet.gso_mss; })
+                return packet.gso_mss;
+            else
+                return 0;
+        }
+        // Appends the buffers of `packet` to `gather`, leaving out its first
+        // `offset` bytes.
+        template <typename ConstBufferSequence>
+        inline static void append_packet(const ConstBufferSequence&              packet,
+                                         std::size_t                             offset,
+                                         std::vector<boost::asio::const_buffer>& gather)
+        {
+            for (auto it = boost::asio::buffer_sequence_begin(packet); it != boost::asio::buffer_sequence_end(packet); ++it) {
+                boost::asio::const_buffer buffer(*it);
+                if (offset >= buffer.size()) {
+                    offset -= buffer.size();
+                    continue;
                 }
+                gather.push_back(buffer + offset);
+                offset = 0;
+            }
+        }
 
-                ifreq ifr{0};
-                ifr.ifr_flags = IFF_TUN;
-                ifr.ifr_flags |= IFF_NO_PI;
-                strcpy(ifr.ifr_name, param.tun_name.c_str());
-                if (ioctl(fd, TUNSETIFF, &ifr) == -1) {
-                    details::log_throw_last_system_error("ioctl");
-                    return;
+        template <typename ConstBufferSequence>
+        inline static bool parse_tcp_segment(const ConstBufferSequence& packet, tcp_segment& seg)
+        {
+            auto first = first_buffer(packet);
+            auto data  = static_cast<const uint8_t*>(first.data());
+            auto size  = first.size();
+            if (size < 40)
+                return false;
+
+            switch (data[0] >> 4) {
+                case 4:
+                    // Fragments can neither be segmented nor merged.
+                    if (data[9] != IPPROTO_TCP || (((data[6] << 8) | data[7]) & 0x3fff))
+                        return false;
+                    seg.ip_hlen = (data[0] & 0x0f) * 4;
+                    break;
+                case 6:
+                    if (data[6] != IPPROTO_TCP)
+                        return false;
+                    seg.ip_hlen = 40;
+                    break;
+                default: return false;
+            }
+            if (seg.ip_hlen + 20 > size)
+                return false;
+
+            auto tcp = data + seg.ip_hlen;
+            seg.data = data;
+            seg.size = boost::asio::buffer_size(packet);
+            seg.hlen = seg.ip_hlen + (tcp[12] >> 4) * 4;
+            seg.seq  = (uint32_t(tcp[4]) << 24) | (uint32_t(tcp[5]) << 16) | (uint32_t(tcp[6]) << 8) | tcp[7];
+            return seg.hlen <= size && seg.hlen <= 120;
+        }
+
+        // `next` may share a GSO packet with `prev` when it continues the same
+        // flow in order and its headers only differ in sequence number, lengths,
+        // checksums and PSH, which only the last segment may carry.
+        inline static bool tcp_segment_continues(const tcp_segment& prev, const tcp_segment& next)
+        {
+            if (prev.ip_hlen != next.ip_hlen || prev.hlen != next.hlen)
+                return false;
+            if (prev.size == prev.hlen || next.size == next.hlen)
+                return false;
+            if (next.seq != prev.seq + uint32_t(prev.size - prev.hlen))
+                return false;
+
+            auto p = prev.data;
+            auto n = next.data;
+            if (p[prev.ip_hlen + 13] != 0x10 || (n[next.ip_hlen + 13] & ~0x08) != 0x10)
+                return false;
+
+            if ((p[0] >> 4) == 4) {
+                if (p[1] != n[1] || p[6] != n[6] || p[8] != n[8] ||
+                    std::memcmp(p + 12, n + 12, prev.ip_hlen - 12) != 0)
+                    return false;
+            }
+            else if (std::memcmp(p, n, 4) != 0 || p[7] != n[7] || std::memcmp(p + 8, n + 8, 32) != 0)
+                return false;
+
+            auto tp = p + prev.ip_hlen;
+            auto tn = n + next.ip_hlen;
+            return std::memcmp(tp, tn, 4) == 0 &&       // ports
+                   std::memcmp(tp + 8, tn + 8, 4) == 0 &&  // ack
+                   std::memcmp(tp + 14, tn + 14, 2) == 0 &&  // window
+                   std::memcmp(tp + 20, tn + 20, prev.hlen - prev.ip_hlen - 20) == 0;
+        }
+
+        // lwIP leaves the UDP checksum of an offloading device empty, put the
+        // pseudo header sum in a copy of the headers and let the kernel finish it.
+        template <typename ConstBufferSequence>
+        inline static void vnet_prepare_udp(const ConstBufferSequence&              packet,
+                                            virtio_net_hdr&                         hdr,
+                                            std::array<uint8_t, 120>&               headers,
+                                            std::vector<boost::asio::const_buffer>& gather)
+        {
+            auto first = first_buffer(packet);
+            auto data  = static_cast<const uint8_t*>(first.data());
+            auto size  = boost::asio::buffer_size(packet);
+
+            std::size_t ip_hlen = 0;
+            uint64_t    sum     = 0;
+            if (first.size() >= 20 && (data[0] >> 4) == 4 && data[9] == IPPROTO_UDP &&
+                !(((data[6] << 8) | data[7]) & 0x3fff)) {
+                ip_hlen = (data[0] & 0x0f) * 4;
+                sum     = checksum_add(data + 12, 8);
+            }
+            else if (first.size() >= 40 && (data[0] >> 4) == 6 && data[6] == IPPROTO_UDP) {
+                ip_hlen = 40;
+                sum     = checksum_add(data + 8, 32);
+            }
+            if (ip_hlen == 0 || ip_hlen + 8 > first.size() || ip_hlen + 8 > headers.size()) {
+                append_packet(packet, 0, gather);
+                return;
+            }
+
+            auto hlen = ip_hlen + 8;
+            std::memcpy(headers.data(), data, hlen);
+
+            uint16_t pseudo      = checksum_fold(sum + IPPROTO_UDP + (size - ip_hlen));
+            headers[ip_hlen + 6] = uint8_t(pseudo >> 8);
+            headers[ip_hlen + 7] = uint8_t(pseudo);
+
+            hdr.flags       = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+            hdr.csum_start  = uint16_t(ip_hlen);
+            hdr.csum_offset = 6;
+
+            gather.emplace_back(headers.data(), hlen);
+            append_packet(packet, hlen, gather);
+        }
+
+        // Build the virtio header and gather list for the packets at `it`.
+        // In-order segments of one TCP flow are merged, and a TCP packet larger
+        // than the MTU, or than the MSS it carries, leaves as a GSO packet cut
+        // at the smaller of the two. The IP/TCP header is rewritten to
+        // `headers` with the pseudo header sum in the checksum field and the
+        // kernel completes the checksum, lwIP leaves it to the device. Returns
+        // the packets consumed.
+        template <typename Iterator>
+        inline static std::size_t vnet_prepare_packets(Iterator                                it,
+                                                       Iterator                                end,
+                                                       std::size_t                             mtu,
+                                                       virtio_net_hdr&                         hdr,
+                                                       std::array<uint8_t, 120>&               headers,
+                                                       std::vector<boost::asio::const_buffer>& gather)
+        {
+            constexpr std::size_t max_segments = 64;
+
+            hdr = {};
+            gather.clear();
+            gather.emplace_back(&hdr, sizeof(hdr));
+
+            tcp_segment first;
+            if (!parse_tcp_segment(*it, first)) {
+                vnet_prepare_udp(*it, hdr, headers, gather);
+                return 1;
+            }
+
+            tcp_segment last    = first;
+            std::size_t count   = 1;
+            std::size_t gso_mss = packet_gso_mss(*it);
+            std::size_t size  = first.size;
+            for (auto next_it = std::next(it); mtu > first.hlen && next_it != end && count < max_segments; ++next_it) {
+                tcp_segment next;
+                if (!parse_tcp_segment(*next_it, next) || !tcp_segment_continues(last, next) ||
+                    size + next.size - next.hlen > 0xffff)
+                    break;
+
+                size += next.size - next.hlen;
+                last = next;
+                ++count;
+            }
+
+            auto ip_hlen = first.ip_hlen;
+            auto hlen    = first.hlen;
+            std::memcpy(headers.data(), first.data, hlen);
+
+            uint64_t sum = 0;
+            uint8_t  gso = VIRTIO_NET_HDR_GSO_NONE;
+            if ((first.data[0] >> 4) == 4) {
+                headers[2]  = uint8_t(size >> 8);
+                headers[3]  = uint8_t(size);
+                headers[10] = 0;
+                headers[11] = 0;
+
+                uint16_t ip_chksum = ~checksum_fold(checksum_add(headers.data(), ip_hlen));
+                headers[10]        = uint8_t(ip_chksum >> 8);
+                headers[11]        = uint8_t(ip_chksum);
+
+                sum = checksum_add(headers.data() + 12, 8);
+                gso = VIRTIO_NET_HDR_GSO_TCPV4;
+            }
+            else {
+                headers[4] = uint8_t((size - ip_hlen) >> 8);
+                headers[5] = uint8_t(size - ip_hlen);
+
+                sum = checksum_add(headers.data() + 8, 32);
+                gso = VIRTIO_NET_HDR_GSO_TCPV6;
+            }
+            headers[ip_hlen + 13] = last.data[ip_hlen + 13];
+
+            uint16_t pseudo       = checksum_fold(sum + IPPROTO_TCP + (size - ip_hlen));
+            headers[ip_hlen + 16] = uint8_t(pseudo >> 8);
+            headers[ip_hlen + 17] = uint8_t(pseudo);
+
+            hdr.flags       = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+            hdr.csum_start  = uint16_t(ip_hlen);
+            hdr.csum_offset = 16;
+
+            // TCP options count against the MSS.
+            std::size_t segment = mtu > hlen ? mtu - hlen : 0;
+            if (gso_mss > hlen - ip_hlen - 20)
+                segment = std::min(segment, gso_mss - (hlen - ip_hlen - 20));
+            if (segment > 0 && size - hlen > segment) {
+                hdr.gso_type = gso;
+                hdr.hdr_len  = uint16_t(hlen);
+                hdr.gso_size = uint16_t(segment);
+            }
+
+            gather.emplace_back(headers.data(), hlen);
+            for (std::size_t i = 0; i < count; ++i, ++it)
+                append_packet(*it, hlen, gather);
+            return count;
+        }
+
+        // Create the interface with one fd per queue and bring it up. On failure
+        // every fd is closed again and `ec` is set.
+        inline static void open_tun(const parameter::tun_device& param,
+                                    std::vector<int>&            fds,
+                                    std::size_t&                 mtu,
+                                    boost::system::error_code&   ec)
+        {
+            int ctl_skt = -1;
+            try {
+                // IFF_MULTI_QUEUE: every TUNSETIFF on the same name attaches one more
+                // queue to the interface and the kernel spreads flows across them.
+                auto queues = std::max<std::size_t>(param.queues, 1);
+                for (std::size_t i = 0; i < queues; ++i) {
+                    int fd = ::open("/dev/net/tun", O_RDWR);
+                    if (fd == -1) {
+                        log_throw_last_system_error("open");
+                        return;
+                    }
+                    fds.push_back(fd);
+
+                    ifreq ifr{0};
+                    ifr.ifr_flags = IFF_TUN;
+                    ifr.ifr_flags |= IFF_NO_PI;
+                    if (queues > 1)
+                        ifr.ifr_flags |= IFF_MULTI_QUEUE;
+                    if (param.offload)
+                        ifr.ifr_flags |= IFF_VNET_HDR;
+                    strcpy(ifr.ifr_name, param.tun_name.c_str());
+                    if (ioctl(fd, TUNSETIFF, &ifr) == -1) {
+                        log_throw_last_system_error("ioctl");
+                        return;
+                    }
+                    if (param.offload) {
+                        int hdr_size = sizeof(virtio_net_hdr);
+                        if (ioctl(fd, TUNSETVNETHDRSZ, &hdr_size) == -1) {
+                            log_throw_last_system_error("ioctl");
+                            return;
+                        }
+                        // USO is left off: a UDP super packet would have to be cut
+                        // back into datagrams before lwIP anyway.
+                        unsigned int offload = TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6;
+                        if (ioctl(fd, TUNSETOFFLOAD, offload) == -1) {
+                            log_throw_last_system_error("ioctl");
+                            return;
+                        }
+                    }
+                    if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
+                        log_throw_last_system_error("ioctl");
+                        return;
+                    }
                 }
 
                 if (param.ipv4) {
-                    details::set_ipv4_address(param.tun_name,
+                    set_ipv4_address(param.tun_name,
                                               boost::asio::ip::make_address_v4(param.ipv4->addr),
                                               param.ipv4->prefix_length);
                 }
                 if (param.ipv6) {
-                    details::set_ipv6_address(
+                    set_ipv6_address(
                         param.tun_name,
                         boost::asio::ip::make_address_v6(param.ipv6->addr),
                         param.ipv6->prefix_length);
                 }
-                if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
-                    details::log_throw_last_system_error("ioctl");
-                    return;
-                }
-                if (ioctl(fd, TUNGETIFF, &ifr) < 0) {
-                    details::log_throw_last_system_error("ioctl");
-                    return;
-                }
-                ifr.ifr_flags |= IFF_UP;
 
                 ctl_skt = socket(AF_INET, SOCK_DGRAM, 0);
                 if (ctl_skt == -1) {
-                    details::log_throw_last_system_error("socket");
+                    log_throw_last_system_error("socket");
                     return;
                 }
 
+                ifreq ifr{0};
+                strcpy(ifr.ifr_name, param.tun_name.c_str());
+                if (ioctl(ctl_skt, SIOCGIFFLAGS, &ifr) < 0) {
+                    log_throw_last_system_error("ioctl");
+                    return;
+                }
+                ifr.ifr_flags |= IFF_UP;
                 if (ioctl(ctl_skt, SIOCSIFFLAGS, &ifr) < 0) {
-                    details::log_throw_last_system_error("ioctl");
+                    log_throw_last_system_error("ioctl");
                     return;
                 }
-
-                stream_descriptor_.assign(fd);
+                ifr.ifr_mtu = param.mtu;
+                if (ioctl(ctl_skt, SIOCSIFMTU, &ifr) < 0) {
+                    log_throw_last_system_error("ioctl");
+                    return;
+                }
+                if (ioctl(ctl_skt, SIOCGIFMTU, &ifr) < 0) {
+                    log_throw_last_system_error("ioctl");
+                    return;
+                }
+                mtu = ifr.ifr_mtu;
             }
             catch (const boost::system::system_error& system_error) {
-                if (fd != -1)
+                for (auto fd : fds)
                     ::close(fd);
+                fds.clear();
                 ec = system_error.code();
             }
 
             if (ctl_skt != -1)
                 ::close(ctl_skt);
         }
+    }  // namespace details
+
+    class tun_service_linux : public boost::asio::detail::service_base<tun_service_linux> {
+    public:
+        tun_service_linux(boost::asio::io_context& ioc)
+            : boost::asio::detail::service_base<tun_service_linux>(ioc)
+        {
+        }
+
+        inline void open(const parameter::tun_device& param, boost::system::error_code& ec)
+        {
+            std::vector<int> fds;
+            details::open_tun(param, fds, mtu_, ec);
+            if (ec)
+                return;
+
+            vnet_            = param.offload;
+            verify_checksum_ = param.verify_checksum;
+            for (auto fd : fds)
+                queues_.emplace_back(get_io_context(), fd);
+        }
 
         inline void close()
         {
             boost::system::error_code ec;
-            stream_descriptor_.close(ec);
+            for (auto& queue : queues_)
+                queue.close(ec);
+        }
+
+        inline std::size_t queue_count() const
+        {
+            return queues_.size();
+        }
+
+        template <typename Executor>
+        inline void bind_queue_executor(std::size_t queue, const Executor& ex)
+        {
+            auto& descriptor = queues_.at(queue);
+            descriptor       = boost::asio::posix::stream_descriptor(ex, descriptor.release());
         }
 
         template <typename MutableBufferSequence>
         boost::asio::awaitable<std::size_t> async_read_some(const MutableBufferSequence& buffers,
                                                             boost::system::error_code&   ec)
         {
-            auto bytes = co_await stream_descriptor_.async_read_some(buffers, net_awaitable[ec]);
+            return async_read_some(0, buffers, ec);
+        }
+        template <typename MutableBufferSequence>
+        boost::asio::awaitable<std::size_t> async_read_some(std::size_t                  queue,
+                                                            const MutableBufferSequence& buffers,
+                                                            boost::system::error_code&   ec)
+        {
+            if (!vnet_) {
+                auto bytes = co_await queues_.at(queue).async_read_some(buffers, net_awaitable[ec]);
+                co_return bytes;
+            }
+
+            details::virtio_net_hdr     hdr{};
+            boost::asio::mutable_buffer packet(*boost::asio::buffer_sequence_begin(buffers));
+
+            std::array<boost::asio::mutable_buffer, 2> vnet_buffers{boost::asio::buffer(&hdr, sizeof(hdr)),
+                                                                    packet};
+
+            // A read that doesn't carry a packet behind the header is dropped.
+            std::size_t bytes = 0;
+            while (bytes <= sizeof(hdr)) {
+                bytes = co_await queues_.at(queue).async_read_some(vnet_buffers, net_awaitable[ec]);
+                if (ec)
+                    co_return 0;
+            }
+
+            bytes -= sizeof(hdr);
+            if (verify_checksum_)
+                details::vnet_complete_checksum(hdr, boost::asio::buffer(packet, bytes));
             co_return bytes;
         }
         template <typename ConstBufferSequence>
         boost::asio::awaitable<std::size_t> async_write_some(const ConstBufferSequence& buffers,
                                                              boost::system::error_code& ec)
         {
-            auto bytes = co_await stream_descriptor_.async_write_some(buffers, net_awaitable[ec]);
-            co_return bytes;
+            if (!vnet_) {
+                auto bytes = co_await queues_.front().async_write_some(buffers, net_awaitable[ec]);
+                co_return bytes;
+            }
+
+            details::virtio_net_hdr                hdr;
+            std::array<uint8_t, 120>               headers;
+            std::vector<boost::asio::const_buffer> gather;
+            std::array<ConstBufferSequence, 1>     packet{buffers};
+
+            details::vnet_prepare_packets(packet.begin(), packet.end(), mtu_, hdr, headers, gather);
+
+            auto bytes = co_await queues_.front().async_write_some(gather, net_awaitable[ec]);
+            co_return bytes < sizeof(hdr) ? 0 : bytes - sizeof(hdr);
+        }
+        // Write a batch of packets, each a buffer sequence, with plain
+        // non-blocking writev calls, waiting for the fd only when the kernel
+        // pushes back. A packet the kernel rejects is dropped and reported
+        // through `ec`, the rest still goes out.
+        // Returns the number of packets written or dropped.
+        template <typename ConstBufferRange>
+        boost::asio::awaitable<std::size_t> async_write_packets(const ConstBufferRange&    packets,
+                                                                boost::system::error_code& ec)
+        {
+            auto& queue = queues_.front();
+
+            details::virtio_net_hdr                hdr;
+            std::array<uint8_t, 120>               headers;
+            std::vector<boost::asio::const_buffer> gather;
+            std::vector<iovec>                     iov;
+
+            std::size_t count = 0;
+            for (auto it = std::begin(packets), end = std::end(packets); it != end;) {
+                std::size_t used = 1;
+                gather.clear();
+                if (vnet_)
+                    used = details::vnet_prepare_packets(it, end, mtu_, hdr, headers, gather);
+                else
+                    details::append_packet(*it, 0, gather);
+
+                iov.clear();
+                for (const auto& buffer : gather)
+                    iov.push_back({const_cast<void*>(buffer.data()), buffer.size()});
+                auto bytes = ::writev(queue.native_handle(), iov.data(), int(iov.size()));
+
+                if (bytes < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        co_await queue.async_wait(boost::asio::posix::stream_descriptor::wait_write,
+                                                  net_awaitable[ec]);
+                        if (ec)
+                            co_return count;
+                        continue;
+                    }
+                    ec = boost::system::error_code(errno, boost::system::system_category());
+                }
+                count += used;
+                std::advance(it, used);
+            }
+            co_return count;
         }
 
     private:
-        boost::asio::posix::stream_descriptor stream_descriptor_;
+        std::vector<boost::asio::posix::stream_descriptor> queues_;
+        std::size_t                                        mtu_  = 1500;
+        bool                                               vnet_            = false;
+        bool                                               verify_checksum_ = false;
     };
 }  // namespace tuntap
 }  // namespace tun2socks
\ No newline at end of file
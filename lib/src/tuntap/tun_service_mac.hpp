@@ -271,6 +271,8 @@ public:
 
         if (fd < 0)
             details::log_throw_last_system_error("Can't find a tun entry");
+        if (!details::utun_set_mtu(fd, param.mtu))
+            spdlog::warn("Failed to set utun mtu: {0}", param.mtu);
         if (param.ipv4) {
             details::utun_set_if_ipv4_addr(fd, param.ipv4->addr, param.ipv4->prefix_length);
             details::utun_set_dns_servers(fd, param.ipv4->dns);
@@ -296,6 +298,20 @@ public:
         auto bytes = co_await stream_descriptor_.async_write_some(buffers, net_awaitable[ec]);
         co_return bytes;
     }
+    template <typename ConstBufferRange>
+    boost::asio::awaitable<std::size_t> async_write_packets(const ConstBufferRange&    packets,
+                                                            boost::system::error_code& ec)
+    {
+        std::size_t count = 0;
+        for (const auto& packet : packets) {
+            boost::system::error_code write_ec;
+            co_await stream_descriptor_.async_write_some(packet, net_awaitable[write_ec]);
+            if (write_ec)
+                ec = write_ec;
+            ++count;
+        }
+        co_return count;
+    }
 
 private:
     boost::asio::posix::stream_descriptor stream_descriptor_;
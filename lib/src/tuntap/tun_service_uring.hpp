@@ -0,0 +1,804 @@
+#pragma once
+
+#include "tun_service_linux.hpp"
+
+#include "pbuf.hpp"
+#include "use_awaitable.hpp"
+
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <vector>
+
+namespace tun2socks {
+namespace tuntap {
+
+    namespace details {
+        inline static int io_uring_setup(unsigned entries, io_uring_params* params)
+        {
+            return (int)::syscall(__NR_io_uring_setup, entries, params);
+        }
+        inline static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+        {
+            return (int)::syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+        }
+        inline static int io_uring_register(int fd, unsigned opcode, void* arg, unsigned nr_args)
+        {
+            return (int)::syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+        }
+
+        template <typename T>
+        inline static T load_acquire(T* ptr)
+        {
+            return std::atomic_ref<T>(*ptr).load(std::memory_order_acquire);
+        }
+        template <typename T>
+        inline static void store_release(T* ptr, T value)
+        {
+            std::atomic_ref<T>(*ptr).store(value, std::memory_order_release);
+        }
+
+        // Receive memory of one ring, carved from large chunks like
+        // wrapper::pbuf_pool. A slot the kernel filled leaves as a custom
+        // PBUF_REF pbuf and lwIP may free it on any stack thread, so freed
+        // slots go to a lock-free list the ring takes back with one exchange.
+        // The pool lives until the ring and every pbuf it handed out are gone.
+        class uring_buffer_pool {
+        public:
+            struct alignas(16) slot
+            {
+                struct pbuf_custom custom;
+                uring_buffer_pool* pool;
+                slot*              next;
+            };
+
+            explicit uring_buffer_pool(std::size_t slot_size)
+                : slot_size_(slot_size)
+            {
+            }
+
+            inline static uint8_t* data(slot* s)
+            {
+                return reinterpret_cast<uint8_t*>(s + 1);
+            }
+
+            // acquire() and recycle() belong to the ring's thread.
+            slot* acquire()
+            {
+                if (!free_)
+                    free_ = remote_free_.exchange(nullptr, std::memory_order_acquire);
+                if (!free_)
+                    grow();
+
+                auto s = free_;
+                free_  = s->next;
+                return s;
+            }
+            void recycle(slot* s)
+            {
+                s->next = free_;
+                free_   = s;
+            }
+
+            // Hands `length` bytes at `offset` of the slot out as a pbuf.
+            pbuf* alloc(slot* s, std::size_t offset, std::size_t length)
+            {
+                refs_.fetch_add(1, std::memory_order_relaxed);
+                s->custom.custom_free_function = &uring_buffer_pool::free_slot;
+                return pbuf_alloced_custom(PBUF_RAW,
+                                           static_cast<uint16_t>(length),
+                                           PBUF_REF,
+                                           &s->custom,
+                                           data(s) + offset,
+                                           static_cast<uint16_t>(slot_size_ - offset));
+            }
+
+            void release()
+            {
+                if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                    delete this;
+            }
+
+        private:
+            static constexpr std::size_t cache_line = 64;
+
+            static void free_slot(pbuf* p)
+            {
+                // The pbuf is the first member of the slot.
+                auto s    = reinterpret_cast<slot*>(p);
+                auto pool = s->pool;
+
+                s->next = pool->remote_free_.load(std::memory_order_relaxed);
+                while (!pool->remote_free_.compare_exchange_weak(s->next,
+                                                                 s,
+                                                                 std::memory_order_release,
+                                                                 std::memory_order_relaxed)) {
+                }
+                pool->release();
+            }
+
+            void grow()
+            {
+                std::size_t stride = (sizeof(slot) + slot_size_ + cache_line - 1) / cache_line * cache_line;
+                std::size_t count  = std::max<std::size_t>(1, (1 << 20) / stride);
+
+                auto& chunk = chunks_.emplace_back(new (std::align_val_t(cache_line)) uint8_t[stride * count]);
+                for (std::size_t i = 0; i < count; ++i) {
+                    auto s  = new (chunk.get() + i * stride) slot{};
+                    s->pool = this;
+                    s->next = free_;
+                    free_   = s;
+                }
+            }
+
+            struct chunk_deleter
+            {
+                void operator()(uint8_t* p) const
+                {
+                    ::operator delete[](p, std::align_val_t(cache_line));
+                }
+            };
+
+        private:
+            std::vector<std::unique_ptr<uint8_t[], chunk_deleter>> chunks_;
+            std::size_t                                            slot_size_;
+            slot*                                                  free_ = nullptr;
+            std::atomic<slot*>                                     remote_free_{nullptr};
+            std::atomic<std::size_t>                               refs_{1};
+        };
+    }  // namespace details
+
+    // Drives the TUN fds through io_uring instead of epoll + read/write, one
+    // ring per queue so every queue is drained on the thread it is bound to:
+    //  - several reads stay in flight and pick their memory from a provided
+    //    buffer ring, a packet is handed to lwIP as a custom pbuf over that
+    //    memory and the ring gets a fresh buffer in its place;
+    //  - a batch of writes goes to the kernel with one io_uring_enter as
+    //    writev SQEs over the callers' buffers, a write completes with its CQE.
+    // Completions are signalled through an eventfd waited on by the io_context.
+    // Writes go through the ring of the first queue and run on its executor.
+    class tun_service_uring : public boost::asio::detail::service_base<tun_service_uring> {
+        static constexpr unsigned ring_entries    = 256;
+        static constexpr unsigned reads_per_queue = 8;
+        static constexpr uint16_t buffer_group    = 0;
+        static constexpr uint64_t read_tag        = uint64_t(1) << 63;
+
+        using buffer_pool = details::uring_buffer_pool;
+
+        struct completed_read
+        {
+            buffer_pool::slot* slot;
+            std::size_t        len;
+        };
+
+        // Owned by the writer until its CQE arrived, the kernel reads the
+        // iovecs and headers from here.
+        struct write_op
+        {
+            details::virtio_net_hdr  hdr;
+            std::array<uint8_t, 120> headers;
+            std::vector<iovec>       iov;
+            std::size_t              packets = 1;
+            int                      res     = 0;
+            bool                     done    = false;
+        };
+
+        class ring {
+        public:
+            ring(const boost::asio::any_io_executor& ex,
+                 int                                 fd,
+                 std::size_t                         header_size,
+                 std::size_t                         buffer_size,
+                 unsigned                            buffer_count)
+                : event_(ex),
+                  wake_(ex, boost::asio::steady_timer::time_point::max()),
+                  fd_(fd),
+                  header_size_(header_size),
+                  // Leaves the IP header of a vnet read 16 byte aligned.
+                  lead_((16 - header_size % 16) % 16),
+                  buffer_size_(buffer_size),
+                  buffer_count_(buffer_count)
+            {
+            }
+            ~ring()
+            {
+                close();
+            }
+
+            void open()
+            {
+                setup_ring();
+                setup_buffer_ring();
+                setup_event();
+
+                for (unsigned i = 0; i < reads_per_queue; ++i)
+                    prepare_read();
+                submit();
+            }
+            void close()
+            {
+                boost::system::error_code ec;
+                event_.close(ec);
+                wake_.cancel();
+
+                if (fd_ != -1) {
+                    ::close(fd_);
+                    fd_ = -1;
+                }
+                if (ring_fd_ != -1) {
+                    ::close(ring_fd_);
+                    ring_fd_ = -1;
+                }
+                if (sqes_)
+                    munmap(sqes_, sqes_size_);
+                if (cq_ring_ && cq_ring_ != sq_ring_)
+                    munmap(cq_ring_, cq_ring_size_);
+                if (sq_ring_)
+                    munmap(sq_ring_, sq_ring_size_);
+                if (buf_ring_)
+                    munmap(buf_ring_, buf_ring_size_);
+
+                sqes_     = nullptr;
+                cq_ring_  = nullptr;
+                sq_ring_  = nullptr;
+                buf_ring_ = nullptr;
+                completed_.clear();
+                bid_slots_.clear();
+
+                // Pbufs still out keep the pool alive.
+                if (pool_) {
+                    pool_->release();
+                    pool_ = nullptr;
+                }
+            }
+            bool is_open() const
+            {
+                return ring_fd_ != -1;
+            }
+
+            template <typename Executor>
+            void bind_executor(const Executor& ex)
+            {
+                event_ = boost::asio::posix::stream_descriptor(ex, event_.release());
+                wake_  = boost::asio::steady_timer(ex, boost::asio::steady_timer::time_point::max());
+            }
+
+            // Waits until the ring made progress. One waiter polls the eventfd
+            // and reaps, the others wait on wake_ which every reap cancels.
+            boost::asio::awaitable<void> wait(boost::system::error_code& ec)
+            {
+                if (polling_) {
+                    boost::system::error_code ignored;
+                    co_await wake_.async_wait(net_awaitable[ignored]);
+                }
+                else {
+                    polling_ = true;
+                    co_await event_.async_wait(boost::asio::posix::stream_descriptor::wait_read,
+                                               net_awaitable[ec]);
+                    polling_ = false;
+                    if (!ec) {
+                        uint64_t count = 0;
+                        ::read(event_.native_handle(), &count, sizeof(count));
+                        reap();
+                    }
+                    else if (is_open()) {
+                        // Without its eventfd the ring can't make progress,
+                        // nothing may be left in flight for the waiters.
+                        spdlog::warn("io_uring eventfd wait failed: {0}", ec.message());
+                        close();
+                    }
+                    else
+                        wake_.cancel();
+                }
+                if (!is_open())
+                    ec = boost::asio::error::operation_aborted;
+            }
+
+            bool pop_read(completed_read& read)
+            {
+                if (completed_.empty())
+                    return false;
+
+                read = completed_.front();
+                completed_.pop_front();
+                return true;
+            }
+            const boost::system::error_code& read_error() const
+            {
+                return read_error_;
+            }
+            // The kernel's view of a slot, the virtio header comes first.
+            uint8_t* buffer(buffer_pool::slot* s) const
+            {
+                return buffer_pool::data(s) + lead_;
+            }
+            // The packet read into `s`, `len` bytes with the header.
+            wrapper::pbuf_buffer packet(buffer_pool::slot* s, std::size_t len)
+            {
+                return wrapper::pbuf_buffer::adopt(pool_->alloc(s, lead_ + header_size_, len - header_size_));
+            }
+            void recycle(buffer_pool::slot* s)
+            {
+                pool_->recycle(s);
+            }
+
+            // Reads keep reads_per_queue entries for themselves, together the
+            // in-flight requests never outgrow the completion queue.
+            bool write_room() const
+            {
+                return is_open() && writes_ < ring_entries - reads_per_queue &&
+                       sq_local_ - details::load_acquire(sq_head_) < sq_entries_;
+            }
+            bool prepare_write(write_op& op)
+            {
+                auto sqe = get_sqe();
+                if (!sqe)
+                    return false;
+
+                sqe->opcode    = IORING_OP_WRITEV;
+                sqe->fd        = fd_;
+                sqe->addr      = reinterpret_cast<uint64_t>(op.iov.data());
+                sqe->len       = uint32_t(op.iov.size());
+                sqe->user_data = reinterpret_cast<uint64_t>(&op);
+                commit_sqe();
+                ++writes_;
+                return true;
+            }
+            void submit()
+            {
+                if (sq_pending_ == 0 || ring_fd_ == -1)
+                    return;
+
+                auto ret = details::io_uring_enter(ring_fd_, sq_pending_, 0, 0);
+                if (ret < 0) {
+                    if (errno != EAGAIN && errno != EBUSY && errno != EINTR)
+                        details::log_last_system_error("io_uring_enter");
+                    return;
+                }
+                sq_pending_ -= std::min<unsigned>(ret, sq_pending_);
+            }
+            void reap()
+            {
+                if (!cq_ring_)
+                    return;
+
+                auto head = *cq_head_;
+                auto tail = details::load_acquire(cq_tail_);
+                if (head == tail)
+                    return;
+
+                for (; head != tail; ++head) {
+                    const auto& cqe = cqes_[head & cq_mask_];
+                    if (cqe.user_data == read_tag)
+                        on_read(cqe);
+                    else
+                        on_write(*reinterpret_cast<write_op*>(cqe.user_data), cqe);
+                }
+                details::store_release(cq_head_, head);
+
+                for (; unarmed_reads_ > 0 && get_sqe_room(); --unarmed_reads_)
+                    prepare_read();
+                submit();
+                wake_.cancel();
+            }
+
+        private:
+            void setup_ring()
+            {
+                io_uring_params params{};
+                ring_fd_ = details::io_uring_setup(ring_entries, &params);
+                if (ring_fd_ < 0)
+                    details::log_throw_last_system_error("io_uring_setup");
+
+                sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+                cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+                if (params.features & IORING_FEAT_SINGLE_MMAP)
+                    sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+
+                sq_ring_ = map_ring(sq_ring_size_, IORING_OFF_SQ_RING);
+                cq_ring_ = (params.features & IORING_FEAT_SINGLE_MMAP) ? sq_ring_
+                                                                       : map_ring(cq_ring_size_, IORING_OFF_CQ_RING);
+                sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+                sqes_      = static_cast<io_uring_sqe*>(map_ring(sqes_size_, IORING_OFF_SQES));
+
+                auto sq = static_cast<uint8_t*>(sq_ring_);
+                sq_head_    = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+                sq_tail_    = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+                sq_mask_    = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+                sq_entries_ = params.sq_entries;
+                sq_array_   = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+                sq_local_   = *sq_tail_;
+
+                auto cq  = static_cast<uint8_t*>(cq_ring_);
+                cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+                cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+                cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+                cqes_    = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+            }
+            void* map_ring(std::size_t size, off_t offset)
+            {
+                auto ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, offset);
+                if (ptr == MAP_FAILED)
+                    details::log_throw_last_system_error("mmap");
+                return ptr;
+            }
+            void setup_buffer_ring()
+            {
+                buf_ring_size_ = buffer_count_ * sizeof(io_uring_buf);
+                auto ptr       = mmap(nullptr, buf_ring_size_, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+                if (ptr == MAP_FAILED)
+                    details::log_throw_last_system_error("mmap");
+                buf_ring_ = static_cast<io_uring_buf*>(ptr);
+
+                io_uring_buf_reg reg{};
+                reg.ring_addr    = reinterpret_cast<uint64_t>(buf_ring_);
+                reg.ring_entries = buffer_count_;
+                reg.bgid         = buffer_group;
+                if (details::io_uring_register(ring_fd_, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+                    details::log_throw_last_system_error("io_uring_register");
+
+                pool_ = new buffer_pool(lead_ + buffer_size_);
+                bid_slots_.resize(buffer_count_);
+                buf_tail_ = 0;
+                for (unsigned bid = 0; bid < buffer_count_; ++bid)
+                    provide_buffer(uint16_t(bid), pool_->acquire());
+            }
+            void setup_event()
+            {
+                int efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+                if (efd < 0)
+                    details::log_throw_last_system_error("eventfd");
+                event_.assign(efd);
+
+                if (details::io_uring_register(ring_fd_, IORING_REGISTER_EVENTFD, &efd, 1) < 0)
+                    details::log_throw_last_system_error("io_uring_register");
+            }
+
+            bool get_sqe_room()
+            {
+                return sq_local_ - details::load_acquire(sq_head_) < sq_entries_;
+            }
+            io_uring_sqe* get_sqe()
+            {
+                if (!get_sqe_room()) {
+                    submit();
+                    if (!get_sqe_room())
+                        return nullptr;
+                }
+                auto index = sq_local_ & sq_mask_;
+                auto sqe   = &sqes_[index];
+                std::memset(sqe, 0, sizeof(*sqe));
+                sq_array_[index] = index;
+                return sqe;
+            }
+            void commit_sqe()
+            {
+                details::store_release(sq_tail_, ++sq_local_);
+                ++sq_pending_;
+            }
+
+            void prepare_read()
+            {
+                auto sqe = get_sqe();
+                if (!sqe) {
+                    ++unarmed_reads_;
+                    return;
+                }
+                sqe->opcode    = IORING_OP_READ;
+                sqe->fd        = fd_;
+                sqe->flags     = IOSQE_BUFFER_SELECT;
+                sqe->buf_group = buffer_group;
+                sqe->len       = uint32_t(buffer_size_);
+                sqe->user_data = read_tag;
+                commit_sqe();
+            }
+            void provide_buffer(uint16_t bid, buffer_pool::slot* s)
+            {
+                bid_slots_[bid] = s;
+
+                // Index the entries by hand, in C++ the header's flexible
+                // array member ends up one empty struct past the ring start.
+                auto& buf = buf_ring_[buf_tail_ & (buffer_count_ - 1)];
+                buf.addr  = reinterpret_cast<uint64_t>(buffer(s));
+                buf.len   = uint32_t(buffer_size_);
+                buf.bid   = bid;
+                details::store_release(&reinterpret_cast<io_uring_buf_ring*>(buf_ring_)->tail, ++buf_tail_);
+            }
+            void on_read(const io_uring_cqe& cqe)
+            {
+                if (cqe.res >= 0 && (cqe.flags & IORING_CQE_F_BUFFER)) {
+                    // The filled slot leaves the ring, a free one takes its bid.
+                    auto bid = uint16_t(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+                    completed_.push_back({bid_slots_[bid], std::size_t(cqe.res)});
+                    provide_buffer(bid, pool_->acquire());
+                    prepare_read();
+                    return;
+                }
+                switch (-cqe.res) {
+                    case ENOBUFS:
+                    case EINTR:
+                    case EAGAIN: prepare_read(); break;
+                    default:
+                        read_error_ = boost::system::error_code(-cqe.res, boost::system::system_category());
+                        break;
+                }
+            }
+            void on_write(write_op& op, const io_uring_cqe& cqe)
+            {
+                --writes_;
+                op.res  = cqe.res;
+                op.done = true;
+            }
+
+        private:
+            boost::asio::posix::stream_descriptor event_;
+            boost::asio::steady_timer             wake_;
+            bool                                  polling_ = false;
+
+            int         fd_;
+            std::size_t header_size_;
+            std::size_t lead_;
+            std::size_t buffer_size_;
+            unsigned    buffer_count_;
+
+            int           ring_fd_      = -1;
+            void*         sq_ring_      = nullptr;
+            void*         cq_ring_      = nullptr;
+            io_uring_sqe* sqes_         = nullptr;
+            std::size_t   sq_ring_size_ = 0;
+            std::size_t   cq_ring_size_ = 0;
+            std::size_t   sqes_size_    = 0;
+            unsigned*     sq_head_      = nullptr;
+            unsigned*     sq_tail_      = nullptr;
+            unsigned*     sq_array_     = nullptr;
+            unsigned      sq_mask_      = 0;
+            unsigned      sq_entries_   = 0;
+            unsigned      sq_local_     = 0;
+            unsigned      sq_pending_   = 0;
+            unsigned*     cq_head_      = nullptr;
+            unsigned*     cq_tail_      = nullptr;
+            unsigned      cq_mask_      = 0;
+            io_uring_cqe* cqes_         = nullptr;
+
+            io_uring_buf*                   buf_ring_      = nullptr;
+            std::size_t                     buf_ring_size_ = 0;
+            uint16_t                        buf_tail_      = 0;
+            buffer_pool*                    pool_          = nullptr;
+            std::vector<buffer_pool::slot*> bid_slots_;
+            std::deque<completed_read>      completed_;
+            unsigned                        unarmed_reads_ = 0;
+            boost::system::error_code       read_error_;
+            unsigned                        writes_ = 0;
+        };
+
+    public:
+        tun_service_uring(boost::asio::io_context& ioc)
+            : boost::asio::detail::service_base<tun_service_uring>(ioc)
+        {
+        }
+        ~tun_service_uring()
+        {
+            close();
+        }
+
+        inline void open(const parameter::tun_device& param, boost::system::error_code& ec)
+        {
+            std::vector<int> fds;
+            details::open_tun(param, fds, mtu_, ec);
+            if (ec)
+                return;
+
+            vnet_            = param.offload;
+            verify_checksum_ = param.verify_checksum;
+
+            // Every ring owns its fd from here on.
+            auto buffer_size  = (vnet_ ? 0xffff : mtu_) + header_size();
+            auto buffer_count = vnet_ ? 64 : ring_entries;
+            for (auto fd : fds)
+                rings_.push_back(std::make_unique<ring>(get_io_context().get_executor(),
+                                                        fd,
+                                                        header_size(),
+                                                        buffer_size,
+                                                        buffer_count));
+            try {
+                for (std::size_t queue = 0; queue < fds.size(); ++queue) {
+                    // io_uring polls the fd by itself, O_NONBLOCK would only turn
+                    // every idle read into an -EAGAIN completion.
+                    if (fcntl(fds[queue], F_SETFL, 0) < 0)
+                        details::log_throw_last_system_error("fcntl");
+                    rings_[queue]->open();
+                }
+            }
+            catch (const boost::system::system_error& system_error) {
+                rings_.clear();
+                ec = system_error.code();
+            }
+        }
+
+        // The rings stay until the service goes away, waiters resume on them
+        // with operation_aborted.
+        inline void close()
+        {
+            for (auto& r : rings_)
+                r->close();
+        }
+
+        inline std::size_t queue_count() const
+        {
+            return rings_.size();
+        }
+
+        template <typename Executor>
+        inline void bind_queue_executor(std::size_t queue, const Executor& ex)
+        {
+            rings_.at(queue)->bind_executor(ex);
+        }
+
+        boost::asio::awaitable<wrapper::pbuf_buffer> async_read_packet(boost::system::error_code& ec)
+        {
+            return async_read_packet(0, ec);
+        }
+        // The packet stays in the ring's memory, no copy is made.
+        boost::asio::awaitable<wrapper::pbuf_buffer> async_read_packet(std::size_t                queue,
+                                                                       boost::system::error_code& ec)
+        {
+            auto& r = *rings_.at(queue);
+            for (;;) {
+                completed_read read;
+                if (r.pop_read(read)) {
+                    // A read that doesn't carry a packet behind the header is dropped.
+                    if (vnet_) {
+                        if (read.len <= sizeof(details::virtio_net_hdr)) {
+                            r.recycle(read.slot);
+                            continue;
+                        }
+                        details::virtio_net_hdr hdr;
+                        std::memcpy(&hdr, r.buffer(read.slot), sizeof(hdr));
+                        if (verify_checksum_)
+                            details::vnet_complete_checksum(hdr,
+                                                            boost::asio::buffer(r.buffer(read.slot) + sizeof(hdr),
+                                                                                read.len - sizeof(hdr)));
+                    }
+                    co_return r.packet(read.slot, read.len);
+                }
+                if (r.read_error()) {
+                    ec = r.read_error();
+                    co_return wrapper::pbuf_buffer();
+                }
+
+                co_await r.wait(ec);
+                if (ec)
+                    co_return wrapper::pbuf_buffer();
+            }
+        }
+
+        template <typename MutableBufferSequence>
+        boost::asio::awaitable<std::size_t> async_read_some(const MutableBufferSequence& buffers,
+                                                            boost::system::error_code&   ec)
+        {
+            return async_read_some(0, buffers, ec);
+        }
+        template <typename MutableBufferSequence>
+        boost::asio::awaitable<std::size_t> async_read_some(std::size_t                  queue,
+                                                            const MutableBufferSequence& buffers,
+                                                            boost::system::error_code&   ec)
+        {
+            auto packet = co_await async_read_packet(queue, ec);
+            if (ec)
+                co_return 0;
+            co_return boost::asio::buffer_copy(buffers, packet.const_data());
+        }
+
+        template <typename ConstBufferSequence>
+        boost::asio::awaitable<std::size_t> async_write_some(const ConstBufferSequence& buffers,
+                                                             boost::system::error_code& ec)
+        {
+            auto& r = *rings_.front();
+
+            write_op                           op;
+            std::array<ConstBufferSequence, 1> packet{buffers};
+            prepare_packets(op, packet.begin(), packet.end());
+
+            while (!r.write_room() || !r.prepare_write(op)) {
+                co_await r.wait(ec);
+                if (ec)
+                    co_return 0;
+            }
+            r.submit();
+            r.reap();
+            while (!op.done) {
+                co_await r.wait(ec);
+                if (ec)
+                    co_return 0;
+            }
+            if (op.res < 0) {
+                ec = boost::system::error_code(-op.res, boost::system::system_category());
+                co_return 0;
+            }
+            co_return std::size_t(op.res) < header_size() ? 0 : op.res - header_size();
+        }
+        // Queue one writev per packet, or per merged group in vnet mode, and
+        // submit them together. The packets' buffers are written in place and
+        // must stay valid until this returns, which is once every write
+        // completed. A full ring is waited out. A packet the kernel rejects
+        // is dropped and reported through `ec`, the rest still goes out.
+        // Returns the number of packets the device is done with.
+        template <typename ConstBufferRange>
+        boost::asio::awaitable<std::size_t> async_write_packets(const ConstBufferRange&    packets,
+                                                                boost::system::error_code& ec)
+        {
+            auto& r = *rings_.front();
+
+            std::vector<write_op> ops;
+            ops.reserve(std::distance(std::begin(packets), std::end(packets)));
+
+            std::size_t count = 0;
+            std::size_t done  = 0;
+            for (auto it = std::begin(packets), end = std::end(packets);;) {
+                for (; it != end && r.write_room(); std::advance(it, ops.back().packets)) {
+                    auto& op = ops.emplace_back();
+                    prepare_packets(op, it, end);
+                    if (!r.prepare_write(op)) {
+                        ops.pop_back();
+                        break;
+                    }
+                }
+                r.submit();
+                r.reap();
+
+                for (; done < ops.size() && ops[done].done; ++done) {
+                    if (ops[done].res < 0)
+                        ec = boost::system::error_code(-ops[done].res, boost::system::system_category());
+                    count += ops[done].packets;
+                }
+                if (it == end && done == ops.size())
+                    break;
+                // The writes reaped above may have made room for the rest.
+                if (it != end && r.write_room())
+                    continue;
+
+                boost::system::error_code wait_ec;
+                co_await r.wait(wait_ec);
+                if (wait_ec) {
+                    ec = wait_ec;
+                    break;
+                }
+            }
+            co_return count;
+        }
+
+    private:
+        inline std::size_t header_size() const
+        {
+            return vnet_ ? sizeof(details::virtio_net_hdr) : 0;
+        }
+
+        template <typename Iterator>
+        void prepare_packets(write_op& op, Iterator it, Iterator end)
+        {
+            gather_.clear();
+            if (vnet_)
+                op.packets = details::vnet_prepare_packets(it, end, mtu_, op.hdr, op.headers, gather_);
+            else
+                details::append_packet(*it, 0, gather_);
+
+            op.iov.clear();
+            for (const auto& buffer : gather_)
+                op.iov.push_back({const_cast<void*>(buffer.data()), buffer.size()});
+        }
+
+    private:
+        std::vector<std::unique_ptr<ring>>     rings_;
+        std::size_t                            mtu_             = 1500;
+        bool                                   vnet_            = false;
+        bool                                   verify_checksum_ = false;
+        std::vector<boost::asio::const_buffer> gather_;
+    };
+}  // namespace tuntap
+}  // namespace tun2socks
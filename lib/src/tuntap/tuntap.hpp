@@ -8,7 +8,11 @@
 #elif defined(OS_MACOS)
 #    include "tun_service_mac.hpp"
 #elif defined(OS_LINUX)
-#    include "tun_service_linux.hpp"
+#    ifdef TUN2SOCKS_IO_URING
+#        include "tun_service_uring.hpp"
+#    else
+#        include "tun_service_linux.hpp"
+#    endif
 #endif
 namespace tun2socks {
 
@@ -19,7 +23,11 @@ namespace tuntap {
 #elif defined(OS_MACOS)
     using tuntap = basic_tuntap<tun_service_mac>;
 #elif defined(OS_LINUX)
+#    ifdef TUN2SOCKS_IO_URING
+    using tuntap = basic_tuntap<tun_service_uring>;
+#    else
     using tuntap = basic_tuntap<tun_service_linux>;
+#    endif
 #endif
 
 }  // namespace tuntap
@@ -311,6 +311,27 @@ namespace wintun {
                     details::SetIpv6DnsServers(details::InterfaceLuidToGuidString(AddressRow.InterfaceLuid), param.ipv6->dns);
                 }
 
+                for (auto family : {AF_INET, AF_INET6}) {
+                    if ((family == AF_INET && !param.ipv4) || (family == AF_INET6 && !param.ipv6))
+                        continue;
+
+                    MIB_IPINTERFACE_ROW InterfaceRow;
+                    InitializeIpInterfaceEntry(&InterfaceRow);
+
+                    library_->WintunGetAdapterLUID(wintun_adapter_, &InterfaceRow.InterfaceLuid);
+                    InterfaceRow.Family = family;
+
+                    auto LastError = GetIpInterfaceEntry(&InterfaceRow);
+                    if (LastError != ERROR_SUCCESS)
+                        details::log_throw_system_error("Failed to get interface", LastError);
+
+                    InterfaceRow.NlMtu            = param.mtu;
+                    InterfaceRow.SitePrefixLength = 0; /* Must be zero for IPv4 */
+                    LastError                     = SetIpInterfaceEntry(&InterfaceRow);
+                    if (LastError != ERROR_SUCCESS)
+                        details::log_throw_system_error("Failed to set MTU", LastError);
+                }
+
                 auto Session = library_->WintunStartSession(wintun_adapter_, 0x400000);
                 if (!Session)
                     details::log_throw_last_system_error("Failed to create adapter");
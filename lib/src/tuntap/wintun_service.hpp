@@ -64,6 +64,20 @@ namespace tuntap {
             }
             co_return boost::asio::buffer_size(buffers);
         }
+        template <typename ConstBufferRange>
+        boost::asio::awaitable<std::size_t> async_write_packets(const ConstBufferRange&    packets,
+                                                                boost::system::error_code& ec)
+        {
+            std::size_t count = 0;
+            for (const auto& packet : packets) {
+                boost::system::error_code send_ec;
+                wintun_session_->send_packets(packet, send_ec);
+                if (send_ec)
+                    ec = send_ec;
+                ++count;
+            }
+            co_return count;
+        }
 
     private:
         boost::asio::windows::object_handle receive_event_;
@@ -59,7 +59,8 @@ protected:
                 for (;;) {
                     reset_timeout_timer();
 
-                    wrapper::pbuf_buffer buffer(4096);
+                    // Leave room for the headers so the reply is sent in place.
+                    wrapper::pbuf_buffer buffer(4096, pbuf_layer::PBUF_TRANSPORT);
 
                     auto bytes = co_await socket_->async_receive_from(buffer.mutable_data(),
                                                                       proxy_endpoint_,
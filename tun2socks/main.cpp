@@ -1,6 +1,9 @@
 #include <fcntl.h>
 
+#include <charconv>
+#include <limits>
 #include <locale>
+#include <stdexcept>
 #include <tun2socks/core.h>
 
 #ifdef OS_WINDOWS
@@ -10,6 +13,18 @@
 
 #include "argparse.hpp"
 
+// Parses an integer option, rejecting anything that isn't a whole number in [min, max].
+static int parse_int(const std::string& value, int min, int max, const char* name)
+{
+    int         result = 0;
+    const char* end    = value.data() + value.size();
+    auto        parsed = std::from_chars(value.data(), end, result);
+    if (parsed.ec != std::errc() || parsed.ptr != end || result < min || result > max)
+        throw std::invalid_argument(std::string(name) + " must be between " + std::to_string(min) +
+                                    " and " + std::to_string(max) + ", got \"" + value + "\"");
+    return result;
+}
+
 int main(int argc, char** argv)
 {
 #ifdef OS_WINDOWS
@@ -35,6 +50,40 @@ int main(int argc, char** argv)
     program.add_argument("-tip6dns", "--tunIP6DNS")
         .help("The IPV6 DNS address of the TUN interface. Example( 2606:4700:4700::1111 )");
 
+    program.add_argument("-tmtu", "--tunMTU")
+        .help("The MTU of the TUN interface, up to 65535 for local-only paths. Default( 1500 )")
+        .default_value(1500)
+        .action([](const std::string& mtu) { return parse_int(mtu, 576, 65535, "--tunMTU"); });
+
+    program.add_argument("-tq", "--tunQueues")
+        .help("The number of TUN queues, each read on its own thread (Linux only). Default( 1 )")
+        .default_value(1)
+        .action([](const std::string& queues) {
+            return parse_int(queues, 1, std::numeric_limits<uint16_t>::max(), "--tunQueues");
+        });
+
+    program.add_argument("-ts", "--stacks")
+        .help("The number of lwIP stacks, each running on its own thread. Flows are spread over them by hash. Default( 1 )")
+        .default_value(1)
+        .action([](const std::string& stacks) {
+            return parse_int(stacks, 1, std::numeric_limits<uint16_t>::max(), "--stacks");
+        });
+
+    program.add_argument("-toff", "--tunOffload")
+        .help("Enable IFF_VNET_HDR checksum/TSO offload on the TUN interface (Linux only).")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("-tcsum", "--tunVerifyChecksum")
+        .help("Verify the checksums of packets read from the TUN interface, which come from the local kernel.")
+        .default_value(false)
+        .implicit_value(true);
+
+    program.add_argument("-tcba", "--tcpConnectBeforeAccept")
+        .help("Answer a TCP SYN only once the upstream connection succeeded, and with a RST if it failed.")
+        .default_value(false)
+        .implicit_value(true);
+
     program.add_argument("-s5proxy", "--socks5Proxy")
         .help("The URL of your socks5 server. Default( socks5://127.0.0.1:1080 )")
         .default_value(std::string("socks5://127.0.0.1:1080"));
@@ -55,7 +104,13 @@ int main(int argc, char** argv)
     try {
         program.parse_args(argc, argv);
 
-        tun_param.tun_name = program.get<std::string>("-tname");
+        tun_param.tun_name              = program.get<std::string>("-tname");
+        tun_param.mtu                   = program.get<int>("-tmtu");
+        tun_param.queues                = program.get<int>("-tq");
+        tun_param.stacks                = program.get<int>("-ts");
+        tun_param.offload               = program.get<bool>("-toff");
+        tun_param.verify_checksum       = program.get<bool>("-tcsum");
+        tun_param.connect_before_accept = program.get<bool>("-tcba");
 
         auto tip4 = program.get<std::string>("-tip4");
 